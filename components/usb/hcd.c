@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include <string.h>
+#include <stdatomic.h>
 #include <sys/queue.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -39,12 +40,46 @@
  *
  * Control: Requires 3 transfer descriptors for a single transfer
  *          corresponding to each stage of a control transfer
- * Bulk: Requires 1 transfer descriptor for each transfer
+ * Bulk: Requires 1 transfer descriptor for each transfer. Up to XFER_LIST_LEN_BULK pending IRPs are loaded into the
+ *       list at once so that the channel executes them back to back, and only interrupts once at the end of the batch.
+ *       Bulk IN pipes with a poll window (see hcd_pipe_config_t.nak_poll_frames) split each IRP across up to
+ *       NUM_DESC_PER_XFER_BULK_POLL descriptors of whole packets instead, as the channel's descriptor index is the only
+ *       measure of the bytes received so far (see pipe_poll_timer_cb())
+ * Interrupt: Requires 1 transfer descriptor per packet, as the channel only executes one packet per service
+ *            interval. XFER_LIST_LEN_INTR is therefore the maximum number of packets in a single interrupt IRP
+ * Isochronous: Requires 1 transfer descriptor per frame. The channel picks the descriptor by the frame number (i.e.,
+ *              frame & (XFER_LIST_LEN_ISOC - 1)), so an IRP's packets are filled from the descriptor of the frame it
+ *              starts in, wrapping around the end of the list. Each packet is followed by (interval - 1) NULL
+ *              descriptors for the frames the pipe is not scheduled in. A single IRP can therefore span
+ *              XFER_LIST_LEN_ISOC frames, and only interrupts once its last packet is done
  */
 #define NUM_DESC_PER_XFER_CTRL      3
 #define NUM_DESC_PER_XFER_BULK      1
+#define NUM_DESC_PER_XFER_BULK_POLL 16
+#define NUM_DESC_PER_XFER_INTR      1
+#define NUM_DESC_PER_XFER_ISOC      1
 #define XFER_LIST_LEN_CTRL          1
-#define XFER_LIST_LEN_BULK          1
+#define XFER_LIST_LEN_BULK          4
+#define XFER_LIST_LEN_INTR          32
+#define XFER_LIST_LEN_ISOC          32
+
+/**
+ * @brief Deferred event delivery (see hcd_port_config_t.defer_task_priority)
+ *
+ * The ISR records events into a ring of DEFER_RING_LEN entries (must be a power of 2), which the port's bottom half
+ * task drains in batches. If the ring is ever full, the ISR drops the event, and only remembers the latest dropped event
+ * of each pipe (and of the port). The task then rescans the port's pipes and delivers those (see defer_task()).
+ */
+#define DEFER_RING_LEN              32
+#define DEFER_TASK_STACK_SIZE       3072
+
+/**
+ * @brief Length of the periodic frame list
+ *
+ * Each entry of the frame list represents a frame, and has a bit for each channel that should be scheduled in that
+ * frame. A periodic pipe's interval is therefore capped to the frame list's length.
+ */
+#define FRAME_LIST_LEN              USB_HAL_FRAME_LIST_LEN_32
 
 #define INIT_DELAY_MS               30      //A delay of at least 25ms to enter Host mode. Make it 30ms to be safe
 #define DEBOUNCE_DELAY_MS           250     //A debounce delay of 250ms
@@ -52,6 +87,7 @@
 #define RESET_RECOVERY_MS           30      //Reset recovery delay of 10ms (make it 30 ms to be safe) to allow for connected device to recover (and for port enabled interrupt to occur)
 #define RESUME_HOLD_MS              30      //Spec requires at least 20ms, Make it 30ms to be safe
 #define RESUME_RECOVERY_MS          20      //Resume recovery of at least 10ms. Make it 20 ms to be safe. This will include the 3 LS bit times of the EOP
+#define FRAME_PERIOD_US             1000    //A (micro)frame at FS/LS is 1ms
 
 #define CTRL_EP_MAX_MPS_LS          8       //Largest Maximum Packet Size for Low Speed control endpoints
 #define CTRL_EP_MAX_MPS_FS          64      //Largest Maximum Packet Size for Full Speed control endpoints
@@ -73,6 +109,7 @@
 #define IRP_STATE_MASK         0x3     //Bit mask of all the IRP state flags
 #define IRP_STATE_SET(reserved_flags, state)    (reserved_flags = (reserved_flags & ~IRP_STATE_MASK) | state)
 #define IRP_STATE_GET(reserved_flags)           (reserved_flags & IRP_STATE_MASK)
+#define IRP_FLAG_ABORT         0x4     //An abort was requested whilst the IRP was in flight
 
 
 // -------------------- Convenience ------------------------
@@ -99,6 +136,14 @@
 typedef struct pipe_obj pipe_t;
 typedef struct port_obj port_t;
 
+/**
+ * @brief An event recorded by the ISR for the bottom half task to deliver
+ */
+typedef struct {
+    pipe_t *pipe;   //Pipe of a pipe event, or NULL for a port event
+    int event;      //hcd_pipe_event_t or hcd_port_event_t. Set to NONE if the event was dropped (e.g., the pipe was freed)
+} defer_event_t;
+
 /**
  * @brief Object representing a pipe in the HCD layer
  */
@@ -109,16 +154,35 @@ struct pipe_obj {
     int num_irp_pending;
     int num_irp_done;
     usb_irp_t *inflight_irp;  //Pointer to the in-flight IRP (i.e., the IRP currently being executed). NULL if none.
+    TAILQ_HEAD(tailhead_irp_chained, usb_irp_obj) chained_irp_tailq;   //IRPs filled after inflight_irp in the same descriptor list
+    int num_irp_chained;
     //Port related
     port_t *port;                       //The port to which this pipe is routed through
     TAILQ_ENTRY(pipe_obj) tailq_entry;  //TailQ entry for port's list of pipes
     //HAl channel related
-    void *xfer_desc_list;
-    usbh_hal_chan_t *chan_obj;
+    void *xfer_desc_list;               //Descriptor list of the in-flight IRP(s)
+    void *xfer_desc_list_next;          //Spare descriptor list, prepared with the next pending IRP(s) whilst the current list executes
+    int next_num_irps;                  //Number of pending IRPs filled into xfer_desc_list_next. 0 if it is not prepared
+    int next_num_desc;                  //Number of descriptors filled into xfer_desc_list_next
+    int isoc_start_idx;                 //Isochronous only. Descriptor of the in-flight IRP's first packet
+    int isoc_next_start_idx;            //Isochronous only. Descriptor of the first packet in xfer_desc_list_next
+    usbh_hal_chan_t *chan_obj;          //Only bound to a hardware channel whilst the pipe has IRPs to execute (periodic pipes: from then on)
     usbh_hal_ep_char_t ep_char;
+    TAILQ_ENTRY(pipe_obj) chan_wait_entry;  //TailQ entry for port's list of pipes waiting for a channel
+    //Bulk IN polling (see hcd_pipe_config_t.nak_poll_frames)
+    struct {
+        esp_timer_handle_t timer;       //NULL if the pipe polls for as long as it has an IRP in flight
+        uint16_t poll_frames;
+        uint16_t rearm_frames;
+        int desc_idx;                   //Descriptor the channel was executing when the poll window started
+        bool stopping;                  //Set by hcd_pipe_free(). The timer callback must no longer touch the pipe
+        esp_timer_handle_t sync_timer;  //Used by hcd_pipe_free() to wait for a timer callback that is already running
+        SemaphoreHandle_t sync_sem;
+    } poll;
     //Pipe status, state, and events
     hcd_pipe_state_t state;
     hcd_pipe_event_t last_event;
+    hcd_pipe_event_t defer_lost_event;      //Latest event dropped because the port's defer ring was full
     TaskHandle_t task_waiting_pipe_notif;   //Task handle used for internal pipe events
     union {
         struct {
@@ -128,9 +192,16 @@ struct pipe_obj {
             //Flags only used by control transfers
             uint32_t ctrl_data_stg_in: 1;
             uint32_t ctrl_data_stg_skip: 1;
-            uint32_t reserved3: 3;
+            uint32_t abort_requested: 1;    //A halt was requested to abort the in-flight IRP (see hcd_irp_abort())
+            uint32_t chan_bound: 1;         //chan_obj is currently bound to a hardware channel
+            uint32_t chan_waiting: 1;       //The pipe is in the port's list of pipes waiting for a channel
             uint32_t xfer_desc_list_len: 8;
-            uint32_t reserved16: 16;
+            uint32_t xfer_desc_num_filled: 8;   //Number of descriptors filled for the in-flight IRP(s)
+            uint32_t data_pid: 1;           //Data toggle of the pipe, saved whilst it is not bound to a channel
+            uint32_t data_pid_restore: 1;   //data_pid must be restored before the next IRP (i.e., after an abort)
+            uint32_t poll_parking: 1;       //A halt was requested because the device NAKed for the whole poll window
+            uint32_t poll_parked: 1;        //The pipe is off the bus until its poll timer re-arms it
+            uint32_t reserved4: 4;
         };
         uint32_t val;
     } flags;
@@ -148,6 +219,7 @@ struct port_obj {
     //Pipes routed through this port
     TAILQ_HEAD(tailhead_pipes_idle, pipe_obj) pipes_idle_tailq;
     TAILQ_HEAD(tailhead_pipes_queued, pipe_obj) pipes_active_tailq;
+    TAILQ_HEAD(tailhead_pipes_chan_wait, pipe_obj) pipes_chan_wait_tailq;  //Pipes with IRPs waiting for a free channel, oldest first
     int num_pipes_idle;
     int num_pipes_queued;
     //Port status, state, and events
@@ -169,11 +241,24 @@ struct port_obj {
         uint32_t val;
     } flags;
     bool initialized;
+    uint32_t *frame_list;   //Periodic frame list. Must be DMA capable
     //Port callback and context
     hcd_port_isr_callback_t callback;
     void *callback_arg;
     SemaphoreHandle_t port_mux;
     void *context;
+    //Deferred event delivery. The ring is written by the ISR only, and read by the bottom half task only
+    struct {
+        TaskHandle_t task;                  //Bottom half task. NULL if callbacks are run from the ISR
+        SemaphoreHandle_t mux;              //Held by the bottom half task whilst it is delivering events
+        _Atomic uint32_t head;              //Next entry to write
+        _Atomic uint32_t tail;              //Next entry to read
+        defer_event_t ring[DEFER_RING_LEN];
+        defer_event_t batch[DEFER_RING_LEN];    //Events the bottom half task is currently delivering
+        int batch_len;
+        _Atomic bool overflow;              //The ring was full, and events were dropped
+        hcd_port_event_t lost_port_event;   //Latest port event dropped because the ring was full
+    } defer;
 };
 
 /**
@@ -367,28 +452,27 @@ static bool _port_debounce(port_t *port);
 // ------------------------ Pipe ---------------------------
 
 /**
- * @brief Get the next pending IRP from the pending tailq
+ * @brief Move the next pending IRP(s) from the pending tailq to in-flight
  *
  * Entry:
  * - The in-flight IRP must be set to NULL (indicating the pipe currently has no in-flight IRP)
+ * - There are at least num_irps pending IRPs
  * Exit:
- * - If (num_irp_pending > 0), the first IRP is removed from pending_irp_tailq and and
- *   inflight_irp is set to that IRP.
- * - If there are no more queued IRPs, inflight_irp is left as NULL
+ * - The first pending IRP is removed from pending_irp_tailq and inflight_irp is set to that IRP.
+ * - The following (num_irps - 1) pending IRPs are moved to chained_irp_tailq (only bulk pipes batch IRPs)
  *
  * @param pipe Pipe object
- * @return true A pending IRP is now set as the in-flight IRP
- * @return false No more pending IRPs
+ * @param num_irps Number of IRPs to move (i.e., the number of IRPs filled into the descriptor list)
  */
-static bool _pipe_get_next_irp(pipe_t *pipe);
+static void _pipe_get_next_irp(pipe_t *pipe, int num_irps);
 
 /**
- * @brief Return the pipe's current IRP (inflight_irp) to the done tailq
+ * @brief Return the pipe's current IRP (inflight_irp) and any IRPs chained after it to the done tailq
  *
  * Entry:
  *  - The inflight_irp must already have been parsed (i.e., results have been checked)
  * Exit:
- * - The IRP is returned to the done tailq and inflight_irp is set to NULL
+ * - The IRPs are returned to the done tailq and inflight_irp is set to NULL
  *
  * @param pipe Pipe object
  */
@@ -409,6 +493,81 @@ static void _pipe_return_cur_irp(pipe_t *pipe);
  */
 static bool _pipe_wait_done(pipe_t *pipe);
 
+/**
+ * @brief Start the pipe's next pending IRP, or notify whoever is waiting for the pipe to stop
+ *
+ * Called after the in-flight IRP has been returned to the done tailq (i.e., it completed or was aborted).
+ *
+ * Entry:
+ * - There can be no in-flight IRP
+ * Exit:
+ * - If a port/pipe command is waiting for the transfer to complete, it is notified and no new IRP is started
+ * - Otherwise, the next pending IRP (if any) is now in-flight
+ *
+ * @param pipe Pipe object
+ * @param[out] yield Set to true if a yield is required as a result of the notification
+ */
+static void _pipe_start_next_or_notify(pipe_t *pipe, bool *yield);
+
+/**
+ * @brief Start the pipe's next pending IRP, binding the pipe to a hardware channel if necessary
+ *
+ * Pipes are only bound to a hardware channel whilst they have IRPs to execute (periodic pipes keep theirs once bound, see
+ * _pipe_chan_release()). If there are no free channels, the pipe is added to the back of the port's list of pipes waiting for a channel, and will be started once one is released.
+ *
+ * Entry:
+ * - The pipe has no in-flight IRP, and is active and not paused
+ * Exit:
+ * - The next pending IRP (if any) is in-flight, or the pipe is waiting for a channel
+ *
+ * @param pipe Pipe object
+ */
+static void _pipe_start_next(pipe_t *pipe);
+
+/**
+ * @brief Release the pipe's hardware channel (if bound) and hand it to the oldest pipe waiting for a channel
+ *
+ * Periodic (interrupt and isochronous) pipes keep their channel once bound, until the pipe is freed. Their channel is
+ * scheduled in the frame list at the pipe's interval, so giving it up would make the pipe miss service intervals
+ * whilst it waits for a channel again.
+ *
+ * Entry:
+ * - The pipe has no in-flight IRP
+ *
+ * @param pipe Pipe object
+ */
+static void _pipe_chan_release(pipe_t *pipe);
+
+/**
+ * @brief Bind free hardware channels to the pipes waiting for one, in the order they started waiting
+ *
+ * Pipes that are no longer able to start an IRP (e.g., they were paused, halted, or their IRPs were retired) are
+ * removed from the list without being bound.
+ *
+ * @param port Port object
+ */
+static void _port_chan_handoff(port_t *port);
+
+/**
+ * @brief Take a bulk IN pipe off the bus after its channel was halted at the end of a poll window
+ *
+ * The controller retries NAKed IN tokens by itself and does not report them, so a device that has nothing to send
+ * keeps the channel busy for as long as an IRP is in flight. Once a poll window passes without the channel moving on
+ * to another descriptor, the channel is halted. IRPs that received data are completed with what they received, the
+ * rest go back to the front of the pending tailq. The pipe then gives up its channel until the re-arm interval has
+ * passed (see pipe_poll_timer_cb()).
+ *
+ * Entry:
+ * - The pipe's channel has halted following a poll_parking halt request
+ * Exit:
+ * - The pipe has no in-flight IRP, and is parked unless a command is waiting for it or it has no IRPs left
+ *
+ * @param pipe Pipe object
+ * @param[out] yield Set to true if a yield is required as a result of a notification
+ * @return hcd_pipe_event_t HCD_PIPE_EVENT_IRP_DONE if any IRPs were completed, HCD_PIPE_EVENT_NONE otherwise
+ */
+static hcd_pipe_event_t _pipe_poll_park(pipe_t *pipe, bool *yield);
+
 /**
  * @brief Retires all IRPs (those that were previously in-flight or pending)
  *
@@ -441,18 +600,47 @@ static inline hcd_pipe_event_t pipe_decode_error_event(usbh_hal_chan_error_t cha
 // ----------------- Transfer Descriptors ------------------
 
 /**
- * @brief Fill the inflight_irp into the pipe's transfer descriptor list
+ * @brief Fill the pipe's next pending IRP(s) into a transfer descriptor list
+ *
+ * Only the descriptors are written (i.e., the channel is not touched), thus a list can be filled whilst the channel is
+ * executing another list. Bulk pipes fill up to XFER_LIST_LEN_BULK pending IRPs, all other pipes fill one.
+ * Isochronous pipes fill from the frame after the in-flight IRP's last packet, or from the next scheduled frame if
+ * there is no in-flight IRP, and record where they started in isoc_next_start_idx.
  *
  * Entry:
- *  - The pipe's inflight_irp must be set to the next IRP
+ *  - The pipe has at least one pending IRP
+ * Exit:
+ *  - The first pending IRP(s) are filled into the list. The IRPs remain in the pending tailq
+ *
+ * @param pipe Pipe object
+ * @param xfer_desc_list Transfer descriptor list to fill
+ * @param[out] num_desc Number of descriptors filled
+ * @return int Number of IRPs filled
+ */
+static int _xfer_desc_list_fill(pipe_t *pipe, void *xfer_desc_list, int *num_desc);
+
+/**
+ * @brief Prepare the pipe's spare transfer descriptor list with its next pending IRP(s)
+ *
+ * Called whilst the pipe's current list is executing, so that the next IRP(s) can be started with a single activate.
+ * Control pipes are never prepared as filling a control transfer also sets up the pipe's control stage flags.
+ *
+ * @param pipe Pipe object
+ */
+static void _xfer_desc_list_prepare(pipe_t *pipe);
+
+/**
+ * @brief Load the pipe's transfer descriptor list into its channel
+ *
+ * Entry:
+ *  - The pipe's in-flight IRP(s) are filled into the pipe's transfer descriptor list
  * Exit:
- *  - inflight_irp filled into the pipe's transfer descriptor list
  *  - Starting PIDs and directions set
  *  - Channel slot acquired. Will need to call usbh_hal_chan_activate() to actually start execution
  *
- * @param pipe Pipe where inflight_irp is already set to the next IRP
+ * @param pipe Pipe object
  */
-static void _xfer_desc_list_fill(pipe_t *pipe);
+static void _xfer_desc_list_load(pipe_t *pipe);
 
 /**
  * @brief Continue the execution of the transfer descriptor list
@@ -463,6 +651,32 @@ static void _xfer_desc_list_fill(pipe_t *pipe);
  */
 static void _xfer_desc_list_continue(pipe_t *pipe);
 
+/**
+ * @brief Parse the descriptors of one IRP of a bulk batch
+ *
+ * @param pipe Pipe object
+ * @param irp IRP
+ * @param desc_idx Index of the IRP's first descriptor
+ * @param[out] num_desc Number of descriptors the IRP was filled into
+ * @param[out] num_bytes Bytes transferred by the IRP's descriptors, including the one the channel halted in (if any)
+ * @return true if the IRP finished (i.e., all its descriptors were executed, or it ended on a short packet)
+ */
+static bool _xfer_desc_list_parse_bulk_irp(pipe_t *pipe, usb_irp_t *irp, int desc_idx, int *num_desc, int *num_bytes);
+
+/**
+ * @brief Parse a bulk pipe's transfer descriptor list, which can hold a batch of IRPs
+ *
+ * IRPs are parsed in the order they were filled. IRPs whose descriptors were executed get their results. If the batch
+ * was stopped early (due to an error, an abort, or a short packet), the first unfinished IRP takes the error status,
+ * and the chained IRPs that were never executed are put back at the front of the pending tailq (unless they were
+ * being aborted, in which case they are cancelled). If the channel was only halted early (a poll window park, or an
+ * abort of a later IRP), the unfinished IRP is put back too, keeping its progress in actual_num_bytes.
+ *
+ * @param pipe Pipe object
+ * @param error_occurred Are we parsing after the pipe had an error (or has become invalid)
+ */
+static void _xfer_desc_list_parse_bulk(pipe_t *pipe, bool error_occurred);
+
 /**
  * @brief Parse the pipe's transfer descriptor list to fill the result of the transfers into the pipe's IRP
  *
@@ -572,6 +786,9 @@ static hcd_port_event_t _intr_hdlr_hprt(port_t *port, usbh_hal_port_event_t hal_
         }
         case USBH_HAL_PORT_EVENT_ENABLED: {
             usbh_hal_port_enable(port->hal);  //Initialize remaining host port registers
+            //Periodic (interrupt) pipes are scheduled using the frame list
+            usbh_hal_port_set_frame_list(port->hal, port->frame_list, FRAME_LIST_LEN);
+            usbh_hal_port_toggle_frame_list(port->hal, true);
             port->speed = (usbh_hal_port_get_conn_speed(port->hal) == USB_PRIV_SPEED_FULL) ? USB_SPEED_FULL : USB_SPEED_LOW;
             port->state = HCD_PORT_STATE_ENABLED;
             port->flags.conn_devc_ena = 1;
@@ -640,27 +857,7 @@ static hcd_pipe_event_t _intr_hdlr_chan(pipe_t *pipe, usbh_hal_chan_t *chan_obj,
             event = HCD_PIPE_EVENT_IRP_DONE;
             _xfer_desc_list_parse(pipe, false);    //Parse results of IRP
             _pipe_return_cur_irp(pipe);    //Return the IRP to the pipe's done tailq
-            if (pipe->flags.waiting_xfer_done) {
-                //A port/pipe command is waiting for this pipe to complete its transfer. So don't load the next transfer
-                pipe->flags.waiting_xfer_done = 0;
-                if (pipe->port->flags.waiting_all_pipes_pause) {
-                    //Port command is waiting for all pipes to be paused
-                    pipe->flags.paused = 1;
-                    pipe->port->flags.num_pipes_waiting_pause--;
-                    if (pipe->port->flags.num_pipes_waiting_pause == 0) {
-                        //All pipes have finished pausing, Notify the blocked port command
-                        pipe->port->flags.waiting_all_pipes_pause = 0;
-                        *yield |= _internal_port_event_notify_from_isr(pipe->port);
-                    }
-                } else {
-                    //Pipe command is waiting for transfer to complete
-                    *yield |= _internal_pipe_event_notify(pipe, true);
-                }
-            } else if (_pipe_get_next_irp(pipe)) {
-                //Fill the descriptor list with the IRP and start the transfer
-                _xfer_desc_list_fill(pipe);
-                usbh_hal_chan_activate(chan_obj, 0);  //Start with the first descriptor
-            }
+            _pipe_start_next_or_notify(pipe, yield);
             break;
         }
         case USBH_HAL_CHAN_EVENT_SLOT_HALT: {
@@ -680,9 +877,35 @@ static hcd_pipe_event_t _intr_hdlr_chan(pipe_t *pipe, usbh_hal_chan_t *chan_obj,
             //Parse the failed IRP and update it's IRP status
             _xfer_desc_list_parse(pipe, true);
             _pipe_return_cur_irp(pipe);    //Return the IRP to the pipe's done tailq
+            if (!pipe->flags.waiting_xfer_done) {
+                //A halted pipe can't execute its IRPs, so let other pipes use the channel
+                _pipe_chan_release(pipe);
+            }
+            break;
+        }
+        case USBH_HAL_CHAN_EVENT_HALT_REQ: {
+            //The channel has halted at our request, to abort the in-flight IRP (see hcd_irp_abort()), or because a
+            //bulk IN pipe's poll window has passed (see pipe_poll_timer_cb())
+            assert(pipe->flags.abort_requested || pipe->flags.poll_parking);
+            //Packets acknowledged before the halt have advanced the data toggle. Keep it for the pipe's next IRP
+            pipe->flags.data_pid = usbh_hal_chan_get_pid(chan_obj);
+            pipe->flags.data_pid_restore = 1;
+            if (!pipe->flags.abort_requested) {
+                event = _pipe_poll_park(pipe, yield);
+                if (event != HCD_PIPE_EVENT_NONE) {
+                    pipe->last_event = event;
+                }
+                break;
+            }
+            //An abort takes precedence over parking. The IRP is done (cancelled), so the pipe needs to be dequeued
+            pipe->last_event = HCD_PIPE_EVENT_IRP_DONE;
+            event = HCD_PIPE_EVENT_IRP_DONE;
+            _xfer_desc_list_parse(pipe, true);  //Parse the aborted IRP. Its status is set to cancelled
+            _pipe_return_cur_irp(pipe);    //Return the IRP to the pipe's done tailq
+            //Aborting an IRP does not affect the pipe's state. Carry on with the next IRP
+            _pipe_start_next_or_notify(pipe, yield);
             break;
         }
-        case USBH_HAL_CHAN_EVENT_HALT_REQ:  //We currently don't halt request so this event should never occur
         default:
             abort();
             break;
@@ -701,10 +924,44 @@ static hcd_pipe_event_t _intr_hdlr_chan(pipe_t *pipe, usbh_hal_chan_t *chan_obj,
  *   allow the users to send whatever OS primitives they need.
  * @param arg
  */
+/**
+ * @brief Record an event for the port's bottom half task to deliver
+ *
+ * @note Only called from the critical section (i.e., by the ISR, or the poll timer), so there is only one writer at a
+ *       time. The port must have a bottom half task
+ * @note If the ring is full, the event is dropped. It is kept as the pipe's (or port's) lost event instead, and the
+ *       bottom half task delivers it once it sees the overflow flag. The ISR never runs the callback itself
+ *
+ * @param port Port object
+ * @param pipe Pipe of the event, or NULL for a port event
+ * @param event Pipe or port event
+ */
+static void _intr_defer_event(port_t *port, pipe_t *pipe, int event)
+{
+    uint32_t head = atomic_load_explicit(&port->defer.head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&port->defer.tail, memory_order_acquire);
+    if (head - tail >= DEFER_RING_LEN) {
+        //A pipe's errors are kept over its later IRP_DONE events, as the pipe has halted
+        if (pipe == NULL) {
+            port->defer.lost_port_event = event;
+        } else if (pipe->defer_lost_event == HCD_PIPE_EVENT_NONE || event != HCD_PIPE_EVENT_IRP_DONE) {
+            pipe->defer_lost_event = event;
+        }
+        atomic_store_explicit(&port->defer.overflow, true, memory_order_release);
+        return;
+    }
+    port->defer.ring[head & (DEFER_RING_LEN - 1)] = (defer_event_t) {
+        .pipe = pipe,
+        .event = event,
+    };
+    atomic_store_explicit(&port->defer.head, head + 1, memory_order_release);
+}
+
 static void intr_hdlr_main(void *arg)
 {
     port_t *port = (port_t *) arg;
     bool yield = false;
+    bool deferred = false;
 
     HCD_ENTER_CRITICAL_ISR();
     usbh_hal_port_event_t hal_port_evt = usbh_hal_decode_intr(port->hal);
@@ -715,7 +972,10 @@ static void intr_hdlr_main(void *arg)
             pipe_t *pipe = (pipe_t *)usbh_hal_chan_get_context(chan_obj);
             hcd_pipe_event_t event = _intr_hdlr_chan(pipe, chan_obj, &yield);
             //Run callback if a pipe event has occurred and the pipe also has a callback
-            if (event != HCD_PIPE_EVENT_NONE && pipe->callback != NULL) {
+            if (event != HCD_PIPE_EVENT_NONE && pipe->callback != NULL && port->defer.task != NULL) {
+                _intr_defer_event(port, pipe, event);
+                deferred = true;
+            } else if (event != HCD_PIPE_EVENT_NONE && pipe->callback != NULL) {
                 HCD_EXIT_CRITICAL_ISR();
                 yield |= pipe->callback((hcd_pipe_handle_t)pipe, event, pipe->callback_arg, true);
                 HCD_ENTER_CRITICAL_ISR();
@@ -728,7 +988,10 @@ static void intr_hdlr_main(void *arg)
         if (port_event != HCD_PORT_EVENT_NONE) {
             port->last_event = port_event;
             port->flags.event_pending = 1;
-            if (port->callback != NULL) {
+            if (port->callback != NULL && port->defer.task != NULL) {
+                _intr_defer_event(port, NULL, port_event);
+                deferred = true;
+            } else if (port->callback != NULL) {
                 HCD_EXIT_CRITICAL_ISR();
                 yield |= port->callback((hcd_port_handle_t)port, port_event, port->callback_arg, true);
                 HCD_ENTER_CRITICAL_ISR();
@@ -737,11 +1000,146 @@ static void intr_hdlr_main(void *arg)
     }
     HCD_EXIT_CRITICAL_ISR();
 
+    if (deferred) {
+        //A single notification per interrupt. The bottom half task drains every recorded event
+        BaseType_t task_woken = pdFALSE;
+        vTaskNotifyGiveFromISR(port->defer.task, &task_woken);
+        yield |= (task_woken == pdTRUE);
+    }
     if (yield) {
         portYIELD_FROM_ISR();
     }
 }
 
+// ------------------ Deferred Events ----------------------
+
+static void defer_batch_add(port_t *port, defer_event_t *evt)
+{
+    //A pipe's IRP_DONE event is delivered once per batch, as the callee dequeues all done IRPs in one go. This is only
+    //done if the pipe's latest event in the batch is also IRP_DONE, so that events are never reordered.
+    if (evt->pipe != NULL && evt->event == HCD_PIPE_EVENT_IRP_DONE) {
+        for (int i = port->defer.batch_len - 1; i >= 0; i--) {
+            if (port->defer.batch[i].pipe == evt->pipe) {
+                if (port->defer.batch[i].event == HCD_PIPE_EVENT_IRP_DONE) {
+                    return;
+                }
+                break;
+            }
+        }
+    }
+    port->defer.batch[port->defer.batch_len++] = *evt;
+}
+
+static void _defer_batch_add_lost_pipe(port_t *port, pipe_t *pipe)
+{
+    if (pipe->defer_lost_event == HCD_PIPE_EVENT_NONE) {
+        return;
+    }
+    if (port->defer.batch_len == DEFER_RING_LEN) {
+        //Doesn't fit. Left for the next round
+        atomic_store_explicit(&port->defer.overflow, true, memory_order_relaxed);
+        return;
+    }
+    port->defer.batch[port->defer.batch_len++] = (defer_event_t) {
+        .pipe = pipe,
+        .event = pipe->defer_lost_event,
+    };
+    pipe->defer_lost_event = HCD_PIPE_EVENT_NONE;
+}
+
+static void defer_batch_add_lost(port_t *port)
+{
+    //Collect the events the ISR dropped whilst the ring was full
+    port->defer.batch_len = 0;
+    HCD_ENTER_CRITICAL();
+    if (port->defer.lost_port_event != HCD_PORT_EVENT_NONE) {
+        port->defer.batch[port->defer.batch_len++] = (defer_event_t) {
+            .pipe = NULL,
+            .event = port->defer.lost_port_event,
+        };
+        port->defer.lost_port_event = HCD_PORT_EVENT_NONE;
+    }
+    pipe_t *pipe;
+    TAILQ_FOREACH(pipe, &port->pipes_idle_tailq, tailq_entry) {
+        _defer_batch_add_lost_pipe(port, pipe);
+    }
+    TAILQ_FOREACH(pipe, &port->pipes_active_tailq, tailq_entry) {
+        _defer_batch_add_lost_pipe(port, pipe);
+    }
+    HCD_EXIT_CRITICAL();
+}
+
+static void defer_batch_deliver(port_t *port)
+{
+    //Events of a freed pipe are set to NONE by hcd_pipe_free()
+    for (int i = 0; i < port->defer.batch_len; i++) {
+        defer_event_t *evt = &port->defer.batch[i];
+        if (evt->pipe != NULL && evt->event != HCD_PIPE_EVENT_NONE) {
+            (void) evt->pipe->callback((hcd_pipe_handle_t)evt->pipe, evt->event, evt->pipe->callback_arg, false);
+        } else if (evt->pipe == NULL && evt->event != HCD_PORT_EVENT_NONE) {
+            (void) port->callback((hcd_port_handle_t)port, evt->event, port->callback_arg, false);
+        }
+    }
+    port->defer.batch_len = 0;
+}
+
+static void defer_task(void *arg)
+{
+    port_t *port = (port_t *)arg;
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        xSemaphoreTake(port->defer.mux, portMAX_DELAY);
+        uint32_t tail = atomic_load_explicit(&port->defer.tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&port->defer.head, memory_order_acquire);
+        while (tail != head) {
+            //Move every recorded event into the batch, and free up the ring for the ISR
+            port->defer.batch_len = 0;
+            while (tail != head) {
+                defer_batch_add(port, &port->defer.ring[tail & (DEFER_RING_LEN - 1)]);
+                tail++;
+            }
+            atomic_store_explicit(&port->defer.tail, tail, memory_order_release);
+            defer_batch_deliver(port);
+            //Check for events recorded whilst delivering
+            head = atomic_load_explicit(&port->defer.head, memory_order_acquire);
+        }
+        if (atomic_exchange(&port->defer.overflow, false)) {
+            //The ring was full, so the ISR dropped events. Rescan the port's pipes for the latest event each one lost
+            defer_batch_add_lost(port);
+            defer_batch_deliver(port);
+            //Go round again for anything recorded (or dropped) meanwhile
+            xTaskNotifyGive(xTaskGetCurrentTaskHandle());
+        }
+        xSemaphoreGive(port->defer.mux);
+    }
+}
+
+static void defer_drop_pipe_events(port_t *port, pipe_t *pipe)
+{
+    //Can be called by the bottom half task itself (i.e., from a callback), in which case it already holds the mutex
+    bool is_defer_task = (xTaskGetCurrentTaskHandle() == port->defer.task);
+    if (!is_defer_task) {
+        xSemaphoreTake(port->defer.mux, portMAX_DELAY);
+    }
+    //Only the entries already recorded need to be checked. A pipe being freed has no IRPs, so no more events
+    uint32_t tail = atomic_load_explicit(&port->defer.tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&port->defer.head, memory_order_acquire);
+    for (; tail != head; tail++) {
+        defer_event_t *evt = &port->defer.ring[tail & (DEFER_RING_LEN - 1)];
+        if (evt->pipe == pipe) {
+            evt->event = HCD_PIPE_EVENT_NONE;
+        }
+    }
+    for (int i = 0; i < port->defer.batch_len; i++) {
+        if (port->defer.batch[i].pipe == pipe) {
+            port->defer.batch[i].event = HCD_PIPE_EVENT_NONE;
+        }
+    }
+    if (!is_defer_task) {
+        xSemaphoreGive(port->defer.mux);
+    }
+}
+
 // --------------------------------------------- Host Controller Driver ------------------------------------------------
 
 static port_t *port_obj_alloc(void)
@@ -749,16 +1147,24 @@ static port_t *port_obj_alloc(void)
     port_t *port = calloc(1, sizeof(port_t));
     usbh_hal_context_t *hal = malloc(sizeof(usbh_hal_context_t));
     SemaphoreHandle_t port_mux = xSemaphoreCreateMutex();
-    if (port == NULL || hal == NULL || port_mux == NULL) {
+    SemaphoreHandle_t defer_mux = xSemaphoreCreateMutex();
+    uint32_t *frame_list = heap_caps_aligned_calloc(USBH_HAL_DMA_MEM_ALIGN, FRAME_LIST_LEN, sizeof(uint32_t), MALLOC_CAP_DMA);
+    if (port == NULL || hal == NULL || port_mux == NULL || defer_mux == NULL || frame_list == NULL) {
         free(port);
         free(hal);
+        free(frame_list);
         if (port_mux != NULL) {
             vSemaphoreDelete(port_mux);
         }
+        if (defer_mux != NULL) {
+            vSemaphoreDelete(defer_mux);
+        }
         return NULL;
     }
     port->hal = hal;
     port->port_mux = port_mux;
+    port->defer.mux = defer_mux;
+    port->frame_list = frame_list;
     return port;
 }
 
@@ -768,6 +1174,8 @@ static void port_obj_free(port_t *port)
         return;
     }
     vSemaphoreDelete(port->port_mux);
+    vSemaphoreDelete(port->defer.mux);
+    free(port->frame_list);
     free(port->hal);
     free(port);
 }
@@ -940,9 +1348,8 @@ static void _port_unpause_all_pipes(port_t *port)
     TAILQ_FOREACH(pipe, &port->pipes_active_tailq, tailq_entry) {
         pipe->flags.paused = 0;
         //If the pipe has more pending IRP, start them.
-        if (_pipe_get_next_irp(pipe)) {
-            _xfer_desc_list_fill(pipe);
-            usbh_hal_chan_activate(pipe->chan_obj, 0);
+        if (pipe->inflight_irp == NULL && pipe->state == HCD_PIPE_STATE_ACTIVE) {
+            _pipe_start_next(pipe);
         }
     }
 }
@@ -1081,10 +1488,36 @@ esp_err_t hcd_port_init(int port_number, hcd_port_config_t *port_config, hcd_por
 
     HCD_ENTER_CRITICAL();
     HCD_CHECK_FROM_CRIT(s_hcd_obj != NULL && !s_hcd_obj->port_obj->initialized, ESP_ERR_INVALID_STATE);
-    //Port object memory and resources (such as the mutex) already be allocated. Just need to initialize necessary fields only
     port_t *port_obj = s_hcd_obj->port_obj;
+    HCD_EXIT_CRITICAL();
+
+    //Create the bottom half task before the port's interrupts are enabled
+    TaskHandle_t defer_task_hdl = NULL;
+    if (port_config->defer_task_priority > 0) {
+        atomic_store(&port_obj->defer.head, 0);
+        atomic_store(&port_obj->defer.tail, 0);
+        port_obj->defer.batch_len = 0;
+        atomic_store(&port_obj->defer.overflow, false);
+        port_obj->defer.lost_port_event = HCD_PORT_EVENT_NONE;
+        if (xTaskCreate(defer_task, "hcd_defer", DEFER_TASK_STACK_SIZE, (void *)port_obj,
+                        port_config->defer_task_priority, &defer_task_hdl) != pdPASS) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    HCD_ENTER_CRITICAL();
+    if (s_hcd_obj == NULL || port_obj->initialized) {
+        HCD_EXIT_CRITICAL();
+        if (defer_task_hdl != NULL) {
+            vTaskDelete(defer_task_hdl);
+        }
+        return ESP_ERR_INVALID_STATE;
+    }
+    //Port object memory and resources (such as the mutex) already be allocated. Just need to initialize necessary fields only
+    port_obj->defer.task = defer_task_hdl;
     TAILQ_INIT(&port_obj->pipes_idle_tailq);
     TAILQ_INIT(&port_obj->pipes_active_tailq);
+    TAILQ_INIT(&port_obj->pipes_chan_wait_tailq);
     port_obj->state = HCD_PORT_STATE_NOT_POWERED;
     port_obj->last_event = HCD_PORT_EVENT_NONE;
     port_obj->callback = port_config->callback;
@@ -1113,8 +1546,16 @@ esp_err_t hcd_port_deinit(hcd_port_handle_t port_hdl)
     port->initialized = false;
     esp_intr_disable(s_hcd_obj->isr_hdl);
     usbh_hal_deinit(port->hal);
+    TaskHandle_t defer_task_hdl = port->defer.task;
+    port->defer.task = NULL;
     HCD_EXIT_CRITICAL();
 
+    if (defer_task_hdl != NULL) {
+        //Holding the mutex ensures the bottom half task is not in the middle of delivering events
+        xSemaphoreTake(port->defer.mux, portMAX_DELAY);
+        vTaskDelete(defer_task_hdl);
+        xSemaphoreGive(port->defer.mux);
+    }
     return ESP_OK;
 }
 
@@ -1291,23 +1732,24 @@ void *hcd_port_get_ctx(hcd_port_handle_t port_hdl)
 
 // ----------------------- Private -------------------------
 
-static bool _pipe_get_next_irp(pipe_t *pipe)
+static void _pipe_get_next_irp(pipe_t *pipe, int num_irps)
 {
-    assert(pipe->inflight_irp == NULL);
-    bool ret;
-    //This function assigns the next pending IRP to the inflight_irp
-    if (pipe->num_irp_pending > 0) {
-        //Set inflight_irp to the next pending IRP
-        pipe->inflight_irp = TAILQ_FIRST(&pipe->pending_irp_tailq);
-        TAILQ_REMOVE(&pipe->pending_irp_tailq, pipe->inflight_irp, tailq_entry);
+    assert(pipe->inflight_irp == NULL && pipe->num_irp_pending >= num_irps && num_irps > 0);
+    //Set inflight_irp to the next pending IRP
+    pipe->inflight_irp = TAILQ_FIRST(&pipe->pending_irp_tailq);
+    TAILQ_REMOVE(&pipe->pending_irp_tailq, pipe->inflight_irp, tailq_entry);
+    pipe->num_irp_pending--;
+    //Update the IRP's current state
+    IRP_STATE_SET(pipe->inflight_irp->reserved_flags, IRP_STATE_INFLIGHT);
+    //Bulk pipes batch the following pending IRPs into the same descriptor list
+    for (int i = 1; i < num_irps; i++) {
+        usb_irp_t *irp = TAILQ_FIRST(&pipe->pending_irp_tailq);
+        TAILQ_REMOVE(&pipe->pending_irp_tailq, irp, tailq_entry);
         pipe->num_irp_pending--;
-        //Update the IRP's current state
-        IRP_STATE_SET(pipe->inflight_irp->reserved_flags, IRP_STATE_INFLIGHT);
-        ret =  true;
-    } else {
-        ret = false;
+        TAILQ_INSERT_TAIL(&pipe->chained_irp_tailq, irp, tailq_entry);
+        pipe->num_irp_chained++;
+        IRP_STATE_SET(irp->reserved_flags, IRP_STATE_INFLIGHT);
     }
-    return ret;
 }
 
 static void _pipe_return_cur_irp(pipe_t *pipe)
@@ -1319,6 +1761,16 @@ static void _pipe_return_cur_irp(pipe_t *pipe)
     IRP_STATE_SET(pipe->inflight_irp->reserved_flags, IRP_STATE_DONE);
     pipe->inflight_irp = NULL;
     pipe->num_irp_done++;
+    //Followed by the rest of its batch
+    if (pipe->num_irp_chained > 0) {
+        usb_irp_t *irp;
+        TAILQ_FOREACH(irp, &pipe->chained_irp_tailq, tailq_entry) {
+            IRP_STATE_SET(irp->reserved_flags, IRP_STATE_DONE);
+        }
+        TAILQ_CONCAT(&pipe->done_irp_tailq, &pipe->chained_irp_tailq, tailq_entry);
+        pipe->num_irp_done += pipe->num_irp_chained;
+        pipe->num_irp_chained = 0;
+    }
 }
 
 static bool _pipe_wait_done(pipe_t *pipe)
@@ -1340,10 +1792,151 @@ static bool _pipe_wait_done(pipe_t *pipe)
     return true;
 }
 
+static void _pipe_start_next_or_notify(pipe_t *pipe, bool *yield)
+{
+    assert(pipe->inflight_irp == NULL);
+    if (pipe->flags.waiting_xfer_done) {
+        //A port/pipe command is waiting for this pipe to complete its transfer. So don't load the next transfer
+        pipe->flags.waiting_xfer_done = 0;
+        if (pipe->port->flags.waiting_all_pipes_pause) {
+            //Port command is waiting for all pipes to be paused
+            pipe->flags.paused = 1;
+            pipe->port->flags.num_pipes_waiting_pause--;
+            if (pipe->port->flags.num_pipes_waiting_pause == 0) {
+                //All pipes have finished pausing, Notify the blocked port command
+                pipe->port->flags.waiting_all_pipes_pause = 0;
+                *yield |= _internal_port_event_notify_from_isr(pipe->port);
+            }
+        } else {
+            //Pipe command is waiting for transfer to complete
+            *yield |= _internal_pipe_event_notify(pipe, true);
+        }
+    } else if (pipe->num_irp_pending > 0
+               && (pipe->ep_char.periodic.interval > 0 || TAILQ_EMPTY(&pipe->port->pipes_chan_wait_tailq))) {
+        //Keep the channel and carry on with the next IRP. Periodic pipes always keep theirs (see _pipe_chan_release())
+        _pipe_start_next(pipe);
+    } else {
+        //The pipe is out of IRPs, or other pipes are waiting for a channel. Give up the channel. If the pipe still
+        //has IRPs, it goes to the back of the queue for a channel (i.e., channels are rotated between pipes)
+        _pipe_chan_release(pipe);
+        if (pipe->num_irp_pending > 0) {
+            _pipe_start_next(pipe);
+        }
+    }
+}
+
+static void _pipe_start_next(pipe_t *pipe)
+{
+    assert(pipe->inflight_irp == NULL);
+    if (pipe->num_irp_pending == 0 || pipe->flags.poll_parked) {
+        //A parked pipe is started by its poll timer
+        return;
+    }
+    if (!pipe->flags.chan_bound) {
+        //Queue up for a channel. Pipes that have been waiting longer are served first
+        if (!pipe->flags.chan_waiting) {
+            TAILQ_INSERT_TAIL(&pipe->port->pipes_chan_wait_tailq, pipe, chan_wait_entry);
+            pipe->flags.chan_waiting = 1;
+        }
+        _port_chan_handoff(pipe->port);
+        return;
+    }
+    //Use the spare list if it was already prepared with the next IRP(s). Otherwise, fill it now
+    int num_irps = pipe->next_num_irps;
+    int num_desc = pipe->next_num_desc;
+    if (num_irps != 0 && pipe->ep_char.type == USB_PRIV_XFER_TYPE_ISOCHRONOUS) {
+        //The spare list carries straight on from the previous IRP. If that frame has already passed, start afresh
+        uint32_t frame = usbh_hal_port_get_cur_frame_num(pipe->port->hal) + 1;
+        if (((pipe->isoc_next_start_idx - frame) & (XFER_LIST_LEN_ISOC - 1)) >= pipe->ep_char.periodic.interval) {
+            num_irps = 0;
+        }
+    }
+    if (num_irps == 0) {
+        num_irps = _xfer_desc_list_fill(pipe, pipe->xfer_desc_list_next, &num_desc);
+    }
+    pipe->next_num_irps = 0;
+    //Swap lists. The list that just finished becomes the spare list
+    void *xfer_desc_list = pipe->xfer_desc_list;
+    pipe->xfer_desc_list = pipe->xfer_desc_list_next;
+    pipe->xfer_desc_list_next = xfer_desc_list;
+    pipe->flags.xfer_desc_num_filled = num_desc;
+    pipe->isoc_start_idx = pipe->isoc_next_start_idx;
+    _pipe_get_next_irp(pipe, num_irps);
+    //Start the transfer. Isochronous IRPs start at the descriptor of their first frame, the rest at the first descriptor
+    _xfer_desc_list_load(pipe);
+    usbh_hal_chan_activate(pipe->chan_obj, (pipe->ep_char.type == USB_PRIV_XFER_TYPE_ISOCHRONOUS) ? pipe->isoc_start_idx : 0);
+    if (pipe->poll.timer != NULL) {
+        //Open a new poll window for this batch
+        pipe->poll.desc_idx = 0;
+        esp_timer_stop(pipe->poll.timer);
+        esp_timer_start_once(pipe->poll.timer, pipe->poll.poll_frames * FRAME_PERIOD_US);
+    }
+    //Whilst it executes, prepare the IRP(s) after it
+    _xfer_desc_list_prepare(pipe);
+}
+
+static void _pipe_chan_release(pipe_t *pipe)
+{
+    assert(pipe->inflight_irp == NULL);
+    if (!pipe->flags.chan_bound || pipe->ep_char.periodic.interval > 0) {
+        return;
+    }
+    //The data toggle is stored in the channel, so save it for the next time the pipe is bound
+    pipe->flags.data_pid = usbh_hal_chan_get_pid(pipe->chan_obj);
+    usbh_hal_chan_free(pipe->port->hal, pipe->chan_obj);
+    pipe->flags.chan_bound = 0;
+    _port_chan_handoff(pipe->port);
+}
+
+static void _port_chan_handoff(port_t *port)
+{
+    pipe_t *pipe;
+    while ((pipe = TAILQ_FIRST(&port->pipes_chan_wait_tailq)) != NULL) {
+        if (pipe->state != HCD_PIPE_STATE_ACTIVE || pipe->flags.paused || pipe->flags.waiting_xfer_done
+            || pipe->inflight_irp != NULL || pipe->num_irp_pending == 0 || pipe->flags.poll_parked) {
+            //Pipe can no longer start an IRP. It will queue up again the next time it is started
+            TAILQ_REMOVE(&port->pipes_chan_wait_tailq, pipe, chan_wait_entry);
+            pipe->flags.chan_waiting = 0;
+            continue;
+        }
+        if (!usbh_hal_chan_alloc(port->hal, pipe->chan_obj, (void *)pipe)) {
+            break;  //No free channels
+        }
+        TAILQ_REMOVE(&port->pipes_chan_wait_tailq, pipe, chan_wait_entry);
+        pipe->flags.chan_waiting = 0;
+        pipe->flags.chan_bound = 1;
+        usbh_hal_chan_set_ep_char(pipe->chan_obj, &pipe->ep_char);
+        usbh_hal_chan_set_pid(pipe->chan_obj, pipe->flags.data_pid);
+        _pipe_start_next(pipe);
+    }
+}
+
+static hcd_pipe_event_t _pipe_poll_park(pipe_t *pipe, bool *yield)
+{
+    hcd_pipe_event_t event = HCD_PIPE_EVENT_NONE;
+    _xfer_desc_list_parse(pipe, true);  //IRPs that did not finish are put back onto the pending tailq
+    if (pipe->inflight_irp != NULL) {
+        //IRPs of the batch that finished before the halt
+        event = HCD_PIPE_EVENT_IRP_DONE;
+        _pipe_return_cur_irp(pipe);
+    }
+    if (pipe->flags.waiting_xfer_done || pipe->num_irp_pending == 0) {
+        _pipe_start_next_or_notify(pipe, yield);
+    } else {
+        //Stay off the bus until the re-arm interval has passed. Other pipes can have the channel in the meantime
+        pipe->flags.poll_parked = 1;
+        _pipe_chan_release(pipe);
+        esp_timer_start_once(pipe->poll.timer, pipe->poll.rearm_frames * FRAME_PERIOD_US);
+    }
+    return event;
+}
+
 static void _pipe_retire(pipe_t *pipe, bool self_initiated)
 {
     //Cannot have any in-flight IRP
     assert(pipe->inflight_irp == NULL);
+    //The prepared list (if any) refers to the IRPs being retired
+    pipe->next_num_irps = 0;
     if (pipe->num_irp_pending > 0) {
         //Process all remaining pending IRPs
         usb_irp_t *irp;
@@ -1380,8 +1973,133 @@ static inline hcd_pipe_event_t pipe_decode_error_event(usbh_hal_chan_error_t cha
     return event;
 }
 
+static void pipe_poll_timer_cb(void *arg)
+{
+    pipe_t *pipe = (pipe_t *)arg;
+    hcd_pipe_event_t event = HCD_PIPE_EVENT_NONE;
+    bool deferred = false;
+    HCD_ENTER_CRITICAL();
+    if (pipe->poll.stopping) {
+        //The pipe is being freed
+        HCD_EXIT_CRITICAL();
+        return;
+    }
+    if (pipe->flags.poll_parked) {
+        //Re-arm interval has passed. Poll the device again
+        pipe->flags.poll_parked = 0;
+        if (pipe->state == HCD_PIPE_STATE_ACTIVE && !pipe->flags.paused && !pipe->flags.waiting_xfer_done
+            && pipe->inflight_irp == NULL && pipe->port->flags.conn_devc_ena) {
+            _pipe_start_next(pipe);
+        }
+    } else if (pipe->inflight_irp != NULL && pipe->flags.chan_bound && pipe->port->flags.conn_devc_ena
+               && pipe->state == HCD_PIPE_STATE_ACTIVE && !pipe->flags.abort_requested
+               && !pipe->flags.waiting_xfer_done && !pipe->flags.poll_parking) {
+        //Polled IRPs are spread across several descriptors, so the descriptor index moves on as their bytes arrive
+        int desc_idx = usbh_hal_chan_get_next_desc_index(pipe->chan_obj);
+        if (desc_idx != pipe->poll.desc_idx) {
+            //Data is flowing. Give the device another poll window
+            pipe->poll.desc_idx = desc_idx;
+            esp_timer_start_once(pipe->poll.timer, pipe->poll.poll_frames * FRAME_PERIOD_US);
+        } else {
+            //The device has NAKed for the whole window. Halt the channel and park the pipe
+            pipe->flags.poll_parking = 1;
+            if (usbh_hal_chan_slot_request_halt(pipe->chan_obj)) {
+                //Channel was already halted. Park now, keeping the data toggle for the pipe's next IRP
+                bool yield = false;
+                pipe->flags.data_pid = usbh_hal_chan_get_pid(pipe->chan_obj);
+                pipe->flags.data_pid_restore = 1;
+                event = _pipe_poll_park(pipe, &yield);
+                if (event != HCD_PIPE_EVENT_NONE) {
+                    pipe->last_event = event;
+                }
+                (void) yield;
+            }
+            //Otherwise, the pipe is parked by the USBH_HAL_CHAN_EVENT_HALT_REQ interrupt
+        }
+    }   //Otherwise, the IRP(s) completed within the window
+    //Deliver the event in order with the pipe's interrupt events. The ring is only written in the critical section
+    port_t *port = pipe->port;
+    if (event != HCD_PIPE_EVENT_NONE && pipe->callback != NULL && port->defer.task != NULL) {
+        _intr_defer_event(port, pipe, event);
+        deferred = true;
+        event = HCD_PIPE_EVENT_NONE;
+    }
+    HCD_EXIT_CRITICAL();
+    if (deferred) {
+        xTaskNotifyGive(port->defer.task);
+    } else if (event != HCD_PIPE_EVENT_NONE && pipe->callback != NULL) {
+        //Without a bottom half task, callbacks run wherever the event occurred
+        (void) pipe->callback((hcd_pipe_handle_t)pipe, event, pipe->callback_arg, false);
+    }
+}
+
+static void pipe_poll_sync_timer_cb(void *arg)
+{
+    //The esp_timer task runs callbacks one at a time, so any earlier pipe_poll_timer_cb() has returned
+    xSemaphoreGive((SemaphoreHandle_t)arg);
+}
+
 // ----------------------- Public --------------------------
 
+static int pipe_intr_interval_frames(uint8_t bInterval)
+{
+    //Round down to a power of 2 that divides the frame list, so the pipe is always scheduled at the same spacing
+    int interval = 1;
+    while (interval * 2 <= bInterval && interval * 2 <= FRAME_LIST_LEN) {
+        interval *= 2;
+    }
+    return interval;
+}
+
+static int pipe_isoc_interval_frames(uint8_t bInterval)
+{
+    //Isochronous bInterval is an exponent (2^(bInterval - 1) frames) in the range 1 to 16
+    if (bInterval <= 1) {
+        return 1;
+    }
+    int interval = 1 << (bInterval - 1);
+    return (interval < FRAME_LIST_LEN) ? interval : FRAME_LIST_LEN;
+}
+
+static int pipe_isoc_num_desc(int num_packets, int interval)
+{
+    //Blank frames after the last packet don't need descriptors, as the channel halts after the last packet
+    return (num_packets - 1) * interval + 1;
+}
+
+static int _pipe_isoc_start_idx(pipe_t *pipe)
+{
+    int interval = pipe->ep_char.periodic.interval;
+    if (pipe->inflight_irp != NULL) {
+        //Carry straight on from the in-flight IRP, in the first service period after its last packet
+        return (pipe->isoc_start_idx + pipe->inflight_irp->num_iso_packets * interval) & (XFER_LIST_LEN_ISOC - 1);
+    }
+    //Otherwise, the first frame that the pipe is scheduled in. Leave a frame of margin to activate the channel in
+    uint32_t frame = usbh_hal_port_get_cur_frame_num(pipe->port->hal) + 1;
+    frame += (pipe->ep_char.periodic.phase_offset_frames - frame) & (interval - 1);
+    return frame & (XFER_LIST_LEN_ISOC - 1);
+}
+
+static int pipe_intr_num_desc(int num_bytes, int mps)
+{
+    //A zero length IRP still sends a (zero length) packet
+    int num_desc = (num_bytes + mps - 1) / mps;
+    return (num_desc > 0) ? num_desc : 1;
+}
+
+static int pipe_bulk_num_desc(pipe_t *pipe, int num_bytes, int *desc_len)
+{
+    if (pipe->poll.timer == NULL || num_bytes == 0) {
+        *desc_len = num_bytes;
+        return NUM_DESC_PER_XFER_BULK;
+    }
+    //Spread the IRP's packets evenly across the descriptors, so that each one completes after a share of its bytes
+    int mps = pipe->ep_char.mps;
+    int num_pkts = (num_bytes + mps - 1) / mps;
+    *desc_len = ((num_pkts + NUM_DESC_PER_XFER_BULK_POLL - 1) / NUM_DESC_PER_XFER_BULK_POLL) * mps;
+    return (num_bytes + *desc_len - 1) / *desc_len;
+}
+
 esp_err_t hcd_pipe_alloc(hcd_port_handle_t port_hdl, const hcd_pipe_config_t *pipe_config, hcd_pipe_handle_t *ctrl_pipe)
 {
     HCD_CHECK(port_hdl != NULL && pipe_config != NULL && ctrl_pipe != NULL, ESP_ERR_INVALID_ARG);
@@ -1415,12 +2133,21 @@ esp_err_t hcd_pipe_alloc(hcd_port_handle_t port_hdl, const hcd_pipe_config_t *pi
             if (pipe_config->dev_speed == USB_SPEED_LOW) {
                 return ESP_ERR_NOT_SUPPORTED;   //Low speed devices do not support bulk transfers
             }
-            num_xfer_desc = XFER_LIST_LEN_BULK * NUM_DESC_PER_XFER_BULK;
+            bool poll = (pipe_config->ep_desc->bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_DIR_MASK)
+                        && pipe_config->nak_poll_frames > 0;
+            num_xfer_desc = XFER_LIST_LEN_BULK * ((poll) ? NUM_DESC_PER_XFER_BULK_POLL : NUM_DESC_PER_XFER_BULK);
             break;
         }
-        default: {
-            //Isochronous and Interrupt pipes currently not supported
-            return ESP_ERR_NOT_SUPPORTED;
+        case USB_XFER_TYPE_INTR: {
+            num_xfer_desc = XFER_LIST_LEN_INTR * NUM_DESC_PER_XFER_INTR;
+            break;
+        }
+        default: {  //USB_XFER_TYPE_ISOCHRONOUS
+            if (pipe_config->dev_speed == USB_SPEED_LOW) {
+                return ESP_ERR_NOT_SUPPORTED;   //Low speed devices do not support isochronous transfers
+            }
+            num_xfer_desc = XFER_LIST_LEN_ISOC * NUM_DESC_PER_XFER_ISOC;
+            break;
         }
     }
 
@@ -1428,7 +2155,8 @@ esp_err_t hcd_pipe_alloc(hcd_port_handle_t port_hdl, const hcd_pipe_config_t *pi
     pipe_t *pipe = calloc(1, sizeof(pipe_t));
     usbh_hal_chan_t *chan_obj = malloc(sizeof(usbh_hal_chan_t));
     void *xfer_desc_list = heap_caps_aligned_calloc(USBH_HAL_DMA_MEM_ALIGN, num_xfer_desc, USBH_HAL_XFER_DESC_SIZE, MALLOC_CAP_DMA);
-    if (pipe == NULL|| chan_obj == NULL || xfer_desc_list == NULL) {
+    void *xfer_desc_list_next = heap_caps_aligned_calloc(USBH_HAL_DMA_MEM_ALIGN, num_xfer_desc, USBH_HAL_XFER_DESC_SIZE, MALLOC_CAP_DMA);
+    if (pipe == NULL|| chan_obj == NULL || xfer_desc_list == NULL || xfer_desc_list_next == NULL) {
         ret = ESP_ERR_NO_MEM;
         goto err;
     }
@@ -1436,8 +2164,10 @@ esp_err_t hcd_pipe_alloc(hcd_port_handle_t port_hdl, const hcd_pipe_config_t *pi
     //Initialize pipe object
     TAILQ_INIT(&pipe->pending_irp_tailq);
     TAILQ_INIT(&pipe->done_irp_tailq);
+    TAILQ_INIT(&pipe->chained_irp_tailq);
     pipe->port = port;
     pipe->xfer_desc_list = xfer_desc_list;
+    pipe->xfer_desc_list_next = xfer_desc_list_next;
     pipe->flags.xfer_desc_list_len = num_xfer_desc;
     pipe->chan_obj = chan_obj;
     usb_priv_xfer_type_t hal_type;
@@ -1466,25 +2196,56 @@ esp_err_t hcd_pipe_alloc(hcd_port_handle_t port_hdl, const hcd_pipe_config_t *pi
     }
     pipe->ep_char.dev_addr = pipe_config->dev_addr;
     pipe->ep_char.ls_via_fs_hub = (port_speed == USB_SPEED_FULL && pipe_config->dev_speed == USB_SPEED_LOW);
+    if (hal_type == USB_PRIV_XFER_TYPE_INTR) {
+        pipe->ep_char.periodic.interval = pipe_intr_interval_frames(pipe_config->ep_desc->bInterval);
+    } else if (hal_type == USB_PRIV_XFER_TYPE_ISOCHRONOUS) {
+        pipe->ep_char.periodic.interval = pipe_isoc_interval_frames(pipe_config->ep_desc->bInterval);
+    } else {
+        pipe->ep_char.periodic.interval = 0;
+    }
+    pipe->ep_char.periodic.phase_offset_frames = 0;
     pipe->state = HCD_PIPE_STATE_ACTIVE;
     pipe->callback = pipe_config->callback;
     pipe->callback_arg = pipe_config->callback_arg;
     pipe->context = pipe_config->context;
+    if (hal_type == USB_PRIV_XFER_TYPE_BULK && (pipe->ep_char.bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_DIR_MASK)
+        && pipe_config->nak_poll_frames > 0) {
+        pipe->poll.poll_frames = pipe_config->nak_poll_frames;
+        pipe->poll.rearm_frames = (pipe_config->nak_rearm_frames > 0) ? pipe_config->nak_rearm_frames : 1;
+        const esp_timer_create_args_t timer_args = {
+            .callback = pipe_poll_timer_cb,
+            .arg = pipe,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "hcd_poll",
+        };
+        if (esp_timer_create(&timer_args, &pipe->poll.timer) != ESP_OK) {
+            ret = ESP_ERR_NO_MEM;
+            goto err;
+        }
+        pipe->poll.sync_sem = xSemaphoreCreateBinary();
+        const esp_timer_create_args_t sync_timer_args = {
+            .callback = pipe_poll_sync_timer_cb,
+            .arg = pipe->poll.sync_sem,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "hcd_poll_sync",
+        };
+        if (pipe->poll.sync_sem == NULL || esp_timer_create(&sync_timer_args, &pipe->poll.sync_timer) != ESP_OK) {
+            ret = ESP_ERR_NO_MEM;
+            goto err;
+        }
+    }
 
-    //Allocate channel
+    //The pipe is only bound to a hardware channel once it has IRPs to execute (see _pipe_start_next())
     HCD_ENTER_CRITICAL();
     if (!port->initialized || !port->flags.conn_devc_ena) {
         HCD_EXIT_CRITICAL();
         ret = ESP_ERR_INVALID_STATE;
         goto err;
     }
-    bool chan_allocated = usbh_hal_chan_alloc(port->hal, pipe->chan_obj, (void *) pipe);
-    if (!chan_allocated) {
-        HCD_EXIT_CRITICAL();
-        ret = ESP_ERR_NOT_SUPPORTED;
-        goto err;
+    if (pipe->ep_char.periodic.interval > 0) {
+        //Spread periodic pipes with the same interval across different frames
+        pipe->ep_char.periodic.phase_offset_frames = (port->num_pipes_idle + port->num_pipes_queued) % pipe->ep_char.periodic.interval;
     }
-    usbh_hal_chan_set_ep_char(pipe->chan_obj, &pipe->ep_char);
 
     //Add the pipe to the list of idle pipes in the port object
     TAILQ_INSERT_TAIL(&port->pipes_idle_tailq, pipe, tailq_entry);
@@ -1494,7 +2255,17 @@ esp_err_t hcd_pipe_alloc(hcd_port_handle_t port_hdl, const hcd_pipe_config_t *pi
     return ret;
 
 err:
+    if (pipe != NULL && pipe->poll.timer != NULL) {
+        esp_timer_delete(pipe->poll.timer);
+    }
+    if (pipe != NULL && pipe->poll.sync_timer != NULL) {
+        esp_timer_delete(pipe->poll.sync_timer);
+    }
+    if (pipe != NULL && pipe->poll.sync_sem != NULL) {
+        vSemaphoreDelete(pipe->poll.sync_sem);
+    }
     free(xfer_desc_list);
+    free(xfer_desc_list_next);
     free(chan_obj);
     free(pipe);
     return ret;
@@ -1512,11 +2283,34 @@ esp_err_t hcd_pipe_free(hcd_pipe_handle_t ctrl_pipe)
     //Remove pipe from the list of idle pipes (it must be in the idle list because it should have no queued IRPs)
     TAILQ_REMOVE(&pipe->port->pipes_idle_tailq, pipe, tailq_entry);
     pipe->port->num_pipes_idle--;
-    usbh_hal_chan_free(pipe->port->hal, pipe->chan_obj);
+    if (pipe->flags.chan_waiting) {
+        TAILQ_REMOVE(&pipe->port->pipes_chan_wait_tailq, pipe, chan_wait_entry);
+    }
+    if (pipe->flags.chan_bound) {
+        usbh_hal_chan_free(pipe->port->hal, pipe->chan_obj);
+    }
+    //From here on, the poll timer callback neither re-arms the timer nor touches the pipe
+    pipe->poll.stopping = true;
     HCD_EXIT_CRITICAL();
 
+    if (pipe->poll.timer != NULL) {
+        //esp_timer_stop() doesn't wait for a callback the esp_timer task has already started (or is about to start).
+        //Such a callback can still be delivering an event, so wait for it to return via a callback queued behind it
+        esp_timer_stop(pipe->poll.timer);
+        esp_timer_start_once(pipe->poll.sync_timer, 0);
+        xSemaphoreTake(pipe->poll.sync_sem, portMAX_DELAY);
+        esp_timer_delete(pipe->poll.timer);
+        esp_timer_delete(pipe->poll.sync_timer);
+        vSemaphoreDelete(pipe->poll.sync_sem);
+    }
+    //Make sure the bottom half task won't deliver any of the pipe's events after it is freed
+    if (pipe->port->defer.task != NULL) {
+        defer_drop_pipe_events(pipe->port, pipe);
+    }
+
     //Free pipe resources
     free(pipe->xfer_desc_list);
+    free(pipe->xfer_desc_list_next);
     free(pipe->chan_obj);
     free(pipe);
     return ESP_OK;
@@ -1535,7 +2329,10 @@ esp_err_t hcd_pipe_update(hcd_pipe_handle_t ctrl_pipe, uint8_t dev_addr, int mps
     //Check that all IRPs have been removed and pipe has no pending events
     pipe->ep_char.dev_addr = dev_addr;
     pipe->ep_char.mps = mps;
-    usbh_hal_chan_set_ep_char(pipe->chan_obj, &pipe->ep_char);
+    pipe->next_num_irps = 0;
+    if (pipe->flags.chan_bound) {
+        usbh_hal_chan_set_ep_char(pipe->chan_obj, &pipe->ep_char);
+    }   //Otherwise, applied once the pipe is bound to a channel
     HCD_EXIT_CRITICAL();
     return ESP_OK;
 }
@@ -1603,10 +2400,8 @@ esp_err_t hcd_pipe_command(hcd_pipe_handle_t ctrl_pipe, hcd_pipe_cmd_t command)
                 if (pipe->state == HCD_PIPE_STATE_HALTED) {
                     pipe->state = HCD_PIPE_STATE_ACTIVE;
                     //Start the next pending transfer if it exists
-                    if (_pipe_get_next_irp(pipe)) {
-                        //Fill the descriptor list with the IRP and start the transfer
-                        _xfer_desc_list_fill(pipe);
-                        usbh_hal_chan_activate(pipe->chan_obj, 0);  //Start with the first descriptor
+                    if (!pipe->flags.paused) {
+                        _pipe_start_next(pipe);
                     }
                 }
                 break;
@@ -1623,6 +2418,10 @@ esp_err_t hcd_pipe_command(hcd_pipe_handle_t ctrl_pipe, hcd_pipe_cmd_t command)
             }
         }
         pipe->flags.pipe_cmd_processing = 0;
+        if (pipe->inflight_irp == NULL && pipe->port->flags.conn_devc_ena) {
+            //The pipe has stopped (or has nothing left to execute). Let other pipes use its channel
+            _pipe_chan_release(pipe);
+        }
     }
     HCD_EXIT_CRITICAL();
     return ret;
@@ -1643,12 +2442,12 @@ hcd_pipe_event_t hcd_pipe_get_event(hcd_pipe_handle_t ctrl_pipe)
 
 // ----------------------- Private -------------------------
 
-static void _xfer_desc_list_fill(pipe_t *pipe)
+static int _xfer_desc_list_fill(pipe_t *pipe, void *xfer_desc_list, int *num_desc)
 {
-    //inflight_irp of the pipe must already set to the target IRP
-    assert(pipe->inflight_irp != NULL);
-    //Fill transfer descriptor list with a single IRP
-    usb_irp_t *usb_irp = pipe->inflight_irp;
+    //The pipe must have a pending IRP to fill
+    assert(pipe->num_irp_pending > 0);
+    usb_irp_t *usb_irp = TAILQ_FIRST(&pipe->pending_irp_tailq);
+    int num_irps = 1;
     switch (pipe->ep_char.type) {
         case USB_XFER_TYPE_CTRL: {
             //Get information about the control transfer by analyzing the setup packet (the first 8 bytes)
@@ -1657,36 +2456,119 @@ static void _xfer_desc_list_fill(pipe_t *pipe)
             pipe->flags.ctrl_data_stg_skip = (usb_irp->num_bytes == 0);
 
             //Fill setup stage
-            usbh_hal_xfer_desc_fill(pipe->xfer_desc_list, 0, usb_irp->data_buffer, sizeof(usb_ctrl_req_t),
+            usbh_hal_xfer_desc_fill(xfer_desc_list, 0, usb_irp->data_buffer, sizeof(usb_ctrl_req_t),
                                     USBH_HAL_XFER_DESC_FLAG_SETUP | USBH_HAL_XFER_DESC_FLAG_HALT);
             if (pipe->flags.ctrl_data_stg_skip) {
                 //Fill a NULL packet if there is no data stage
-                usbh_hal_xfer_desc_fill(pipe->xfer_desc_list, 1, NULL, 0, USBH_HAL_XFER_DESC_FLAG_NULL);
+                usbh_hal_xfer_desc_fill(xfer_desc_list, 1, NULL, 0, USBH_HAL_XFER_DESC_FLAG_NULL);
             } else {
                 //Fill data stage
-                usbh_hal_xfer_desc_fill(pipe->xfer_desc_list, 1, usb_irp->data_buffer + sizeof(usb_ctrl_req_t), usb_irp->num_bytes,
+                usbh_hal_xfer_desc_fill(xfer_desc_list, 1, usb_irp->data_buffer + sizeof(usb_ctrl_req_t), usb_irp->num_bytes,
                                         ((pipe->flags.ctrl_data_stg_in) ? USBH_HAL_XFER_DESC_FLAG_IN : 0) | USBH_HAL_XFER_DESC_FLAG_HALT);
             }
             //Fill status stage (i.e., a zero length packet). If data stage is skipped, the status stage is always IN.
-            usbh_hal_xfer_desc_fill(pipe->xfer_desc_list, 2, NULL, 0,
+            usbh_hal_xfer_desc_fill(xfer_desc_list, 2, NULL, 0,
                                     ((pipe->flags.ctrl_data_stg_in && !pipe->flags.ctrl_data_stg_skip) ? 0 : USBH_HAL_XFER_DESC_FLAG_IN) | USBH_HAL_XFER_DESC_FLAG_HALT);
-            //Set the channel's direction to OUT and PID to 0 respectively for the the setup stage
-            usbh_hal_chan_set_dir(pipe->chan_obj, false);   //Setup stage is always OUT
-            usbh_hal_chan_set_pid(pipe->chan_obj, 0);   //Setup stage always has a PID of DATA0
+            *num_desc = NUM_DESC_PER_XFER_CTRL;
             break;
         }
         case USB_XFER_TYPE_BULK: {
+            //Fill a batch of the first pending IRPs. Only the last one halts the channel
             bool is_in = pipe->ep_char.bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_DIR_MASK;
-            usbh_hal_xfer_desc_fill(pipe->xfer_desc_list, 0, usb_irp->data_buffer, usb_irp->num_bytes,
-                                    ((is_in) ? USBH_HAL_XFER_DESC_FLAG_IN : 0) | USBH_HAL_XFER_DESC_FLAG_HALT);
+            uint32_t desc_flags = (is_in) ? USBH_HAL_XFER_DESC_FLAG_IN : 0;
+            num_irps = (pipe->num_irp_pending < XFER_LIST_LEN_BULK) ? pipe->num_irp_pending : XFER_LIST_LEN_BULK;
+            int desc_idx = 0;
+            usb_irp_t *irp = usb_irp;
+            for (int i = 0; i < num_irps; i++) {
+                //An IRP that was stopped early carries on after the bytes it already transferred
+                int done = irp->actual_num_bytes;
+                int desc_len;
+                int num_irp_desc = pipe_bulk_num_desc(pipe, irp->num_bytes - done, &desc_len);
+                for (int j = 0; j < num_irp_desc; j++) {
+                    int offset = done + j * desc_len;
+                    int len = (irp->num_bytes - offset < desc_len) ? irp->num_bytes - offset : desc_len;
+                    bool is_last_desc = (i == num_irps - 1 && j == num_irp_desc - 1);
+                    usbh_hal_xfer_desc_fill(xfer_desc_list, desc_idx, irp->data_buffer + offset, len,
+                                            desc_flags | ((is_last_desc) ? USBH_HAL_XFER_DESC_FLAG_HALT : 0));
+                    desc_idx++;
+                }
+                irp = TAILQ_NEXT(irp, tailq_entry);
+            }
+            *num_desc = desc_idx;
             break;
         }
-        default: {
-            break;  //Isoc and Interrupt transfers not supported yet
+        case USB_XFER_TYPE_INTR: {
+            //Fill a descriptor per packet. The channel executes one each service interval
+            bool is_in = pipe->ep_char.bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_DIR_MASK;
+            uint32_t desc_flags = (is_in) ? USBH_HAL_XFER_DESC_FLAG_IN : 0;
+            int mps = pipe->ep_char.mps;
+            int num_intr_desc = pipe_intr_num_desc(usb_irp->num_bytes, mps);
+            for (int i = 0; i < num_intr_desc; i++) {
+                int offset = i * mps;
+                int len = (usb_irp->num_bytes - offset < mps) ? usb_irp->num_bytes - offset : mps;
+                //Last packet halts the channel once done
+                usbh_hal_xfer_desc_fill(xfer_desc_list, i, usb_irp->data_buffer + offset, len,
+                                        desc_flags | ((i == num_intr_desc - 1) ? USBH_HAL_XFER_DESC_FLAG_HALT : 0));
+            }
+            *num_desc = num_intr_desc;
+            break;
+        }
+        default: {  //USB_XFER_TYPE_ISOCHRONOUS
+            //Fill a descriptor per packet from the descriptor of the starting frame, and a NULL descriptor for every other
+            //frame (i.e., in between packets, and the rest of the list)
+            bool is_in = pipe->ep_char.bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_DIR_MASK;
+            uint32_t desc_flags = (is_in) ? USBH_HAL_XFER_DESC_FLAG_IN : 0;
+            int interval = pipe->ep_char.periodic.interval;
+            int num_isoc_desc = pipe_isoc_num_desc(usb_irp->num_iso_packets, interval);
+            int start_idx = _pipe_isoc_start_idx(pipe);
+            int offset = 0;
+            for (int i = 0; i < XFER_LIST_LEN_ISOC; i++) {
+                int desc_idx = (start_idx + i) & (XFER_LIST_LEN_ISOC - 1);
+                if (i >= num_isoc_desc || i % interval != 0) {
+                    usbh_hal_xfer_desc_fill(xfer_desc_list, desc_idx, NULL, 0, USBH_HAL_XFER_DESC_FLAG_NULL);
+                    continue;
+                }
+                int len = usb_irp->iso_packet_desc[i / interval].length;
+                //Last packet halts the channel once done
+                usbh_hal_xfer_desc_fill(xfer_desc_list, desc_idx, usb_irp->data_buffer + offset, len,
+                                        desc_flags | ((i == num_isoc_desc - 1) ? USBH_HAL_XFER_DESC_FLAG_HALT : 0));
+                offset += len;
+            }
+            pipe->isoc_next_start_idx = start_idx;
+            *num_desc = XFER_LIST_LEN_ISOC;
+            break;
         }
     }
+    return num_irps;
+}
+
+static void _xfer_desc_list_prepare(pipe_t *pipe)
+{
+    if (pipe->ep_char.type == USB_PRIV_XFER_TYPE_CTRL || pipe->num_irp_pending == 0) {
+        return;
+    }
+    //Bulk pipes refill if more IRPs were enqueued since the list was prepared, so that the batch isn't cut short
+    if (pipe->next_num_irps == 0
+        || (pipe->ep_char.type == USB_PRIV_XFER_TYPE_BULK && pipe->next_num_irps < XFER_LIST_LEN_BULK
+            && pipe->next_num_irps < pipe->num_irp_pending)) {
+        pipe->next_num_irps = _xfer_desc_list_fill(pipe, pipe->xfer_desc_list_next, &pipe->next_num_desc);
+    }
+}
+
+static void _xfer_desc_list_load(pipe_t *pipe)
+{
+    if (pipe->ep_char.type == USB_PRIV_XFER_TYPE_CTRL) {
+        //Set the channel's direction to OUT and PID to 0 respectively for the the setup stage
+        usbh_hal_chan_set_dir(pipe->chan_obj, false);   //Setup stage is always OUT
+        usbh_hal_chan_set_pid(pipe->chan_obj, 0);   //Setup stage always has a PID of DATA0
+        pipe->flags.data_pid_restore = 0;
+    } else if (pipe->flags.data_pid_restore) {
+        //Continue with the data toggle that the aborted IRP left off at
+        pipe->flags.data_pid_restore = 0;
+        usbh_hal_chan_set_pid(pipe->chan_obj, pipe->flags.data_pid);
+    }
     //Claim slot
-    usbh_hal_chan_slot_acquire(pipe->chan_obj, pipe->xfer_desc_list, pipe->flags.xfer_desc_list_len, (void *)pipe);
+    usbh_hal_chan_slot_acquire(pipe->chan_obj, pipe->xfer_desc_list, pipe->flags.xfer_desc_num_filled, (void *)pipe);
 }
 
 static void _xfer_desc_list_continue(pipe_t *pipe)
@@ -1720,6 +2602,136 @@ static void _xfer_desc_list_continue(pipe_t *pipe)
     usbh_hal_chan_activate(pipe->chan_obj, num_to_skip);    //Start the next stage
 }
 
+static usb_transfer_status_t pipe_decode_error_status(pipe_t *pipe)
+{
+    usb_transfer_status_t xfer_status;
+    if (pipe->state == HCD_PIPE_STATE_INVALID) {
+        xfer_status = USB_TRANSFER_STATUS_NO_DEVICE;
+    } else if (pipe->flags.abort_requested) {
+        //The channel was halted to abort the IRP
+        xfer_status = USB_TRANSFER_STATUS_CANCELLED;
+    } else {
+        //Must have been a pipe error event
+        switch (pipe->last_event) {
+            case HCD_PIPE_EVENT_ERROR_XFER: //Excessive transaction error
+                xfer_status = USB_TRANSFER_STATUS_ERROR;
+                break;
+            case HCD_PIPE_EVENT_ERROR_OVERFLOW:
+                xfer_status = USB_TRANSFER_STATUS_OVERFLOW;
+                break;
+            case HCD_PIPE_EVENT_ERROR_STALL:
+                xfer_status = USB_TRANSFER_STATUS_STALL;
+                break;
+            default:
+                //HCD_PIPE_EVENT_ERROR_IRP_NOT_AVAIL should never occur
+                abort();
+                break;
+        }
+    }
+    return xfer_status;
+}
+
+static bool _xfer_desc_list_parse_bulk_irp(pipe_t *pipe, usb_irp_t *irp, int desc_idx, int *num_desc, int *num_bytes)
+{
+    //Only the bytes left after any earlier, early stopped, run were filled (see _xfer_desc_list_fill())
+    int rem = irp->num_bytes - irp->actual_num_bytes;
+    int desc_len;
+    *num_desc = pipe_bulk_num_desc(pipe, rem, &desc_len);
+    *num_bytes = 0;
+    for (int i = 0; i < *num_desc; i++) {
+        int len = (rem - i * desc_len < desc_len) ? rem - i * desc_len : desc_len;
+        int desc_rem_len;
+        int desc_status;
+        usbh_hal_xfer_desc_parse(pipe->xfer_desc_list, desc_idx + i, &desc_rem_len, &desc_status);
+        *num_bytes += len - desc_rem_len;
+        if (desc_status != USBH_HAL_XFER_DESC_STS_SUCCESS) {
+            return false;
+        }
+        if (desc_rem_len > 0) {
+            //A short packet ends the IRP. The channel halted, so its remaining descriptors were never executed
+            break;
+        }
+    }
+    return true;
+}
+
+static void _xfer_desc_list_parse_bulk(pipe_t *pipe, bool error_occurred)
+{
+    //A poll window halt is not an error. The IRP being executed is put back, and carries on once the pipe is re-armed
+    bool parking = error_occurred && pipe->flags.poll_parking && !pipe->flags.abort_requested;
+    usb_transfer_status_t error_status = (error_occurred && !parking) ? pipe_decode_error_status(pipe) : USB_TRANSFER_STATUS_COMPLETED;
+    bool stopped = false;           //The batch stopped before this IRP's descriptor was executed
+    usb_irp_t *requeue_tail = NULL; //Last IRP put back onto the front of the pending tailq
+    usb_irp_t *irp = pipe->inflight_irp;
+    int desc_idx = 0;
+    while (irp != NULL) {
+        usb_irp_t *next_irp = (irp == pipe->inflight_irp) ? TAILQ_FIRST(&pipe->chained_irp_tailq) : TAILQ_NEXT(irp, tailq_entry);
+        bool is_last = (next_irp == NULL);
+        bool requeue = false;
+        int num_irp_desc;
+        int num_bytes;
+        bool irp_done = _xfer_desc_list_parse_bulk_irp(pipe, irp, desc_idx, &num_irp_desc, &num_bytes);
+        //The channel was halted by the poll window, or to abort a later IRP of the batch. This one was not aborted
+        bool halted_early = parking || (error_status == USB_TRANSFER_STATUS_CANCELLED && !(irp->reserved_flags & IRP_FLAG_ABORT));
+        if (!stopped && irp_done && !(error_occurred && is_last)) {
+            irp->actual_num_bytes += num_bytes;
+            irp->status = USB_TRANSFER_STATUS_COMPLETED;
+        } else if (!stopped && halted_early) {
+            //This IRP was being executed when the channel halted. Its descriptors hold the number of bytes that got
+            //through before the halt. Unless that finished it, it is still pending: the device didn't end it, so it must
+            //not look like a short packet (or be cut short by someone else's abort). It resumes after those bytes, and
+            //the pipe's data toggle (saved on halt) carries on from them
+            irp->actual_num_bytes += num_bytes;
+            irp->status = USB_TRANSFER_STATUS_COMPLETED;
+            stopped = true;
+            requeue = !irp_done;
+        } else if (!stopped && (error_occurred || irp == pipe->inflight_irp)) {
+            //This IRP was being executed when the batch stopped. If it was aborted, its descriptors hold the number of
+            //bytes that got through before the channel halted. For other errors, we assume no bytes transmitted.
+            assert(error_occurred);
+            irp->actual_num_bytes += (error_status == USB_TRANSFER_STATUS_CANCELLED) ? num_bytes : 0;
+            irp->status = error_status;
+            stopped = true;
+        } else if (irp->reserved_flags & IRP_FLAG_ABORT) {
+            //Never executed, and being aborted
+            irp->actual_num_bytes = 0;
+            irp->status = USB_TRANSFER_STATUS_CANCELLED;
+            stopped = true;
+        } else {
+            //Never executed (e.g., the channel halted on a short packet)
+            requeue = true;
+            stopped = true;
+        }
+        if (requeue) {
+            //Return it to the front of the pending tailq
+            if (irp == pipe->inflight_irp) {
+                pipe->inflight_irp = NULL;
+            } else {
+                TAILQ_REMOVE(&pipe->chained_irp_tailq, irp, tailq_entry);
+                pipe->num_irp_chained--;
+            }
+            if (requeue_tail == NULL) {
+                TAILQ_INSERT_HEAD(&pipe->pending_irp_tailq, irp, tailq_entry);
+            } else {
+                TAILQ_INSERT_AFTER(&pipe->pending_irp_tailq, requeue_tail, irp, tailq_entry);
+            }
+            requeue_tail = irp;
+            pipe->num_irp_pending++;
+            pipe->next_num_irps = 0;    //The front of the pending tailq changed, so the prepared list is stale
+            IRP_STATE_SET(irp->reserved_flags, IRP_STATE_PENDING);
+        }
+        irp->reserved_flags &= ~IRP_FLAG_ABORT;
+        irp = next_irp;
+        desc_idx += num_irp_desc;
+    }
+    if (pipe->inflight_irp == NULL && pipe->num_irp_chained > 0) {
+        //The stopped IRP was put back, but aborted IRPs behind it still need returning
+        pipe->inflight_irp = TAILQ_FIRST(&pipe->chained_irp_tailq);
+        TAILQ_REMOVE(&pipe->chained_irp_tailq, pipe->inflight_irp, tailq_entry);
+        pipe->num_irp_chained--;
+    }
+}
+
 static void _xfer_desc_list_parse(pipe_t *pipe, bool error_occurred)
 {
     assert(pipe->inflight_irp != NULL);
@@ -1730,35 +2742,35 @@ static void _xfer_desc_list_parse(pipe_t *pipe, bool error_occurred)
     assert(xfer_desc_list == pipe->xfer_desc_list);
     (void) xfer_desc_len;
 
+    if (pipe->ep_char.type == USB_PRIV_XFER_TYPE_BULK) {
+        //Bulk descriptor lists can hold a batch of IRPs
+        _xfer_desc_list_parse_bulk(pipe, error_occurred);
+        //Any abort or park request for this batch has now been resolved
+        pipe->flags.abort_requested = 0;
+        pipe->flags.poll_parking = 0;
+        return;
+    }
+
     //Parse the transfer descriptor list for the result of the transfer
     usb_irp_t *irp = pipe->inflight_irp;
     usb_transfer_status_t xfer_status;
     int xfer_rem_len;
+    bool parse_descs = !error_occurred;
     if (error_occurred) {
         //Either a pipe error has occurred or the pipe is no longer valid
-        if (pipe->state == HCD_PIPE_STATE_INVALID) {
-            xfer_status = USB_TRANSFER_STATUS_NO_DEVICE;
-        } else {
-            //Must have been a pipe error event
-            switch (pipe->last_event) {
-                case HCD_PIPE_EVENT_ERROR_XFER: //Excessive transaction error
-                    xfer_status = USB_TRANSFER_STATUS_ERROR;
-                    break;
-                case HCD_PIPE_EVENT_ERROR_OVERFLOW:
-                    xfer_status = USB_TRANSFER_STATUS_OVERFLOW;
-                    break;
-                case HCD_PIPE_EVENT_ERROR_STALL:
-                    xfer_status = USB_TRANSFER_STATUS_STALL;
-                    break;
-                default:
-                    //HCD_PIPE_EVENT_ERROR_IRP_NOT_AVAIL should never occur
-                    abort();
-                    break;
+        xfer_status = pipe_decode_error_status(pipe);
+        //The descriptors of an aborted IRP are written back up to where the channel halted, so they are parsed for
+        //the number of bytes that did get through. For other errors, we assume no bytes transmitted.
+        parse_descs = (xfer_status == USB_TRANSFER_STATUS_CANCELLED);
+        xfer_rem_len = irp->num_bytes;
+        if (pipe->ep_char.type == USB_PRIV_XFER_TYPE_ISOCHRONOUS && !parse_descs) {
+            for (int i = 0; i < irp->num_iso_packets; i++) {
+                irp->iso_packet_desc[i].actual_length = 0;
+                irp->iso_packet_desc[i].status = xfer_status;
             }
         }
-        //We assume no bytes transmitted because of an error.
-        xfer_rem_len = irp->num_bytes;
-    } else {
+    }
+    if (parse_descs) {
         int desc_status;
         switch (pipe->ep_char.type) {
             case USB_XFER_TYPE_CTRL: {
@@ -1776,25 +2788,88 @@ static void _xfer_desc_list_parse(pipe_t *pipe, bool error_occurred)
                 usbh_hal_xfer_desc_parse(pipe->xfer_desc_list, 0, &xfer_rem_len, &desc_status);
                 break;
             }
-            default: {
-                //We don't supportISOC and INTR pipes yet
-                desc_status = USBH_HAL_XFER_DESC_STS_NOT_EXECUTED;
-                xfer_rem_len = 0;
-                xfer_status = USB_TRANSFER_STATUS_ERROR;
-                abort();
+            case USB_XFER_TYPE_INTR: {
+                //Add up each packet. A short IN packet ends the transfer early, so the rest are not executed
+                int mps = pipe->ep_char.mps;
+                int xfer_len = 0;
+                desc_status = USBH_HAL_XFER_DESC_STS_SUCCESS;
+                for (int i = 0; i < pipe->flags.xfer_desc_num_filled; i++) {
+                    int desc_len = (irp->num_bytes - i * mps < mps) ? irp->num_bytes - i * mps : mps;
+                    int desc_rem_len;
+                    usbh_hal_xfer_desc_parse(pipe->xfer_desc_list, i, &desc_rem_len, &desc_status);
+                    xfer_len += desc_len - desc_rem_len;
+                    if (desc_rem_len > 0) {
+                        break;  //Short packet
+                    }
+                }
+                xfer_rem_len = irp->num_bytes - xfer_len;
+                break;
+            }
+            default: {  //USB_XFER_TYPE_ISOCHRONOUS
+                //Each packet has its own status. A failed packet is not retried, and doesn't fail the whole IRP
+                int interval = pipe->ep_char.periodic.interval;
+                int xfer_len = 0;
+                for (int i = 0; i < irp->num_iso_packets; i++) {
+                    usb_iso_packet_desc_t *pkt = &irp->iso_packet_desc[i];
+                    int pkt_rem_len;
+                    int pkt_status;
+                    int desc_idx = (pipe->isoc_start_idx + i * interval) & (XFER_LIST_LEN_ISOC - 1);
+                    usbh_hal_xfer_desc_parse(pipe->xfer_desc_list, desc_idx, &pkt_rem_len, &pkt_status);
+                    switch (pkt_status) {
+                        case USBH_HAL_XFER_DESC_STS_SUCCESS:
+                            pkt->actual_length = pkt->length - pkt_rem_len;
+                            pkt->status = USB_TRANSFER_STATUS_COMPLETED;
+                            break;
+                        case USBH_HAL_XFER_DESC_STS_BUFFER_ERR:
+                            pkt->actual_length = 0;
+                            pkt->status = USB_TRANSFER_STATUS_OVERFLOW;
+                            break;
+                        default:    //USBH_HAL_XFER_DESC_STS_PKTERR or USBH_HAL_XFER_DESC_STS_NOT_EXECUTED
+                            pkt->actual_length = 0;
+                            pkt->status = USB_TRANSFER_STATUS_ERROR;
+                            break;
+                    }
+                    xfer_len += pkt->actual_length;
+                }
+                desc_status = USBH_HAL_XFER_DESC_STS_SUCCESS;
+                xfer_rem_len = irp->num_bytes - xfer_len;
                 break;
             }
         }
-        xfer_status = USB_TRANSFER_STATUS_COMPLETED;
-        assert(desc_status == USBH_HAL_XFER_DESC_STS_SUCCESS);
+        if (!error_occurred) {
+            xfer_status = USB_TRANSFER_STATUS_COMPLETED;
+            assert(desc_status == USBH_HAL_XFER_DESC_STS_SUCCESS);
+        }
+        (void) desc_status;
     }
     //Write back results to IRP
     irp->actual_num_bytes = irp->num_bytes - xfer_rem_len;
     irp->status = xfer_status;
+    //Any abort request for this IRP has now been resolved
+    irp->reserved_flags &= ~IRP_FLAG_ABORT;
+    pipe->flags.abort_requested = 0;
 }
 
 // ----------------------- Public --------------------------
 
+static bool pipe_isoc_irp_is_valid(pipe_t *pipe, usb_irp_t *irp)
+{
+    //The packets must fit in the descriptor list, and exactly cover the IRP's data buffer
+    if (irp->num_iso_packets <= 0
+        || pipe_isoc_num_desc(irp->num_iso_packets, pipe->ep_char.periodic.interval) > XFER_LIST_LEN_ISOC) {
+        return false;
+    }
+    int num_bytes = 0;
+    for (int i = 0; i < irp->num_iso_packets; i++) {
+        int len = irp->iso_packet_desc[i].length;
+        if (len < 0 || len > pipe->ep_char.mps) {
+            return false;
+        }
+        num_bytes += len;
+    }
+    return num_bytes == irp->num_bytes;
+}
+
 esp_err_t hcd_irp_enqueue(hcd_pipe_handle_t ctrl_pipe, usb_irp_t *irp)
 {
     //Check that IRP has not already been enqueued
@@ -1802,6 +2877,18 @@ esp_err_t hcd_irp_enqueue(hcd_pipe_handle_t ctrl_pipe, usb_irp_t *irp)
               && IRP_STATE_GET(irp->reserved_flags) == IRP_STATE_IDLE,
               ESP_ERR_INVALID_STATE);
     pipe_t *pipe = (pipe_t *)ctrl_pipe;
+    //Interrupt IRPs need a descriptor per packet
+    HCD_CHECK(pipe->ep_char.type != USB_PRIV_XFER_TYPE_INTR || irp->num_bytes <= XFER_LIST_LEN_INTR * pipe->ep_char.mps,
+              ESP_ERR_INVALID_SIZE);
+    //Bulk and interrupt IN IRPs must be whole packets, otherwise a full packet from the device would overrun the buffer.
+    //A short packet ends the IRP early, with actual_num_bytes set to what was received
+    HCD_CHECK(!(pipe->ep_char.type == USB_PRIV_XFER_TYPE_BULK || pipe->ep_char.type == USB_PRIV_XFER_TYPE_INTR)
+              || !(pipe->ep_char.bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_DIR_MASK)
+              || irp->num_bytes % pipe->ep_char.mps == 0,
+              ESP_ERR_INVALID_SIZE);
+    if (pipe->ep_char.type == USB_PRIV_XFER_TYPE_ISOCHRONOUS) {
+        HCD_CHECK(pipe_isoc_irp_is_valid(pipe, irp), ESP_ERR_INVALID_SIZE);
+    }
 
     HCD_ENTER_CRITICAL();
     //Check that pipe and port are in the corrrect state to receive IRPs
@@ -1811,28 +2898,27 @@ esp_err_t hcd_irp_enqueue(hcd_pipe_handle_t ctrl_pipe, usb_irp_t *irp)
                         ESP_ERR_INVALID_STATE);
     //Use the IRP's reserved_ptr to store the pipe's
     irp->reserved_ptr = (void *)pipe;
-
-    //Check if we can start execution on the pipe immediately
-    if (!pipe->flags.paused && pipe->num_irp_pending == 0 && pipe->inflight_irp == NULL) {
-        //Pipe isn't executing any transfers. Start immediately
-        pipe->inflight_irp = irp;
-        _xfer_desc_list_fill(pipe);
-        usbh_hal_chan_activate(pipe->chan_obj, 0);  //Start with the first descriptor
-        //use the IRP's reserved_flags to store the IRP's current state
-        IRP_STATE_SET(irp->reserved_flags, IRP_STATE_INFLIGHT);
-        if (pipe->num_irp_done == 0) {
-            //This is the first IRP to be enqueued into the pipe. Move the pipe to the list of active pipes
-            TAILQ_REMOVE(&pipe->port->pipes_idle_tailq, pipe, tailq_entry);
-            TAILQ_INSERT_TAIL(&pipe->port->pipes_active_tailq, pipe, tailq_entry);
-            pipe->port->num_pipes_idle--;
-            pipe->port->num_pipes_queued++;
-        }
-    } else {
-        //Add the IRP to the pipe's pending tailq
-        TAILQ_INSERT_TAIL(&pipe->pending_irp_tailq, irp, tailq_entry);
-        pipe->num_irp_pending++;
-        //use the IRP's reserved_flags to store the IRP's current state
-        IRP_STATE_SET(irp->reserved_flags, IRP_STATE_PENDING);
+    //Bulk IRPs count their progress here whilst they are enqueued, as they can be stopped early and resumed
+    irp->actual_num_bytes = 0;
+
+    //Add the IRP to the pipe's pending tailq
+    TAILQ_INSERT_TAIL(&pipe->pending_irp_tailq, irp, tailq_entry);
+    pipe->num_irp_pending++;
+    //use the IRP's reserved_flags to store the IRP's current state
+    IRP_STATE_SET(irp->reserved_flags, IRP_STATE_PENDING);
+    if (pipe->num_irp_pending == 1 && pipe->inflight_irp == NULL && pipe->num_irp_done == 0) {
+        //This is the first IRP to be enqueued into the pipe. Move the pipe to the list of active pipes
+        TAILQ_REMOVE(&pipe->port->pipes_idle_tailq, pipe, tailq_entry);
+        TAILQ_INSERT_TAIL(&pipe->port->pipes_active_tailq, pipe, tailq_entry);
+        pipe->port->num_pipes_idle--;
+        pipe->port->num_pipes_queued++;
+    }
+    //Check if we can start execution on the pipe immediately (i.e., the pipe isn't executing any transfers)
+    if (!pipe->flags.paused && pipe->inflight_irp == NULL) {
+        _pipe_start_next(pipe);
+    } else if (pipe->inflight_irp != NULL) {
+        //Prepare the IRP in the spare list now, so that the ISR only needs to activate it
+        _xfer_desc_list_prepare(pipe);
     }
     HCD_EXIT_CRITICAL();
     return ESP_OK;
@@ -1880,13 +2966,36 @@ esp_err_t hcd_irp_abort(usb_irp_t *irp)
         //Remove it form the pending queue
         TAILQ_REMOVE(&pipe->pending_irp_tailq, irp, tailq_entry);
         pipe->num_irp_pending--;
+        pipe->next_num_irps = 0;    //The prepared list may contain the IRP
         //Add it to the done queue
         TAILQ_INSERT_TAIL(&pipe->done_irp_tailq, irp, tailq_entry);
         pipe->num_irp_done++;
         //Update the IRP's current state and status
         IRP_STATE_SET(irp->reserved_flags, IRP_STATE_DONE);
         irp->status = USB_TRANSFER_STATUS_CANCELLED;
-    }// Otherwise, the IRP is in-flight or already done thus cannot be aborted
+    } else if (IRP_STATE_GET(irp->reserved_flags) == IRP_STATE_INFLIGHT) {
+        //IRP is being executed. Halt the channel to abort it
+        pipe_t *pipe = (pipe_t *)irp->reserved_ptr;
+        //Can't abort if the device is gone, or a pipe command is already stopping the transfer
+        if (pipe->port->flags.conn_devc_ena && !pipe->flags.waiting_xfer_done) {
+            //Mark which IRP of the batch is being aborted
+            irp->reserved_flags |= IRP_FLAG_ABORT;
+        }
+        if (pipe->port->flags.conn_devc_ena && !pipe->flags.abort_requested && !pipe->flags.waiting_xfer_done) {
+            pipe->flags.abort_requested = 1;
+            if (usbh_hal_chan_slot_request_halt(pipe->chan_obj)) {
+                //Channel was already halted. Retire the IRP now, keeping the data toggle for the pipe's next IRP
+                bool yield = false;
+                pipe->flags.data_pid = usbh_hal_chan_get_pid(pipe->chan_obj);
+                pipe->flags.data_pid_restore = 1;
+                _xfer_desc_list_parse(pipe, true);
+                _pipe_return_cur_irp(pipe);
+                _pipe_start_next_or_notify(pipe, &yield);
+                (void) yield;
+            }
+            //Otherwise, the IRP is retired by the USBH_HAL_CHAN_EVENT_HALT_REQ interrupt
+        }
+    }// Otherwise, the IRP is already done thus cannot be aborted
     HCD_EXIT_CRITICAL();
     return ESP_OK;
 }
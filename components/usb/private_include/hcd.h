@@ -170,6 +170,10 @@ typedef struct {
     hcd_port_isr_callback_t callback;       /**< HCD port event callback */
     void *callback_arg;                     /**< User argument for HCD port callback */
     void *context;
+    int defer_task_priority;                /**< 0 to run the port's and its pipes' callbacks from the ISR. Otherwise, the ISR
+                                                 only records events, and a task of this priority runs the callbacks
+                                                 (with in_isr set to false). Those callbacks must not block either, as
+                                                 hcd_pipe_free() waits for the task to finish delivering its batch */
 } hcd_port_config_t;
 
 /**
@@ -184,6 +188,13 @@ typedef struct {
     usb_desc_ep_t *ep_desc;                 /**< Pointer to endpoint descriptor of the pipe */
     uint8_t dev_addr;                       /**< Device address of the pipe */
     usb_speed_t dev_speed;                  /**< Speed of the device */
+    uint16_t nak_poll_frames;               /**< Bulk IN only. If the device sends nothing (i.e., NAKs) for this many frames,
+                                                 the pipe stops polling and frees its channel. 0 to poll for as long as
+                                                 an IRP is in flight. A frame is 1ms. An IRP that was partly filled when
+                                                 polling stopped is not completed: it stays at the head of the pipe's
+                                                 queue and carries on from where it was once polling resumes, so only
+                                                 a short packet (or a full IRP) ends it */
+    uint16_t nak_rearm_frames;              /**< Bulk IN only. Frames to wait before polling again after nak_poll_frames */
 } hcd_pipe_config_t;
 
 // --------------------------------------------- Host Controller Driver ------------------------------------------------
@@ -224,6 +235,10 @@ esp_err_t hcd_uninstall(void);
  * After a port is initialized, it will be put into the HCD_PORT_STATE_NOT_POWERED state.
  *
  * @note The host controller only has one port, thus the only valid port_number is 1
+ * @note If port_config->defer_task_priority is set, a bottom half task is created for the port. The ISR then records
+ *       events into a ring that the task drains in batches, so callbacks run outside of the ISR. Consecutive
+ *       HCD_PIPE_EVENT_IRP_DONE events of a pipe are delivered once per batch. If the ring overflows, only the latest
+ *       event of each pipe (or of the port) that could not be recorded is delivered, once the task catches up.
  *
  * @param[in] port_number Port number
  * @param[in] port_config Port configuration
@@ -339,8 +354,14 @@ void *hcd_port_get_ctx(hcd_port_handle_t port_hdl);
  * When allocating a pipe, the HCD will assess whether there are sufficient resources (i.e., bus time, and controller
  * channels). If sufficient, the pipe will be allocated.
  *
- * @note Currently, Interrupt and Isochronous pipes are not supported yet
+ * @note Interrupt pipes are polled every bInterval frames, rounded down to a power of 2 (at most 32 frames)
+ * @note Isochronous pipes are serviced every 2^(bInterval - 1) frames (at most 32 frames)
  * @note The host port must be in the enabled state before a pipe can be allcoated
+ * @note A pipe is only bound to one of the controller's hardware channels whilst it has IRPs to execute. Thus more pipes
+ *       can be allocated than there are channels. When all channels are in use, pipes with IRPs take turns (in the
+ *       order they started waiting), with each pipe giving up its channel after each transfer. Interrupt and
+ *       isochronous pipes are the exception. Once bound, they keep their channel until they are freed, so that they
+ *       never miss a service interval.
  *
  * @param[in] port_hdl Handle of the port this pipe will be routed through
  * @param[in] pipe_config Pipe configuration
@@ -361,6 +382,9 @@ esp_err_t hcd_pipe_alloc(hcd_port_handle_t port_hdl, const hcd_pipe_config_t *pi
  * must be in following condition before it can be freed:
  * - All IRPs have been dequeued
  *
+ * @note Bulk IN pipes with a poll window (see hcd_pipe_config_t.nak_poll_frames) wait for the esp_timer task here, so
+ *       they must not be freed from an esp_timer callback
+ *
  * @param ctrl_pipe Pipe handle
  *
  * @retval ESP_OK: Pipe successfully freed
@@ -441,11 +465,21 @@ hcd_pipe_event_t hcd_pipe_get_event(hcd_pipe_handle_t ctrl_pipe);
  * - The IRP is properly initialized (data buffer and transfer length are set)
  * - The IRP must not already be enqueued
  * - The pipe must be in the HCD_PIPE_STATE_ACTIVE state
+ * - Bulk IRPs may be executed back to back with other pending IRPs, and are then completed together (i.e., a single
+ *   HCD_PIPE_EVENT_IRP_DONE event for multiple IRPs)
+ * - Interrupt IRPs can be at most 32 packets
+ * - Bulk and interrupt IN IRPs must be a multiple of MPS. A short packet (or zero length packet) from the device
+ *   completes the IRP early, and actual_num_bytes holds the number of bytes received
+ * - Isochronous IRPs must fill in num_iso_packets and iso_packet_desc[]. Each packet is at most MPS, the packet
+ *   lengths must add up to num_bytes, and the packets must fit in 32 frames (i.e., 32 / interval packets). Each
+ *   packet's actual_length and status are written back once the IRP is done
  *
  * @param ctrl_pipe Pipe handle
  * @param irp I/O Request Packet to enqueue
  * @retval ESP_OK: IRP enqueued successfully
  * @retval ESP_ERR_INVALID_STATE: Conditions not met to enqueue IRP
+ * @retval ESP_ERR_INVALID_SIZE: IN IRP is not a multiple of MPS, Interrupt or Isochronous IRP is too long, or
+ *                               its packets are invalid
  */
 esp_err_t hcd_irp_enqueue(hcd_pipe_handle_t ctrl_pipe, usb_irp_t *irp);
 
@@ -465,8 +499,19 @@ usb_irp_t *hcd_irp_dequeue(hcd_pipe_handle_t ctrl_pipe);
  * @brief Abort an enqueued IRP
  *
  * This function will attempt to abort an IRP that is already enqueued. If the IRP has yet to be executed, it will be
- * "cancelled" and can then be dequeued. If the IRP is currenty inflight or has already completed, the IRP will not be
- * affected by this function.
+ * "cancelled" and can then be dequeued. If the IRP is currently in-flight, the pipe's channel is halted. Once the
+ * channel halts, the IRP is "cancelled" and a HCD_PIPE_EVENT_IRP_DONE event occurs so that it can be dequeued. The
+ * pipe's state is not affected, and the pipe carries on with its next pending IRP. If the IRP has already completed,
+ * the IRP will not be affected by this function.
+ *
+ * @note A pending IRP is cancelled without a pipe event. The caller is responsible for dequeuing it.
+ * @note An aborted in-flight IRP reports the bytes that were transferred before the channel halted in actual_num_bytes.
+ *       The pipe's data toggle is preserved, so the pipe's next IRP carries on from where the aborted IRP stopped.
+ * @note Bulk pipes execute several IRPs back to back as a batch. If the aborted IRP is queued behind other IRPs in the
+ *       same batch, the channel is still halted, but only the aborted IRP is cancelled. The IRP that is being executed
+ *       when the channel halts is returned to the front of the pending queue with the bytes transferred so far kept,
+ *       and later carries on after them, so it is never cut short. The batch's IRPs that were not executed yet are
+ *       returned to the pending queue behind it. The data toggle carries on in either case.
  *
  * @param irp I/O Request Packet to abort
  * @retval ESP_OK: IRP successfully aborted, or was not affected by this function
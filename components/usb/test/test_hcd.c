@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include <stdio.h>
+#include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 #include "unity.h"
@@ -21,6 +22,7 @@
 #include "esp_err.h"
 #include "esp_attr.h"
 #include "esp_rom_gpio.h"
+#include "esp_rom_sys.h"
 #include "soc/gpio_pins.h"
 #include "soc/gpio_sig_map.h"
 #include "hal/usbh_ll.h"
@@ -612,7 +614,8 @@ TEST_CASE("Test HCD pipe transfer request", "[hcd][ignore]")
         expect_pipe_event(pipe_evt_queue, default_pipe, HCD_PIPE_EVENT_XFER_REQ_DONE);
     }
 
-    //Dequeue transfer requests and check results.
+    //Dequeue transfer requests and check results. Keep a copy of the device descriptor
+    uint8_t devc_desc[USB_DESC_DEV_SIZE];
     for (int i = 0; i < NUM_XFER_REQS; i++) {
         hcd_xfer_req_handle_t req_hdl = hcd_xfer_req_dequeue(default_pipe);
         TEST_ASSERT_EQUAL(req_hdls[i], req_hdl);
@@ -623,8 +626,10 @@ TEST_CASE("Test HCD pipe transfer request", "[hcd][ignore]")
         TEST_ASSERT_EQUAL(default_pipe, ctrl_pipe);
         TEST_ASSERT_EQUAL(irp, irps[i]);
         TEST_ASSERT_EQUAL(USB_TRANSFER_STATUS_COMPLETED, irp->status);
+        TEST_ASSERT_EQUAL(USB_DESC_DEV_SIZE, irp->actual_num_bytes);
         TEST_ASSERT_EQUAL(NULL, context);
     }
+    memcpy(devc_desc, data_buffers[0] + sizeof(usb_ctrl_req_t), USB_DESC_DEV_SIZE);
 
     //Enqueue them again but abort them short after
     for (int i = 0; i < NUM_XFER_REQS; i++) {
@@ -637,6 +642,7 @@ TEST_CASE("Test HCD pipe transfer request", "[hcd][ignore]")
 
     expect_pipe_event(pipe_evt_queue, default_pipe, HCD_PIPE_EVENT_XFER_REQ_DONE);
     //Dequeue transfer rqeuests and check results of aborted transfer request
+    int num_partial = 0;
     for (int i = 0; i < NUM_XFER_REQS; i++) {
         hcd_xfer_req_handle_t req_hdl = hcd_xfer_req_dequeue(default_pipe);
         hcd_pipe_handle_t ctrl_pipe;
@@ -645,9 +651,21 @@ TEST_CASE("Test HCD pipe transfer request", "[hcd][ignore]")
         hcd_xfer_req_get_target(req_hdl, &ctrl_pipe, &irp, &context);
         TEST_ASSERT_EQUAL(default_pipe, ctrl_pipe);
         //No need to check req_hdl or IRP order as abort will cause them to dequeu out of order
-        TEST_ASSERT(irp->status == USB_TRANSFER_STATUS_COMPLETED || irp->status == USB_TRANSFER_STATUS_CANCELLED);
+        if (irp->status == USB_TRANSFER_STATUS_COMPLETED) {
+            //Finished before the abort. Must be the same (whole) descriptor
+            TEST_ASSERT_EQUAL(USB_DESC_DEV_SIZE, irp->actual_num_bytes);
+            TEST_ASSERT_EQUAL_MEMORY(devc_desc, irp->data_buffer + sizeof(usb_ctrl_req_t), USB_DESC_DEV_SIZE);
+        } else {
+            //Only the transfer request that was in-flight when aborted can report a partial length
+            TEST_ASSERT_EQUAL(USB_TRANSFER_STATUS_CANCELLED, irp->status);
+            TEST_ASSERT_LESS_OR_EQUAL(USB_DESC_DEV_SIZE, irp->actual_num_bytes);
+            if (irp->actual_num_bytes > 0) {
+                num_partial++;
+            }
+        }
         TEST_ASSERT_EQUAL(NULL, context);
     }
+    TEST_ASSERT_LESS_OR_EQUAL(1, num_partial);
 
     //Free transfer requests
     free_pipe_and_xfer_reqs(default_pipe, req_hdls, data_buffers, irps, NUM_XFER_REQS);
@@ -831,3 +849,271 @@ TEST_CASE("Test HCD pipe runtime halt and clear", "[hcd][ignore]")
     wait_for_disconnection(port_hdl, port_evt_queue, false);
     teardown(port_evt_queue, pipe_evt_queue, port_hdl);
 }
+
+/*
+Test HCD bulk IN abort and resubmit
+
+Purpose:
+    - Test that an in-flight bulk IN IRP that is aborted reports the number of bytes received before the channel halted
+    - Test that the pipe's data toggle carries on from the aborted IRP, so that resubmitting the rest of the transfer
+      neither drops nor duplicates any data (a toggle mismatch makes one side discard a packet)
+    - Test that aborting the last IRP of a batch, whilst the IRP before it is in flight, does not cut that IRP short
+
+Procedure:
+    - Setup HCD and a port. A mass storage (Bulk-Only Transport) device must be connected, with the bulk endpoints
+      and max packet size given by the TEST_MSC_... defines below
+    - Address and configure the device, then allocate its bulk pipes
+    - Read TEST_MSC_NUM_SECTORS sectors in one IRP as a reference
+    - Read the same sectors again, but abort the data IRP while it is in flight, then submit a second IRP for the rest
+    - Check that both reads returned the same data, and that the device's status reports no residue
+    - Read the same sectors a third time, split over three IRPs. The first holds a single packet, and waits for the
+      device whilst the other two are batched behind it. Abort the last one whilst the middle one is in flight
+    - Check that the middle IRP completed with all its bytes, resubmit the rest of the aborted one, and compare again
+    - Teardown
+*/
+
+#define TEST_MSC_DEV_ADDR       1
+#define TEST_MSC_CONFIG_NUM     1
+#define TEST_MSC_EP_OUT         0x01    //Change these to match the device under test
+#define TEST_MSC_EP_IN          0x82
+#define TEST_MSC_MPS            64
+#define TEST_MSC_SECTOR_SIZE    512
+#define TEST_MSC_NUM_SECTORS    32
+#define TEST_MSC_DATA_LEN       (TEST_MSC_SECTOR_SIZE * TEST_MSC_NUM_SECTORS)
+#define TEST_MSC_CBW_LEN        31
+#define TEST_MSC_CSW_LEN        13
+#define TEST_MSC_ABORT_DELAY_US 2000    //Long enough for some packets, well short of the whole read at full speed
+#define TEST_MSC_BATCH_MID_LEN  (TEST_MSC_DATA_LEN / 2 - TEST_MSC_MPS)  //Middle IRP of the batched read
+
+static usb_irp_t *alloc_irp(int num_bytes)
+{
+    usb_irp_t *irp = heap_caps_calloc(1, sizeof(usb_irp_t), MALLOC_CAP_DEFAULT);
+    TEST_ASSERT_NOT_EQUAL(NULL, irp);
+    irp->data_buffer = heap_caps_calloc(1, num_bytes, MALLOC_CAP_DMA);
+    TEST_ASSERT_NOT_EQUAL(NULL, irp->data_buffer);
+    irp->num_bytes = num_bytes;
+    return irp;
+}
+
+static void free_irp(usb_irp_t *irp)
+{
+    heap_caps_free(irp->data_buffer);
+    heap_caps_free(irp);
+}
+
+static void xfer_irp_and_wait(hcd_pipe_handle_t pipe, QueueHandle_t pipe_evt_queue, usb_irp_t *irp)
+{
+    TEST_ASSERT_EQUAL(ESP_OK, hcd_irp_enqueue(pipe, irp));
+    expect_pipe_event(pipe_evt_queue, pipe, HCD_PIPE_EVENT_IRP_DONE);
+    TEST_ASSERT_EQUAL(irp, hcd_irp_dequeue(pipe));
+    TEST_ASSERT_EQUAL(USB_TRANSFER_STATUS_COMPLETED, irp->status);
+}
+
+//Read the rest of an IRP that was aborted after 'received' bytes. Its data toggle carries on from the aborted IRP
+static void resubmit_rest(hcd_pipe_handle_t pipe, QueueHandle_t pipe_evt_queue, usb_irp_t *irp, int received)
+{
+    uint8_t *buffer = irp->data_buffer;
+    int num_bytes = irp->num_bytes;
+    irp->data_buffer = buffer + received;
+    irp->num_bytes = num_bytes - received;
+    xfer_irp_and_wait(pipe, pipe_evt_queue, irp);
+    TEST_ASSERT_EQUAL(num_bytes - received, irp->actual_num_bytes);
+    irp->data_buffer = buffer;
+    irp->num_bytes = num_bytes;
+}
+
+static void msc_fill_read10_cbw(uint8_t *cbw, uint32_t tag)
+{
+    memset(cbw, 0, TEST_MSC_CBW_LEN);
+    memcpy(cbw, "USBC", 4);
+    memcpy(cbw + 4, &tag, 4);   //Little endian
+    uint32_t data_len = TEST_MSC_DATA_LEN;
+    memcpy(cbw + 8, &data_len, 4);
+    cbw[12] = 0x80;             //Data IN
+    cbw[14] = 10;               //Command block length
+    cbw[15] = 0x28;             //READ(10) from LBA 0. Sector count is big endian
+    cbw[22] = TEST_MSC_NUM_SECTORS >> 8;
+    cbw[23] = TEST_MSC_NUM_SECTORS & 0xFF;
+}
+
+static void msc_check_csw(usb_irp_t *csw_irp, uint32_t tag)
+{
+    uint8_t *csw = csw_irp->data_buffer;
+    uint32_t csw_tag;
+    uint32_t residue;
+    memcpy(&csw_tag, csw + 4, 4);
+    memcpy(&residue, csw + 8, 4);
+    TEST_ASSERT_EQUAL(TEST_MSC_CSW_LEN, csw_irp->actual_num_bytes);
+    TEST_ASSERT_EQUAL_MEMORY("USBS", csw, 4);
+    TEST_ASSERT_EQUAL(tag, csw_tag);
+    TEST_ASSERT_EQUAL(0, residue);
+    TEST_ASSERT_EQUAL(0, csw[12]);  //Command passed
+}
+
+static hcd_pipe_handle_t alloc_bulk_pipe(hcd_port_handle_t port_hdl, QueueHandle_t pipe_evt_queue, uint8_t ep_addr)
+{
+    usb_speed_t port_speed;
+    TEST_ASSERT_EQUAL(ESP_OK, hcd_port_get_speed(port_hdl, &port_speed));
+    usb_desc_ep_t ep_desc = {
+        .bLength = USB_DESC_EP_SIZE,
+        .bDescriptorType = USB_W_VALUE_DT_ENDPOINT,
+        .bEndpointAddress = ep_addr,
+        .bmAttributes = USB_BM_ATTRIBUTES_XFER_BULK,
+        .wMaxPacketSize = TEST_MSC_MPS,
+        .bInterval = 0,
+    };
+    hcd_pipe_config_t config = {
+        .callback = pipe_callback,
+        .callback_arg = (void *)pipe_evt_queue,
+        .context = NULL,
+        .ep_desc = &ep_desc,
+        .dev_addr = TEST_MSC_DEV_ADDR,
+        .dev_speed = port_speed,
+        .nak_poll_frames = 0,   //Keep polling, so the abort is what stops the channel
+    };
+    hcd_pipe_handle_t pipe;
+    TEST_ASSERT_EQUAL(ESP_OK, hcd_pipe_alloc(port_hdl, &config, &pipe));
+    TEST_ASSERT_NOT_EQUAL(NULL, pipe);
+    return pipe;
+}
+
+TEST_CASE("Test HCD bulk IN abort and resubmit", "[hcd][ignore]")
+{
+    QueueHandle_t port_evt_queue;
+    QueueHandle_t pipe_evt_queue;
+    hcd_port_handle_t port_hdl;
+    setup(&port_evt_queue, &pipe_evt_queue, &port_hdl);
+    wait_for_connection(port_hdl, port_evt_queue);
+    vTaskDelay(pdMS_TO_TICKS(100)); //Short delay send of SOF (for FS) or EOPs (for LS)
+
+    //Address and configure the device through its default pipe
+    usb_speed_t port_speed;
+    TEST_ASSERT_EQUAL(ESP_OK, hcd_port_get_speed(port_hdl, &port_speed));
+    hcd_pipe_config_t default_config = {
+        .callback = pipe_callback,
+        .callback_arg = (void *)pipe_evt_queue,
+        .context = NULL,
+        .ep_desc = NULL,
+        .dev_addr = 0,
+        .dev_speed = port_speed,
+    };
+    hcd_pipe_handle_t default_pipe;
+    TEST_ASSERT_EQUAL(ESP_OK, hcd_pipe_alloc(port_hdl, &default_config, &default_pipe));
+    usb_irp_t *ctrl_irp = alloc_irp(sizeof(usb_ctrl_req_t));
+    ctrl_irp->num_bytes = 0;    //No data stage
+    USB_CTRL_REQ_INIT_SET_ADDR((usb_ctrl_req_t *)ctrl_irp->data_buffer, TEST_MSC_DEV_ADDR);
+    xfer_irp_and_wait(default_pipe, pipe_evt_queue, ctrl_irp);
+    vTaskDelay(pdMS_TO_TICKS(10));  //SET_ADDRESS recovery interval
+    TEST_ASSERT_EQUAL(ESP_OK, hcd_pipe_update(default_pipe, TEST_MSC_DEV_ADDR, (port_speed == USB_SPEED_FULL) ? 64 : 8));
+    USB_CTRL_REQ_INIT_SET_CONFIG((usb_ctrl_req_t *)ctrl_irp->data_buffer, TEST_MSC_CONFIG_NUM);
+    xfer_irp_and_wait(default_pipe, pipe_evt_queue, ctrl_irp);
+
+    //The IN pipe has a queue of its own, so that its events can't be mistaken for the OUT pipe's
+    QueueHandle_t in_evt_queue = xQueueCreate(EVENT_QUEUE_LEN, sizeof(pipe_event_msg_t));
+    TEST_ASSERT_NOT_EQUAL(NULL, in_evt_queue);
+    hcd_pipe_handle_t out_pipe = alloc_bulk_pipe(port_hdl, pipe_evt_queue, TEST_MSC_EP_OUT);
+    hcd_pipe_handle_t in_pipe = alloc_bulk_pipe(port_hdl, in_evt_queue, TEST_MSC_EP_IN);
+    usb_irp_t *cbw_irp = alloc_irp(TEST_MSC_CBW_LEN);
+    usb_irp_t *csw_irp = alloc_irp(TEST_MSC_MPS);   //Bulk IN IRPs must be whole packets. The CSW is a short one
+    usb_irp_t *ref_irp = alloc_irp(TEST_MSC_DATA_LEN);
+    usb_irp_t *data_irp = alloc_irp(TEST_MSC_DATA_LEN);
+
+    //Reference read, in one go
+    msc_fill_read10_cbw(cbw_irp->data_buffer, 1);
+    xfer_irp_and_wait(out_pipe, pipe_evt_queue, cbw_irp);
+    xfer_irp_and_wait(in_pipe, in_evt_queue, ref_irp);
+    TEST_ASSERT_EQUAL(TEST_MSC_DATA_LEN, ref_irp->actual_num_bytes);
+    xfer_irp_and_wait(in_pipe, in_evt_queue, csw_irp);
+    msc_check_csw(csw_irp, 1);
+
+    //Same read, but abort the data IRP part way through
+    msc_fill_read10_cbw(cbw_irp->data_buffer, 2);
+    xfer_irp_and_wait(out_pipe, pipe_evt_queue, cbw_irp);
+    TEST_ASSERT_EQUAL(ESP_OK, hcd_irp_enqueue(in_pipe, data_irp));
+    esp_rom_delay_us(TEST_MSC_ABORT_DELAY_US);
+    TEST_ASSERT_EQUAL(ESP_OK, hcd_irp_abort(data_irp));
+    expect_pipe_event(in_evt_queue, in_pipe, HCD_PIPE_EVENT_IRP_DONE);
+    TEST_ASSERT_EQUAL(data_irp, hcd_irp_dequeue(in_pipe));
+    int received = data_irp->actual_num_bytes;
+    printf("Aborted after %d bytes\n", received);
+    //The device only sends whole packets until the last one, so the halt can only land between packets
+    TEST_ASSERT_EQUAL(0, received % TEST_MSC_MPS);
+    if (data_irp->status == USB_TRANSFER_STATUS_CANCELLED) {
+        TEST_ASSERT_LESS_THAN(TEST_MSC_DATA_LEN, received);
+        //Resubmit for the rest of the data. This IRP must continue with the toggle the aborted one left off at
+        resubmit_rest(in_pipe, in_evt_queue, data_irp, received);
+    } else {
+        //The whole read finished before the abort, so there is nothing to resubmit
+        TEST_ASSERT_EQUAL(USB_TRANSFER_STATUS_COMPLETED, data_irp->status);
+        TEST_ASSERT_EQUAL(TEST_MSC_DATA_LEN, received);
+    }
+    //A dropped packet would shift the data and leave a residue. A duplicated one would shift it the other way
+    TEST_ASSERT_EQUAL_MEMORY(ref_irp->data_buffer, data_irp->data_buffer, TEST_MSC_DATA_LEN);
+    xfer_irp_and_wait(in_pipe, in_evt_queue, csw_irp);
+    msc_check_csw(csw_irp, 2);
+
+    //Same read over three IRPs. The device only gets the command once they are all enqueued, so the first one waits
+    //(the pipe keeps polling), and the other two are batched behind it
+    usb_irp_t *batch_irps[3] = {
+        alloc_irp(TEST_MSC_MPS),
+        alloc_irp(TEST_MSC_BATCH_MID_LEN),
+        alloc_irp(TEST_MSC_DATA_LEN - TEST_MSC_MPS - TEST_MSC_BATCH_MID_LEN),
+    };
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL(ESP_OK, hcd_irp_enqueue(in_pipe, batch_irps[i]));
+    }
+    msc_fill_read10_cbw(cbw_irp->data_buffer, 3);
+    xfer_irp_and_wait(out_pipe, pipe_evt_queue, cbw_irp);
+    //Abort the last IRP of the batch whilst the middle one is in flight
+    esp_rom_delay_us(TEST_MSC_ABORT_DELAY_US);
+    TEST_ASSERT_EQUAL(ESP_OK, hcd_irp_abort(batch_irps[2]));
+    //The halt puts the middle IRP back, so the IRPs can finish in any order, over several events
+    int num_dequeued = 0;
+    while (num_dequeued < 3) {
+        expect_pipe_event(in_evt_queue, in_pipe, HCD_PIPE_EVENT_IRP_DONE);
+        while (hcd_irp_dequeue(in_pipe) != NULL) {
+            num_dequeued++;
+        }
+    }
+    vTaskDelay(pdMS_TO_TICKS(10));
+    xQueueReset(in_evt_queue);  //Events of IRPs that were already dequeued
+    //The first two are never cut short by the abort
+    TEST_ASSERT_EQUAL(USB_TRANSFER_STATUS_COMPLETED, batch_irps[0]->status);
+    TEST_ASSERT_EQUAL(TEST_MSC_MPS, batch_irps[0]->actual_num_bytes);
+    TEST_ASSERT_EQUAL(USB_TRANSFER_STATUS_COMPLETED, batch_irps[1]->status);
+    TEST_ASSERT_EQUAL(TEST_MSC_BATCH_MID_LEN, batch_irps[1]->actual_num_bytes);
+    received = batch_irps[2]->actual_num_bytes;
+    printf("Aborted batch after %d bytes of its last IRP\n", received);
+    TEST_ASSERT_EQUAL(0, received % TEST_MSC_MPS);
+    if (batch_irps[2]->status == USB_TRANSFER_STATUS_CANCELLED) {
+        TEST_ASSERT_LESS_THAN(batch_irps[2]->num_bytes, received);
+        resubmit_rest(in_pipe, in_evt_queue, batch_irps[2], received);
+    } else {
+        TEST_ASSERT_EQUAL(USB_TRANSFER_STATUS_COMPLETED, batch_irps[2]->status);
+        TEST_ASSERT_EQUAL(batch_irps[2]->num_bytes, received);
+    }
+    int offset = 0;
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL_MEMORY(ref_irp->data_buffer + offset, batch_irps[i]->data_buffer, batch_irps[i]->num_bytes);
+        offset += batch_irps[i]->num_bytes;
+    }
+    xfer_irp_and_wait(in_pipe, in_evt_queue, csw_irp);
+    msc_check_csw(csw_irp, 3);
+
+    //Free IRPs and pipes
+    for (int i = 0; i < 3; i++) {
+        free_irp(batch_irps[i]);
+    }
+    free_irp(data_irp);
+    free_irp(ref_irp);
+    free_irp(csw_irp);
+    free_irp(cbw_irp);
+    free_irp(ctrl_irp);
+    TEST_ASSERT_EQUAL(ESP_OK, hcd_pipe_free(in_pipe));
+    TEST_ASSERT_EQUAL(ESP_OK, hcd_pipe_free(out_pipe));
+    TEST_ASSERT_EQUAL(ESP_OK, hcd_pipe_free(default_pipe));
+    vQueueDelete(in_evt_queue);
+    vTaskDelay(pdMS_TO_TICKS(100)); //Short delay send of SOF (for FS) or EOPs (for LS)
+    wait_for_disconnection(port_hdl, port_evt_queue, false);
+    teardown(port_evt_queue, pipe_evt_queue, port_hdl);
+}
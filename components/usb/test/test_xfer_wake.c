@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "unity.h"
+#include "test_utils.h"
+#include "soc/cpu.h"
+
+/*
+Compares how long it takes to wake a task that is blocked waiting for a transfer
+to complete, using an EventGroup (how xesp_usbh_xfer_irp used to wait) versus a
+direct task notification (how it waits now).
+
+The waiter runs at a higher priority than the signaller, so it is woken and
+scheduled immediately. The latency is the number of cpu cycles from just before
+the signal is sent to just after the waiter returns from its wait.
+*/
+
+#define WAKE_BENCH_ITERATIONS   1000
+#define WAKE_BENCH_EVENT        1 // HCD_PIPE_EVENT_IRP_DONE
+
+typedef struct {
+    bool use_notify;
+    EventGroupHandle_t event_group;
+    SemaphoreHandle_t done;
+    volatile uint32_t signal_ccount;
+    uint32_t total_cycles;
+    uint32_t max_cycles;
+} wake_bench_t;
+
+static void wake_bench_waiter(void *arg)
+{
+    wake_bench_t *bench = (wake_bench_t *)arg;
+    for (int i = 0; i < WAKE_BENCH_ITERATIONS; i++) {
+        if (bench->use_notify) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        } else {
+            xEventGroupWaitBits(bench->event_group, 0x00FFFFFF, pdTRUE, pdFALSE, portMAX_DELAY);
+        }
+        uint32_t cycles = esp_cpu_get_ccount() - bench->signal_ccount;
+        bench->total_cycles += cycles;
+        if (cycles > bench->max_cycles) {
+            bench->max_cycles = cycles;
+        }
+    }
+    xSemaphoreGive(bench->done);
+    vTaskDelete(NULL);
+}
+
+static uint32_t wake_bench_run(bool use_notify)
+{
+    wake_bench_t bench = {
+        .use_notify = use_notify,
+        .event_group = xEventGroupCreate(),
+        .done = xSemaphoreCreateBinary(),
+    };
+    TEST_ASSERT_NOT_EQUAL(NULL, bench.event_group);
+    TEST_ASSERT_NOT_EQUAL(NULL, bench.done);
+
+    //Waiter must preempt us as soon as it is signalled, and must be on our core
+    TaskHandle_t waiter;
+    TEST_ASSERT_EQUAL(pdTRUE, xTaskCreatePinnedToCore(wake_bench_waiter, "wake_bench", 2048, &bench,
+                                                      uxTaskPriorityGet(NULL) + 1, &waiter, 0));
+
+    for (int i = 0; i < WAKE_BENCH_ITERATIONS; i++) {
+        //The waiter is higher priority, so it is already blocked again by the time we get here
+        bench.signal_ccount = esp_cpu_get_ccount();
+        if (use_notify) {
+            xTaskNotifyGive(waiter);
+        } else {
+            xEventGroupSetBits(bench.event_group, WAKE_BENCH_EVENT);
+        }
+    }
+
+    TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(bench.done, pdMS_TO_TICKS(1000)));
+    vSemaphoreDelete(bench.done);
+    vEventGroupDelete(bench.event_group);
+
+    uint32_t avg = bench.total_cycles / WAKE_BENCH_ITERATIONS;
+    printf("%s wake latency: avg %u cycles, max %u cycles\n",
+           use_notify ? "Task notify" : "EventGroup", avg, bench.max_cycles);
+    return avg;
+}
+
+TEST_CASE("Test xfer completion wake latency", "[xfer][bench]")
+{
+    uint32_t event_group_avg = wake_bench_run(false);
+    uint32_t notify_avg = wake_bench_run(true);
+    TEST_ASSERT_LESS_THAN(event_group_avg, notify_avg);
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "xesp_usbh_addr.h"
+
+/*
+
+Checks of the usb address allocator, on a host.
+
+    alloc:   hands out 1 to 127 in order, never 0, then 0 once all are taken
+    take:    rejects 0, addresses past 127, and addresses already taken
+    release: a released address is the last to be handed out again
+    wrap:    the search wraps around past 127, and skips taken addresses
+
+*/
+
+static int errors;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("  %s:%d: %s\n", __func__, __LINE__, #cond); \
+        errors++; \
+    } \
+} while (0)
+
+static void test_alloc(void){
+    xesp_usb_addr_pool_t pool;
+    xesp_usb_addr_init(&pool);
+
+    for (int addr = 1; addr <= XESP_USB_ADDR_MAX; addr++) {
+        CHECK(xesp_usb_addr_alloc(&pool) == addr);
+    }
+
+    // all taken
+    CHECK(xesp_usb_addr_alloc(&pool) == 0);
+    CHECK(xesp_usb_addr_alloc(&pool) == 0);
+}
+
+static void test_take(void){
+    xesp_usb_addr_pool_t pool;
+    xesp_usb_addr_init(&pool);
+
+    CHECK(!xesp_usb_addr_take(&pool, 0));
+    CHECK(!xesp_usb_addr_take(&pool, XESP_USB_ADDR_MAX + 1));
+    CHECK(!xesp_usb_addr_take(&pool, 255));
+
+    CHECK(xesp_usb_addr_take(&pool, 5));
+    CHECK(!xesp_usb_addr_take(&pool, 5));
+
+    // handed out by alloc
+    uint8_t addr = xesp_usb_addr_alloc(&pool);
+    CHECK(addr == 1);
+    CHECK(!xesp_usb_addr_take(&pool, addr));
+
+    // free again once released
+    xesp_usb_addr_release(&pool, 5);
+    CHECK(xesp_usb_addr_take(&pool, 5));
+
+    // alloc skips taken addresses
+    CHECK(xesp_usb_addr_take(&pool, 2));
+    CHECK(xesp_usb_addr_take(&pool, 3));
+    CHECK(xesp_usb_addr_alloc(&pool) == 4);
+    CHECK(xesp_usb_addr_alloc(&pool) == 6);
+}
+
+static void test_release(void){
+    xesp_usb_addr_pool_t pool;
+    xesp_usb_addr_init(&pool);
+
+    CHECK(xesp_usb_addr_alloc(&pool) == 1);
+    CHECK(xesp_usb_addr_alloc(&pool) == 2);
+
+    // not reused until every other address was handed out
+    xesp_usb_addr_release(&pool, 1);
+    for (int addr = 3; addr <= XESP_USB_ADDR_MAX; addr++) {
+        CHECK(xesp_usb_addr_alloc(&pool) == addr);
+    }
+    CHECK(xesp_usb_addr_alloc(&pool) == 1);
+    CHECK(xesp_usb_addr_alloc(&pool) == 0);
+
+    // releasing what is not taken, or is not an address, changes nothing
+    xesp_usb_addr_release(&pool, 0);
+    xesp_usb_addr_release(&pool, XESP_USB_ADDR_MAX + 1);
+    CHECK(xesp_usb_addr_alloc(&pool) == 0);
+    xesp_usb_addr_release(&pool, 64);
+    xesp_usb_addr_release(&pool, 64);
+    CHECK(xesp_usb_addr_alloc(&pool) == 64);
+    CHECK(xesp_usb_addr_alloc(&pool) == 0);
+}
+
+static void test_wrap(void){
+    xesp_usb_addr_pool_t pool;
+    xesp_usb_addr_init(&pool);
+
+    // take everything, then free a few on either side of the end
+    for (int addr = 1; addr <= XESP_USB_ADDR_MAX; addr++) {
+        CHECK(xesp_usb_addr_alloc(&pool) == addr);
+    }
+    xesp_usb_addr_release(&pool, 3);
+    xesp_usb_addr_release(&pool, 40);
+    xesp_usb_addr_release(&pool, XESP_USB_ADDR_MAX);
+
+    // the last one handed out was 127, so the search starts over at 1
+    CHECK(xesp_usb_addr_alloc(&pool) == 3);
+    CHECK(xesp_usb_addr_alloc(&pool) == 40);
+    CHECK(xesp_usb_addr_alloc(&pool) == XESP_USB_ADDR_MAX);
+    CHECK(xesp_usb_addr_alloc(&pool) == 0);
+
+    // from the middle of a word, past the end, around to the start
+    xesp_usb_addr_release(&pool, 33);
+    xesp_usb_addr_release(&pool, 100);
+    CHECK(xesp_usb_addr_alloc(&pool) == 33);
+    xesp_usb_addr_release(&pool, 2);
+    CHECK(xesp_usb_addr_alloc(&pool) == 100);
+    CHECK(xesp_usb_addr_alloc(&pool) == 2);
+
+    // only address 0 is never free
+    for (int i = 0; i < 4 * XESP_USB_ADDR_MAX; i++) {
+        uint8_t addr = 1 + (i * 37) % XESP_USB_ADDR_MAX;
+        xesp_usb_addr_release(&pool, addr);
+        CHECK(xesp_usb_addr_alloc(&pool) == addr);
+    }
+}
+
+int main(void){
+
+    test_alloc();
+    test_take();
+    test_release();
+    test_wrap();
+
+    printf("%s (%d errors)\n", errors ? "FAILED" : "OK", errors);
+
+    return errors ? 1 : 0;
+}
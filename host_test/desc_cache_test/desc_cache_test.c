@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xesp_usbh_desc_cache.h"
+
+/*
+
+Checks of the descriptor cache, on a host.
+
+    find:        a hit needs the same key and the same whole device descriptor
+    lru:         a full cache replaces the least recently used entry
+    validate:    put refuses a config descriptor shorter than its header,
+                 or whose wTotalLength is not its length
+    round trip:  serialize then deserialize gives back the same entries
+    corrupt:     deserialize refuses truncated blobs and bad config lengths, 
+                 and leaves the cache empty
+
+*/
+
+static int errors;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("  %s:%d: %s\n", __func__, __LINE__, #cond); \
+        errors++; \
+    } \
+} while (0)
+
+#define CONFIG_BYTES 32
+
+// a device descriptor with this product id and serial index
+static void make_devc(uint8_t* devc, uint16_t product, uint8_t serial){
+    memset(devc, 0, XESP_USB_DESC_CACHE_DEVC_BYTES);
+    devc[0] = XESP_USB_DESC_CACHE_DEVC_BYTES;
+    devc[1] = 1; // DEVICE
+    devc[8] = 0x34; // idVendor
+    devc[9] = 0x12;
+    devc[10] = product & 0xFF;
+    devc[11] = product >> 8;
+    devc[16] = serial;
+}
+
+// a config descriptor of 'len' bytes, that says so
+static void make_config(uint8_t* config, uint16_t len, uint8_t fill){
+    memset(config, fill, len);
+    config[0] = 9;
+    config[1] = 2; // CONFIGURATION
+    config[2] = len & 0xFF;
+    config[3] = len >> 8;
+}
+
+static bool put(xesp_usb_desc_cache_t* cache, uint16_t product, const char* manufacturer, const char* name){
+    uint8_t devc[XESP_USB_DESC_CACHE_DEVC_BYTES];
+    uint8_t config[CONFIG_BYTES];
+    make_devc(devc, product, 3);
+    make_config(config, CONFIG_BYTES, product);
+    return xesp_usb_desc_cache_put(cache, devc, config, CONFIG_BYTES, manufacturer, name);
+}
+
+static xesp_usb_desc_cache_entry_t* find(xesp_usb_desc_cache_t* cache, uint16_t product){
+    uint8_t devc[XESP_USB_DESC_CACHE_DEVC_BYTES];
+    make_devc(devc, product, 3);
+    return xesp_usb_desc_cache_find(cache, devc);
+}
+
+static int used(xesp_usb_desc_cache_t* cache){
+    int n = 0;
+    for (int i = 0; i < cache->capacity; i++) {
+        n += cache->entries[i].config != NULL;
+    }
+    return n;
+}
+
+static void test_find(void){
+    xesp_usb_desc_cache_t cache;
+    CHECK(xesp_usb_desc_cache_init(&cache, 4));
+
+    CHECK(find(&cache, 1) == NULL);
+    CHECK(put(&cache, 1, "maker", "thing"));
+
+    xesp_usb_desc_cache_entry_t* entry = find(&cache, 1);
+    CHECK(entry != NULL);
+    CHECK(entry && entry->config_bytes == CONFIG_BYTES);
+    CHECK(entry && strcmp(entry->manufacturer, "maker") == 0);
+    CHECK(entry && strcmp(entry->product, "thing") == 0);
+    CHECK(find(&cache, 2) == NULL);
+
+    // same key, but the firmware changed
+    uint8_t devc[XESP_USB_DESC_CACHE_DEVC_BYTES];
+    make_devc(devc, 1, 3);
+    devc[12] = 0x99; // bcdDevice
+    CHECK(xesp_usb_desc_cache_find(&cache, devc) == NULL);
+
+    // a put with the same key replaces the entry
+    CHECK(put(&cache, 1, NULL, "other"));
+    CHECK(used(&cache) == 1);
+    entry = find(&cache, 1);
+    CHECK(entry && entry->manufacturer == NULL);
+    CHECK(entry && strcmp(entry->product, "other") == 0);
+
+    xesp_usb_desc_cache_clear(&cache);
+    CHECK(used(&cache) == 0);
+    free(cache.entries);
+}
+
+static void test_lru(void){
+    xesp_usb_desc_cache_t cache;
+    CHECK(xesp_usb_desc_cache_init(&cache, 3));
+
+    CHECK(put(&cache, 1, NULL, NULL));
+    CHECK(put(&cache, 2, NULL, NULL));
+    CHECK(put(&cache, 3, NULL, NULL));
+
+    // 1 is now more recent than 2
+    CHECK(find(&cache, 1) != NULL);
+
+    CHECK(put(&cache, 4, NULL, NULL));
+    CHECK(used(&cache) == 3);
+    CHECK(find(&cache, 2) == NULL);
+    CHECK(find(&cache, 1) != NULL);
+    CHECK(find(&cache, 3) != NULL);
+    CHECK(find(&cache, 4) != NULL);
+
+    // a removed entry's slot is used before any other is replaced
+    xesp_usb_desc_cache_remove(&cache, find(&cache, 1));
+    CHECK(put(&cache, 5, NULL, NULL));
+    CHECK(find(&cache, 3) != NULL);
+    CHECK(find(&cache, 4) != NULL);
+    CHECK(find(&cache, 5) != NULL);
+
+    // nothing cached at all
+    xesp_usb_desc_cache_clear(&cache);
+    free(cache.entries);
+    CHECK(xesp_usb_desc_cache_init(&cache, 0));
+    CHECK(!put(&cache, 1, NULL, NULL));
+    CHECK(find(&cache, 1) == NULL);
+}
+
+static void test_validate(void){
+    xesp_usb_desc_cache_t cache;
+    CHECK(xesp_usb_desc_cache_init(&cache, 2));
+
+    uint8_t devc[XESP_USB_DESC_CACHE_DEVC_BYTES];
+    uint8_t config[CONFIG_BYTES];
+    make_devc(devc, 1, 3);
+
+    make_config(config, 9, 0);
+    CHECK(xesp_usb_desc_cache_put(&cache, devc, config, 9, NULL, NULL));
+
+    // shorter than the header
+    make_config(config, 8, 0);
+    CHECK(!xesp_usb_desc_cache_put(&cache, devc, config, 8, NULL, NULL));
+
+    // wTotalLength disagrees
+    make_config(config, CONFIG_BYTES, 0);
+    CHECK(!xesp_usb_desc_cache_put(&cache, devc, config, CONFIG_BYTES - 1, NULL, NULL));
+    CHECK(!xesp_usb_desc_cache_put(&cache, devc, NULL, CONFIG_BYTES, NULL, NULL));
+
+    xesp_usb_desc_cache_clear(&cache);
+    free(cache.entries);
+}
+
+static void test_round_trip(void){
+    xesp_usb_desc_cache_t cache;
+    CHECK(xesp_usb_desc_cache_init(&cache, 4));
+
+    CHECK(put(&cache, 1, "maker", "thing"));
+    CHECK(put(&cache, 2, NULL, ""));
+    CHECK(put(&cache, 3, "", NULL));
+    CHECK(cache.dirty);
+
+    size_t size = xesp_usb_desc_cache_serialize(&cache, NULL, 0);
+    CHECK(cache.dirty);
+    uint8_t* blob = malloc(size);
+    CHECK(xesp_usb_desc_cache_serialize(&cache, blob, size - 1) == size); // too small, not written
+    CHECK(cache.dirty);
+    CHECK(xesp_usb_desc_cache_serialize(&cache, blob, size) == size);
+    CHECK(!cache.dirty);
+
+    xesp_usb_desc_cache_t loaded;
+    CHECK(xesp_usb_desc_cache_init(&loaded, 4));
+    CHECK(xesp_usb_desc_cache_deserialize(&loaded, blob, size));
+    CHECK(!loaded.dirty);
+    CHECK(used(&loaded) == 3);
+
+    for (uint16_t product = 1; product <= 3; product++) {
+        xesp_usb_desc_cache_entry_t* a = find(&cache, product);
+        xesp_usb_desc_cache_entry_t* b = find(&loaded, product);
+        CHECK(a && b);
+        if (!a || !b) {
+            continue;
+        }
+        CHECK(memcmp(a->devc, b->devc, XESP_USB_DESC_CACHE_DEVC_BYTES) == 0);
+        CHECK(a->config_bytes == b->config_bytes);
+        CHECK(memcmp(a->config, b->config, a->config_bytes) == 0);
+        CHECK((a->manufacturer == NULL) == (b->manufacturer == NULL));
+        CHECK(!a->manufacturer || strcmp(a->manufacturer, b->manufacturer) == 0);
+        CHECK((a->product == NULL) == (b->product == NULL));
+        CHECK(!a->product || strcmp(a->product, b->product) == 0);
+    }
+
+    // into a smaller cache: the rest are replaced
+    xesp_usb_desc_cache_t small;
+    CHECK(xesp_usb_desc_cache_init(&small, 2));
+    CHECK(xesp_usb_desc_cache_deserialize(&small, blob, size));
+    CHECK(used(&small) == 2);
+
+    xesp_usb_desc_cache_clear(&small);
+    free(small.entries);
+    xesp_usb_desc_cache_clear(&loaded);
+    free(loaded.entries);
+    xesp_usb_desc_cache_clear(&cache);
+    free(cache.entries);
+    free(blob);
+}
+
+static void test_corrupt(void){
+    xesp_usb_desc_cache_t cache;
+    CHECK(xesp_usb_desc_cache_init(&cache, 2));
+    CHECK(put(&cache, 1, "maker", "thing"));
+
+    size_t size = xesp_usb_desc_cache_serialize(&cache, NULL, 0);
+    uint8_t* blob = malloc(size);
+    xesp_usb_desc_cache_serialize(&cache, blob, size);
+
+    xesp_usb_desc_cache_t loaded;
+    CHECK(xesp_usb_desc_cache_init(&loaded, 2));
+
+    // every truncation
+    for (size_t n = 0; n < size; n++) {
+        CHECK(!xesp_usb_desc_cache_deserialize(&loaded, blob, n));
+        CHECK(used(&loaded) == 0);
+    }
+
+    // offsets in the blob: header (4), devc (18), then config_bytes (2)
+    const size_t CONFIG_BYTES_AT = 4 + XESP_USB_DESC_CACHE_DEVC_BYTES;
+    const size_t CONFIG_AT = CONFIG_BYTES_AT + 2 + 2 * 2;
+
+    // a config too short to hold its header. the blob is otherwise consistent
+    uint8_t* bad = malloc(size);
+    memcpy(bad, blob, size);
+    bad[CONFIG_BYTES_AT] = 1;
+    bad[CONFIG_BYTES_AT + 1] = 0;
+    CHECK(!xesp_usb_desc_cache_deserialize(&loaded, bad, size));
+    CHECK(used(&loaded) == 0);
+
+    // wTotalLength disagrees with config_bytes
+    memcpy(bad, blob, size);
+    bad[CONFIG_AT + 2] ^= 1;
+    CHECK(!xesp_usb_desc_cache_deserialize(&loaded, bad, size));
+    CHECK(used(&loaded) == 0);
+
+    // bad magic
+    memcpy(bad, blob, size);
+    bad[0] ^= 0xFF;
+    CHECK(!xesp_usb_desc_cache_deserialize(&loaded, bad, size));
+
+    // the good blob still loads
+    CHECK(xesp_usb_desc_cache_deserialize(&loaded, blob, size));
+    CHECK(used(&loaded) == 1);
+
+    xesp_usb_desc_cache_clear(&loaded);
+    free(loaded.entries);
+    xesp_usb_desc_cache_clear(&cache);
+    free(cache.entries);
+    free(blob);
+    free(bad);
+}
+
+int main(void){
+
+    test_find();
+    test_lru();
+    test_validate();
+    test_round_trip();
+    test_corrupt();
+
+    printf("%s (%d errors)\n", errors ? "FAILED" : "OK", errors);
+
+    return errors ? 1 : 0;
+}
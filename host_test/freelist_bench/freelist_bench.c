@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+#include "xesp_usbh_freelist.h"
+
+/*
+
+Contention benchmark for the irp freelist, on a host.
+
+Several threads take and give irps as fast as they can, like several 
+tasks doing small transfers. Each take / give is done the way 
+xesp_usbh_xfer_take_irp / give_irp do it:
+
+    mutex:     counting semaphore + mutex protected array (the old pool)
+    lock-free: counting semaphore + xesp_freelist_t      (the current pool)
+    pop/push:  xesp_freelist_t alone, spinning when empty
+
+The pool is smaller than the number of threads, so takers also block.
+
+Every taken index is checked to be owned by nobody else.
+
+*/
+
+#define POOL_SIZE 8
+#define OPS_PER_THREAD 200000
+#define MAX_THREADS 16
+
+enum { MODE_MUTEX, MODE_LOCK_FREE, MODE_POP_PUSH, NUM_MODES };
+
+static const char* mode_names[NUM_MODES] = {"mutex", "lock-free", "pop/push"};
+
+static int mode;
+
+static sem_t counting_sem;
+
+// the old pool
+static pthread_mutex_t freelist_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint16_t freelist_array[POOL_SIZE];
+static int freelist_count;
+
+// the new pool
+static xesp_freelist_t freelist;
+static _Atomic uint16_t freelist_next[POOL_SIZE];
+
+// who owns each index. checks nobody gets the same index twice
+static atomic_int owners[POOL_SIZE];
+static atomic_int errors;
+
+static uint16_t take(void){
+    uint16_t idx = 0;
+    switch (mode) {
+    case MODE_MUTEX:
+        sem_wait(&counting_sem);
+        pthread_mutex_lock(&freelist_mutex);
+        idx = freelist_array[--freelist_count];
+        pthread_mutex_unlock(&freelist_mutex);
+        break;
+    case MODE_LOCK_FREE:
+        sem_wait(&counting_sem);
+        if (!xesp_freelist_pop(&freelist, &idx)) {
+            atomic_fetch_add(&errors, 1);
+        }
+        break;
+    case MODE_POP_PUSH:
+        while (!xesp_freelist_pop(&freelist, &idx)) {
+            sched_yield();
+        }
+        break;
+    }
+    return idx;
+}
+
+static void give(uint16_t idx){
+    switch (mode) {
+    case MODE_MUTEX:
+        pthread_mutex_lock(&freelist_mutex);
+        freelist_array[freelist_count++] = idx;
+        pthread_mutex_unlock(&freelist_mutex);
+        sem_post(&counting_sem);
+        break;
+    case MODE_LOCK_FREE:
+        xesp_freelist_push(&freelist, idx);
+        sem_post(&counting_sem);
+        break;
+    case MODE_POP_PUSH:
+        xesp_freelist_push(&freelist, idx);
+        break;
+    }
+}
+
+static void* worker(void* arg){
+    int id = (int) (intptr_t) arg;
+    for (int i = 0; i < OPS_PER_THREAD; i++) {
+        uint16_t idx = take();
+        if (idx >= POOL_SIZE) {
+            atomic_fetch_add(&errors, 1);
+            continue;
+        }
+        int expected = 0;
+        if (!atomic_compare_exchange_strong(&owners[idx], &expected, id)) {
+            atomic_fetch_add(&errors, 1); // somebody else has it!
+        }
+        atomic_store(&owners[idx], 0);
+        give(idx);
+    }
+    return NULL;
+}
+
+static void pool_reset(void){
+    sem_destroy(&counting_sem);
+    sem_init(&counting_sem, 0, POOL_SIZE);
+    freelist_count = 0;
+    xesp_freelist_init(&freelist, freelist_next);
+    for (int i = POOL_SIZE - 1; i >= 0; i--) {
+        freelist_array[freelist_count++] = i;
+        xesp_freelist_push(&freelist, i);
+        atomic_store(&owners[i], 0);
+    }
+}
+
+static double now_sec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// returns ns per take + give
+static double run(int m, int num_threads){
+    pthread_t threads[MAX_THREADS];
+
+    mode = m;
+    pool_reset();
+
+    double start = now_sec();
+    for (int t = 0; t < num_threads; t++) {
+        // ids start at 1, 0 means unowned
+        pthread_create(&threads[t], NULL, worker, (void*) (intptr_t) (t + 1));
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    double elapsed = now_sec() - start;
+
+    // every index must be back
+    uint16_t idx;
+    int free_count = 0;
+    if (m == MODE_MUTEX) {
+        free_count = freelist_count;
+    } else {
+        while (xesp_freelist_pop(&freelist, &idx)) {
+            free_count++;
+        }
+    }
+    if (free_count != POOL_SIZE) {
+        printf("  %s: %d of %d indices returned!\n", mode_names[m], free_count, POOL_SIZE);
+        atomic_fetch_add(&errors, 1);
+    }
+
+    return elapsed * 1e9 / ((double) num_threads * OPS_PER_THREAD);
+}
+
+int main(void){
+
+    const int thread_counts[] = {1, 2, 4, 8, 16};
+    const int num_counts = sizeof(thread_counts) / sizeof(thread_counts[0]);
+
+    sem_init(&counting_sem, 0, POOL_SIZE);
+
+    printf("pool of %d, %d take + give per thread. ns per take + give:\n", 
+        POOL_SIZE, OPS_PER_THREAD);
+    printf("%8s", "threads");
+    for (int m = 0; m < NUM_MODES; m++) {
+        printf("%12s", mode_names[m]);
+    }
+    printf("\n");
+
+    for (int c = 0; c < num_counts; c++) {
+        printf("%8d", thread_counts[c]);
+        for (int m = 0; m < NUM_MODES; m++) {
+            printf("%12.1f", run(m, thread_counts[c]));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    int err = atomic_load(&errors);
+    printf("%s (%d errors)\n", err ? "FAILED" : "OK", err);
+
+    return err ? 1 : 0;
+}
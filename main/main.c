@@ -4,6 +4,7 @@
 #include "freertos/task.h"
 
 #include "esp_log.h"
+#include "nvs_flash.h"
 
 #include "usb_utils.h"
 
@@ -72,6 +73,17 @@ void app_main(void)
 {
     printf("Hello world USB host!\n");
 
+    // before xesp_usbh_init, which loads the saved descriptors, 
+    // so that devices seen before boot are enumerated from them
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        nvs_flash_erase();
+        err = nvs_flash_init();
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "could not init nvs. descriptor cache will not be saved");
+    }
+
     xesp_usbh_init();
 
     uint64_t open_count = 0;
@@ -80,38 +92,45 @@ open_device:
 
     printf("opening device...\n");
 
-    // block until we open a device
+    // block until we open a device. it has already been enumerated,
+    // so its descriptors and strings are on hand
     xesp_usb_device_t device = xesp_usbh_open_device(&open_count);
 
-    usb_desc_devc_t2 descriptor;
-    hcd_pipe_event_t rc = xesp_usbh_get_device_descriptor(device, &descriptor);
-
-    if (rc == XUSB_OK) {
-        usb_util_print_devc(&descriptor);
-    } else {
-        ESP_LOGE(TAG, "could not get device descriptor");
+    const xesp_usbh_device_info_t* info = xesp_usbh_get_device_info(device);
+    if (info == NULL) {
+        ESP_LOGE(TAG, "device closed before it could be used");
+        goto open_device;
     }
 
-    // get strings
-    char * str;
-    rc = xesp_usbh_get_string_descriptor(device, descriptor.iManufacturer,&str);
-    if(rc == XUSB_OK){
-        printf("manufacturer: %s\n", str);
-        free(str);
+    // remember it across reboots
+    if (err == ESP_OK) {
+        xesp_usbh_save_descriptor_cache();
     }
 
-    rc = xesp_usbh_get_string_descriptor(device, descriptor.iProduct,&str);
-    if(rc == XUSB_OK){
-        printf("product: %s\n", str);
-        free(str);
+    usb_desc_devc_t2 descriptor = info->descriptor;
+    usb_util_print_devc(&descriptor);
+
+    // the devices behind a hub are opened like any other
+    if (descriptor.bDeviceClass == USB_CLASS_HUB) {
+        if (!xesp_usbh_attach_hub(device)) {
+            ESP_LOGE(TAG, "could not attach hub");
+        }
+        goto open_device;
     }
 
-    rc = xesp_usbh_get_string_descriptor(device, descriptor.iSerialNumber,&str);
-    if(rc == XUSB_OK){
-        printf("serial: %s\n", str);
-        free(str);
+    // strings
+    if (info->manufacturer) {
+        printf("manufacturer: %s\n", info->manufacturer);
+    }
+    if (info->product) {
+        printf("product: %s\n", info->product);
+    }
+    if (info->serial) {
+        printf("serial: %s\n", info->serial);
     }
 
+    hcd_pipe_event_t rc;
+
     //
     // midi
     //
@@ -132,11 +151,16 @@ open_device:
 
 	for(int iConf = 0; iConf < num_configs; iConf++) {
 
-		xesp_usb_config_descriptor_t* config;
-        rc = xesp_usbh_get_config_descriptor(device, iConf, &config);
-        if (rc != XUSB_OK) {
-            ESP_LOGE(TAG, "could not get config descriptor %u", iConf);
-            continue;
+		xesp_usb_config_descriptor_t* config = NULL;
+        if (iConf == 0 && info->config) {
+            // read during enumeration
+            config = info->config;
+        } else {
+            rc = xesp_usbh_get_config_descriptor(device, iConf, &config);
+            if (rc != XUSB_OK) {
+                ESP_LOGE(TAG, "could not get config descriptor %u", iConf);
+                continue;
+            }
         }
 
         ESP_LOGI(TAG, "print config");
@@ -178,7 +202,8 @@ open_device:
             }
         }
 
-        if (config != midi_config) {
+        // the library owns info->config
+        if (config != midi_config && config != info->config) {
 		    xesp_usbh_free_config_descriptor(config);
         }
 	}
@@ -212,24 +237,29 @@ open_device:
     //ESP_LOGI(TAG, "out pipe: %p", midi_pipe_out);
     ESP_LOGI(TAG, "in pipe: %p", midi_pipe_in);
 
-    uint8_t* data_buff = calloc(1, XESP_USB_MAX_XFER_BYTES);
+    // post big reads. Each one still returns as soon as the device sends a short packet
+    uint16_t midi_in_mps = USB_DESC_EP_GET_MPS(&ep_midi_in->val);
+    uint16_t midi_in_bytes = (XESP_USB_IRP_MEDIUM_BYTES / midi_in_mps) * midi_in_mps;
 
     while (true){
 
-        // xfer in data
-        uint16_t num_bytes_transfered;
-        rc = xesp_usbh_xfer_from_pipe(midi_pipe_in, data_buff, &num_bytes_transfered);
+        // xfer in data. The lease points straight into the irp buffer, no copy.
+        xesp_usbh_lease_t lease;
+        rc = xesp_usbh_lease_from_pipe(midi_pipe_in, midi_in_bytes, &lease);
         if (rc != XUSB_OK) {
             ESP_LOGE(TAG, "xfer midi IN pipe fail: %s", hcd_pipe_event_str(rc));
             goto open_device;
         } 
         
-        ESP_LOG_BUFFER_HEX_LEVEL(TAG, data_buff, num_bytes_transfered, ESP_LOG_INFO);
+        ESP_LOG_BUFFER_HEX_LEVEL(TAG, lease.data, lease.length, ESP_LOG_INFO);
 
 
-		for(int i = 0; i < num_bytes_transfered; i += 4) {
+		for(int i = 0; i < lease.length; i += 4) {
 			// each midi event is 4 bytes
-			midi_event(data_buff + i);
+			midi_event(lease.data + i);
 		}
+
+        // return the irp
+        xesp_usbh_release_lease(&lease);
 	}
-}
\ No newline at end of file
+}
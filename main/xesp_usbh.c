@@ -9,6 +9,7 @@
 #include <string.h>
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "freertos/semphr.h"
 #include "freertos/event_groups.h"
 
@@ -16,49 +17,205 @@
 #include "esp_err.h"
 #include "esp_attr.h"
 #include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "soc/soc_memory_layout.h"
 
+#include "hal/usbh_hal.h"
 #include "hal/usbh_ll.h"
 #include "hcd.h"
 
 #include "usb_utils.h"
 
 #include "xesp_usbh_port.h"
+#include "xesp_usbh_addr.h"
+#include "xesp_usbh_desc_cache.h"
+#include "xesp_usbh_hub.h"
 #include "xesp_usbh_xfer.h"
 #include "xesp_usbh_parse.h"
 #include "xesp_usbh.h"
 
-#define XESP_USBH_MAX_PIPES 8
+// string descriptors are at most 255 bytes (bLength is a uint8)
+#define XESP_USB_STRING_DESC_MAX_BYTES 256
 
 static const char* TAG = "xesp usb";
 
-// we keep track of all open pipe information here
-struct xesp_open_pipe_t{
-    hcd_port_handle_t port;
+// an open endpoint (see ep_of)
+struct xesp_usbh_ep_t{
     hcd_pipe_handle_t pipe;
-    int16_t device_addr; // usb device address
-    uint64_t nth_open; // the nth pipe opened
-    bool is_control_pipe; // is the main control endpoint (EP0) ?
+    struct xesp_usbh_dev_t* dev; // the device that owns this endpoint
+    uint16_t mps; // max packet size of this endpoint (0 until known, for EP0)
+    bool is_in; // data flows to the host
+    struct xesp_usbh_ep_t* next; // next endpoint of the same device
+    struct xesp_usbh_ep_t* next_by_pipe; // next endpoint in the same eps_by_pipe bucket
+};
+
+typedef struct xesp_usbh_ep_t xesp_usbh_ep_t;
+
+// an open device, and the endpoints it owns
+struct xesp_usbh_dev_t{
+    hcd_port_handle_t port;
+    xesp_usbh_ep_t ctrl; // the control endpoint (EP0)
+    xesp_usbh_ep_t* endpoints; // the other open endpoints
+    uint8_t device_addr; // usb device address. 0 until set
+    uint64_t nth_open; // the nth device opened
     uint16_t bMaxPacketSize0; // obtained from the device description
+    usb_speed_t speed; // device speed. can differ from the port speed behind a hub
+    uint8_t hub_addr; // usb address of the hub the device is on. 0 for the root port
+    uint8_t hub_port; // port of that hub, starting at 1. 0 for the root port
+    bool published; // enumerated, and can be returned by xesp_usbh_open_device
+    xesp_usbh_device_info_t info; // filled in by enumeration
+    struct xesp_usbh_enum_t* enumeration; // while being enumerated
+    struct xesp_usbh_dev_t* parent; // the hub the device is on. NULL for the root port
+    struct xesp_usbh_dev_t* children; // devices on the downstream ports, if a hub
+    struct xesp_usbh_dev_t* sibling; // next device on the same hub
+    struct xesp_usbh_dev_t* prev; // previous device opened
+    struct xesp_usbh_dev_t* next; // next device opened
+};
+
+typedef struct xesp_usbh_dev_t xesp_usbh_dev_t;
+
+// the steps of enumerating a device (usb 2.0 9.1.2), in order
+typedef enum {
+    ENUM_DEVC_DESC_SHORT,   // the first 8 bytes of the device descriptor, for bMaxPacketSize0
+    ENUM_SET_ADDR,
+    ENUM_DEVC_DESC,
+    ENUM_CONFIG_DESC_SHORT, // the first 9 bytes of the first configuration, for wTotalLength
+    ENUM_CONFIG_DESC,
+    ENUM_STR_MANUFACTURER,
+    ENUM_STR_PRODUCT,
+    ENUM_STR_SERIAL,
+    ENUM_DONE,
+} enum_step_t;
+
+// usb 2.0 9.2.6.3: the device gets 2ms after SET_ADDRESS before its next request
+#define ENUM_SET_ADDR_RECOVERY_US 2000
+
+// how long a step waits before trying again to get an irp
+#define ENUM_IRP_RETRY_US 1000
+
+// the bytes of the device descriptor that are always in the first packet
+#define ENUM_DEVC_DESC_SHORT_BYTES 8
+
+// same as the pipe task
+#define ENUM_TASK_PRIORITY 5
+
+struct xesp_usbh_enum_t{
+    xesp_usbh_dev_t* volatile dev; // NULL once the device is closed. Set under devices_mutex
+    hcd_pipe_handle_t ctrl_pipe; // only used while 'dev' is set
+    usb_irp_t* irp; // of the step in progress, sized for it. NULL between steps
+    hcd_pipe_event_t event; // how 'irp' completed
+    enum_step_t step;
+    uint8_t device_addr;
+    uint16_t config_bytes; // wTotalLength
+    SemaphoreHandle_t addressed; // given once the device leaves address 0. Can be NULL
+    esp_timer_handle_t recovery_timer; // SET_ADDRESS recovery, and waiting for an irp
+    xesp_usbh_device_info_t info; // moved to the device when done
+    uint8_t* config_raw; // the config descriptor as read, for the descriptor cache
+    uint8_t* big_buffer; // replaces the irp buffer, for a config descriptor too big for any irp
+    bool cached; // the config descriptor and strings came from the descriptor cache
+    struct xesp_usbh_enum_t* next_free;
+    struct xesp_usbh_enum_t* next_ready; // in enums_ready
 };
 
-typedef struct xesp_open_pipe_t xesp_open_pipe_t;
+typedef struct xesp_usbh_enum_t xesp_usbh_enum_t;
 
 // event fires when device is connected
 static EventGroupHandle_t connect_xEvent;
 #define CONNECT_BITS 1
 
-// global counter that increases every time a pipe is opened
-static uint64_t num_ctlr_pipes_opened = 0;
+// global counter that increases every time a device is opened
+static uint64_t num_devices_opened = 0;
+
+// all the open devices, oldest first
+static xesp_usbh_dev_t* devices_head = NULL;
+static xesp_usbh_dev_t* devices_tail = NULL;
 
-// all the currently open pipes
-static xesp_open_pipe_t open_pipes[XESP_USBH_MAX_PIPES];
+// the device on the root port
+static xesp_usbh_dev_t* root_device = NULL;
 
-static SemaphoreHandle_t open_pipes_mutex;
+// the open devices, by usb address
+static xesp_usbh_dev_t* devices_by_addr[XESP_USB_ADDR_MAX + 1];
+
+// the open endpoints, by pipe, so handles from users are checked without
+// walking every device (see ep_of). Chained through next_by_pipe
+#define EPS_BY_PIPE_BUCKETS 32
+static xesp_usbh_ep_t* eps_by_pipe[EPS_BY_PIPE_BUCKETS];
+
+// the usb addresses in use
+static xesp_usb_addr_pool_t addr_pool;
+
+// protects the device table above, and the devices in it
+static SemaphoreHandle_t devices_mutex;
+
+// a hub child must have left address 0 before the hub resets its next port
+static SemaphoreHandle_t hub_child_addressed;
+
+// the descriptors of devices enumerated before
+static xesp_usb_desc_cache_t desc_cache;
+static SemaphoreHandle_t desc_cache_mutex;
+
+// where the descriptor cache is saved
+#define DESC_CACHE_NVS_NAMESPACE "xesp_usbh"
+#define DESC_CACHE_NVS_KEY "desc_cache"
 
 //forward declaration
-hcd_pipe_event_t xesp_usb_set_addr_auto(hcd_port_handle_t port);
+hcd_pipe_event_t xesp_usb_set_addr_auto(xesp_usb_device_t device);
+static xesp_usbh_dev_t* device_open(hcd_port_handle_t port, usb_speed_t speed, uint8_t hub_addr, uint8_t hub_port);
+static bool device_close_locked(xesp_usbh_dev_t* dev);
+static void device_set_addr_locked(xesp_usbh_dev_t* dev, uint8_t addr);
+static bool enum_setup();
+static bool enum_start(xesp_usbh_dev_t* dev, SemaphoreHandle_t addressed);
+static void free_device_info(xesp_usbh_device_info_t* info);
+static char* string_from_desc(uint8_t* data, uint16_t num_bytes);
+static bool desc_cache_load();
 hcd_pipe_event_t xesp_usbh_set_addr(xesp_usb_device_t device, uint8_t addr);
 
+// the eps_by_pipe bucket of a pipe
+static xesp_usbh_ep_t** ep_bucket(hcd_pipe_handle_t pipe){
+    // pipes are heap blocks, the low bits are always the same
+    return &eps_by_pipe[((uintptr_t) pipe >> 4) % EPS_BY_PIPE_BUCKETS];
+}
+
+// make an endpoint's pipe known to ep_of. The caller holds devices_mutex
+static void ep_register(xesp_usbh_ep_t* ep){
+    xesp_usbh_ep_t** bucket = ep_bucket(ep->pipe);
+    ep->next_by_pipe = *bucket;
+    *bucket = ep;
+}
+
+// before its pipe is closed. The caller holds devices_mutex
+static void ep_unregister(xesp_usbh_ep_t* ep){
+    xesp_usbh_ep_t** link = ep_bucket(ep->pipe);
+    while (*link && *link != ep) {
+        link = &(*link)->next_by_pipe;
+    }
+    if (*link) {
+        *link = ep->next_by_pipe;
+    }
+}
+
+// the endpoint of an open pipe, or NULL.
+// Handles come from users, and a closed pipe is freed, so the pipe is
+// looked up rather than dereferenced. Callers log a miss, if it is one.
+// The caller holds devices_mutex
+static xesp_usbh_ep_t* ep_of(hcd_pipe_handle_t pipe){
+    if (pipe) {
+        for (xesp_usbh_ep_t* ep = *ep_bucket(pipe); ep; ep = ep->next_by_pipe) {
+            if (ep->pipe == pipe) {
+                return ep;
+            }
+        }
+    }
+    return NULL;
+}
+
+// the device an open pipe belongs to, or NULL. The caller holds devices_mutex
+static xesp_usbh_dev_t* dev_of(hcd_pipe_handle_t pipe){
+    xesp_usbh_ep_t* ep = ep_of(pipe);
+    return ep ? ep->dev : NULL;
+}
 
 // port callback 
 static void port_event_callback(hcd_port_handle_t port, hcd_port_event_t event){
@@ -74,16 +231,13 @@ static void port_event_callback(hcd_port_handle_t port, hcd_port_event_t event){
     }
 
 
-    // loop through all devices and get the control pipe
+    // get the control pipe of the device on the root port
     hcd_port_handle_t control_pipe = NULL;
-    xSemaphoreTake(open_pipes_mutex, portMAX_DELAY);
-    for(int i = 0; i < XESP_USBH_MAX_PIPES; i++){
-        if (open_pipes[i].port == port &&
-            open_pipes[i].is_control_pipe){
-            control_pipe = open_pipes[i].pipe;
-        }
+    xSemaphoreTake(devices_mutex, portMAX_DELAY);
+    if (root_device && root_device->port == port) {
+        control_pipe = root_device->ctrl.pipe;
     }
-    xSemaphoreGive(open_pipes_mutex);
+    xSemaphoreGive(devices_mutex);
 
     hcd_port_state_t port_state = hcd_port_get_state(port);
     hcd_pipe_state_t pipe_state = HCD_PIPE_STATE_INVALID;
@@ -145,14 +299,52 @@ static void port_event_callback(hcd_port_handle_t port, hcd_port_event_t event){
             }
             port_state = hcd_port_get_state(port); // get new state
             if(port_state == HCD_PORT_STATE_ENABLED){
-                xesp_usbh_open_endpoint(device, NULL); // open the control pipe (EP0)
-                ESP_LOGI(TAG, "xEventGroupSetBits CONNECT_BITS");
-                xEventGroupSetBits(connect_xEvent, CONNECT_BITS);
+                // open the control pipe (EP0), and enumerate in the background.
+                // CONNECT_BITS are set once the device is ready.
+                xesp_usbh_open_endpoint(device, NULL);
             }
             break;
     }  
 }
 
+// a device connected or disconnected on a downstream port of a hub.
+// Runs on the hub task, one event at a time.
+static void hub_child_callback(hcd_port_handle_t port, 
+                               uint8_t hub_addr, 
+                               uint8_t hub_port, 
+                               bool connected, 
+                               usb_speed_t speed){
+
+    if (!connected) {
+        xSemaphoreTake(devices_mutex, portMAX_DELAY);
+        xesp_usbh_dev_t* hub = devices_by_addr[hub_addr];
+        xesp_usbh_dev_t* child = hub ? hub->children : NULL;
+        while (child && child->hub_port != hub_port) {
+            child = child->sibling;
+        }
+        // not found if already closed along with its hub
+        if (child) {
+            device_close_locked(child);
+        }
+        xSemaphoreGive(devices_mutex);
+        return;
+    }
+
+    // the child starts at address 0, like a device on the root port
+    xesp_usbh_dev_t* dev = device_open(port, speed, hub_addr, hub_port);
+    if (!dev) {
+        ESP_LOGE(TAG, "hub %u port %u: could not open control pipe", hub_addr, hub_port);
+        return;
+    }
+
+    // wait until the child is addressed (or enumeration failed) before 
+    // the hub task resets the next port, so that two devices never answer
+    // to address 0. The rest of enumeration carries on in the background.
+    if (enum_start(dev, hub_child_addressed)) {
+        xSemaphoreTake(hub_child_addressed, portMAX_DELAY);
+    }
+}
+
 void xesp_usbh_init(){
 
     // connect event 
@@ -162,13 +354,37 @@ void xesp_usbh_init(){
         //PDAASSERT(g_connect_event_group, "this must not fail");
     }
 
-    // usb pipes mutex
-    open_pipes_mutex = xSemaphoreCreateMutex();
-    if(open_pipes_mutex == NULL ){
-        ESP_LOGE(TAG, "could not create usb pipes mutex");
+    xesp_usb_addr_init(&addr_pool);
+
+    // usb devices mutex
+    devices_mutex = xSemaphoreCreateMutex();
+    if(devices_mutex == NULL ){
+        ESP_LOGE(TAG, "could not create usb devices mutex");
+        // should PDASSERT...
+    }
+
+    hub_child_addressed = xSemaphoreCreateBinary();
+    if(hub_child_addressed == NULL ){
+        ESP_LOGE(TAG, "could not create hub child semaphore");
+        // should PDASSERT...
+    }
+
+    if (!enum_setup()) {
+        ESP_LOGE(TAG, "could not create enumeration task");
         // should PDASSERT...
     }
 
+    desc_cache_mutex = xSemaphoreCreateMutex();
+    if(desc_cache_mutex == NULL ||
+       !xesp_usb_desc_cache_init(&desc_cache, XESP_USBH_DESC_CACHE_ENTRIES)){
+        ESP_LOGE(TAG, "could not create usb descriptor cache");
+        // should PDASSERT...
+    }
+
+    // before the port is powered. A device present at boot would 
+    // otherwise be cached, then dropped by the load.
+    desc_cache_load();
+
     hcd_port_handle_t port = xesp_usbh_port_setup(&port_event_callback);
     if(!port) {
         ESP_LOGE(TAG, "Could not init usbh");
@@ -178,6 +394,11 @@ void xesp_usbh_init(){
 
     // init pipe
     xesp_usbh_xfer_init();
+
+    // init hubs
+    if (!xesp_usbh_hub_setup(&hub_child_callback)) {
+        ESP_LOGE(TAG, "Could not init usb hubs");
+    }
 }
 
 
@@ -188,396 +409,803 @@ void xesp_usbh_init(){
 xesp_usb_device_t xesp_usbh_open_device(uint64_t* open_idx){
 
     // the device / ctrl pipe we will return
-    xesp_open_pipe_t found;
+    xesp_usb_device_t device = {0};
+    uint64_t nth_open = 0;
 
-    found.port = NULL;
+    while (true) { 
 
-    uint32_t loop_count = 0;
+        printf("open_idx %llu num_devices_opened %llu\n", *open_idx, num_devices_opened);
 
-    while (!found.port) { 
+        // at this point xesp_usbh_open_endpoint was called elsewhere
+        // so the device should be in the device table
 
-        if (loop_count > 0) {
-            // If we programmed our logic correctly, we should
-            // always have a device ready to be opened after the first loop and should never hit this
-            ESP_LOGW(TAG, "No device ready to be opened. odd. blocking more (loop count %i)...", loop_count); 
-        }
+        xSemaphoreTake(devices_mutex, portMAX_DELAY);
 
-        loop_count++;
+        // return the oldest device the caller hasn't opened yet.
+        // devices behind a hub are only published once they have an address.
+        for (xesp_usbh_dev_t* dev = devices_head; dev; dev = dev->next){
+            if (*open_idx < dev->nth_open && dev->published) {
+                device.port = dev->port;
+                device.ctrl_pipe = dev->ctrl.pipe;
+                nth_open = dev->nth_open;
+                break;
+            }
+        }
 
-        printf("open_idx %llu num_ctlr_pipes_opened %llu\n", *open_idx, num_ctlr_pipes_opened);
+        xSemaphoreGive(devices_mutex);
 
-        // has caller already opened all devices?
-        if (*open_idx >= num_ctlr_pipes_opened) {
+        if (device.port) {
+            break;
+        }
 
-            // block until a device is connected
-            ESP_LOGI(TAG, "Waiting for USB Connection...");
+        // block until a device is connected
+        ESP_LOGI(TAG, "Waiting for USB Connection...");
 
-            xEventGroupWaitBits(
-                connect_xEvent, 
-                CONNECT_BITS, /* The bits within the event group to wait for. */
-                true,        /* clear the bits after 'wait' completes */
-                false,       /* Wait for all bits? */
-                portMAX_DELAY );
-        }
+        xEventGroupWaitBits(
+            connect_xEvent, 
+            CONNECT_BITS, /* The bits within the event group to wait for. */
+            true,        /* clear the bits after 'wait' completes */
+            false,       /* Wait for all bits? */
+            portMAX_DELAY );
 
         ESP_LOGI(TAG, "USB Connection Found.");
+    }
 
-        // at this point xesp_usbh_open_endpoint was called elsewhere
-        // so EP0 should be availble in the open_pipes global object
+    // return the open idx of this device. 
+    // Other devices may have connected since, so dont skip ahead.
+    *open_idx = nth_open;
 
-        xSemaphoreTake(open_pipes_mutex, portMAX_DELAY);
+    ESP_LOGI(TAG, "opened device #%llu port %p ctrl_pipe %p", *open_idx, device.port, device.ctrl_pipe);
 
-        // loop through all open pipes and return the first that the callers hasn't opened yet
-        for(int i = 0; i < XESP_USBH_MAX_PIPES; i++){
+    return device;
+}
 
-            // find the next device for the caller to open
-            if (*open_idx < open_pipes[i].nth_open &&
-                open_pipes[i].is_control_pipe ) {
+// close the pipe of an endpoint
+static bool close_ep_pipe(xesp_usbh_ep_t* ep){
 
-                found = open_pipes[i];
-                break;
-            }
+    bool is_control_pipe = ep == &ep->dev->ctrl;
+
+    bool success = xesp_usbh_xfer_close_endpoint(ep->pipe);
+    if (!success) {
+        ESP_LOGE(TAG, "failed to close pipe %p control_pipe? %s", ep->pipe, is_control_pipe ? "YES" : "NO");
+        return false;
+    }
+
+    ESP_LOGI(TAG, "closed pipe %p control_pipe? %s", ep->pipe, is_control_pipe ? "YES" : "NO");
+    ep_unregister(ep);
+    ep->pipe = NULL;
+    return true;
+}
+
+// close the devices behind a device, if it is a hub, then its endpoints,
+// and take it out of the device table
+static bool device_close_locked(xesp_usbh_dev_t* dev){
+
+    // an enumeration in progress finds out from this, and stops
+    if (dev->enumeration) {
+        dev->enumeration->dev = NULL;
+        dev->enumeration = NULL;
+    }
+
+    // the devices downstream of a hub go with it
+    while (dev->children) {
+        if (!device_close_locked(dev->children)) {
+            return false;
         }
+    }
 
-        xSemaphoreGive(open_pipes_mutex);
+    while (dev->endpoints) {
+        xesp_usbh_ep_t* ep = dev->endpoints;
+        if (!close_ep_pipe(ep)) {
+            return false;
+        }
+        dev->endpoints = ep->next;
+        free(ep);
     }
 
-    // to return 
-    xesp_usb_device_t device;
-    device.port = found.port;
-    device.ctrl_pipe = found.pipe;
+    if (!close_ep_pipe(&dev->ctrl)) {
+        return false;
+    }
 
-    // return the open idx of this device
-    *open_idx = num_ctlr_pipes_opened;
+    // unlink from the hub, or the root port
+    if (dev->parent) {
+        xesp_usbh_dev_t** link = &dev->parent->children;
+        while (*link != dev) {
+            link = &(*link)->sibling;
+        }
+        *link = dev->sibling;
+    } else if (root_device == dev) {
+        root_device = NULL;
+    }
 
-    ESP_LOGI(TAG, "opened device #%llu port %p ctrl_pipe %p", *open_idx, device.port, device.ctrl_pipe);
+    device_set_addr_locked(dev, 0);
 
-    return device;
+    // unlink from the device list
+    if (dev->prev) {
+        dev->prev->next = dev->next;
+    } else {
+        devices_head = dev->next;
+    }
+    if (dev->next) {
+        dev->next->prev = dev->prev;
+    } else {
+        devices_tail = dev->prev;
+    }
+
+    free_device_info(&dev->info);
+    free(dev);
+    return true;
 }
 
-// calls hcd_pipe_free on all open pipes of this device
+// calls hcd_pipe_free on all open pipes of this device, and of the devices behind it
 bool xesp_usbh_close_device(xesp_usb_device_t device) {
 
-    xSemaphoreTake(open_pipes_mutex, portMAX_DELAY);
-
-    // close all pipes belonging to a device
-    for (int i = 0; i < XESP_USBH_MAX_PIPES; i++){
-        
-        // is this pipe part of the given device?
-        if (open_pipes[i].port == device.port) {
-
-            // close the pipe
-            bool success = xesp_usbh_xfer_close_endpoint(open_pipes[i].pipe);
-            if (!success) {
-                ESP_LOGE(TAG, "failed to close pipe %p control_pipe? %s", open_pipes[i].pipe, 
-                    open_pipes[i].is_control_pipe ? "YES" : "NO");
-                xSemaphoreGive(open_pipes_mutex);
-                return false;
-            }
+    xSemaphoreTake(devices_mutex, portMAX_DELAY);
 
-            ESP_LOGI(TAG, "closed pipe %p control_pipe? %s", open_pipes[i].pipe, 
-                open_pipes[i].is_control_pipe ? "YES" : "NO");
+    bool success = true;
 
-            open_pipes[i].port = NULL;
-            open_pipes[i].pipe = NULL;
-            open_pipes[i].nth_open = 0;
-            open_pipes[i].device_addr = 0;
-            open_pipes[i].is_control_pipe = false;
-            open_pipes[i].bMaxPacketSize0 = 0;
+    if (device.ctrl_pipe) {
+        xesp_usbh_dev_t* dev = dev_of(device.ctrl_pipe);
+        success = dev ? device_close_locked(dev) : false;
+    } else {
+        // every device on the port. The devices behind hubs go with their hub.
+        xesp_usbh_dev_t* dev = devices_head;
+        while (dev && success) {
+            if (dev->port == device.port && dev->parent == NULL) {
+                success = device_close_locked(dev);
+                dev = devices_head; // the list changed
+            } else {
+                dev = dev->next;
+            }
         }
     }
 
-    xSemaphoreGive(open_pipes_mutex);
-    return true;
+    xSemaphoreGive(devices_mutex);
+    return success;
+}
+
+const xesp_usbh_device_info_t* xesp_usbh_get_device_info(xesp_usb_device_t device){
+
+    xSemaphoreTake(devices_mutex, portMAX_DELAY);
+    xesp_usbh_dev_t* dev = dev_of(device.ctrl_pipe);
+    const xesp_usbh_device_info_t* info = (dev && dev->published) ? &dev->info : NULL;
+    xSemaphoreGive(devices_mutex);
+
+    return info;
 }
 
 //////////////////////////////////
 // Endpoints 
 //
 
-xesp_open_pipe_t* new_xesp_usbh_get_pipe_info(hcd_pipe_handle_t pipe){
-    for (int i = 0; i < XESP_USBH_MAX_PIPES; i++){
-        if (open_pipes[i].pipe == pipe){
-            return &open_pipes[i];
-        }
-    }
-    ESP_LOGE(TAG, "could not find pipe info for pipe %p", pipe);
-    return NULL;
-}
+static void reset_pipe(hcd_pipe_handle_t pipe){
 
-xesp_open_pipe_t* new_xesp_usbh_get_ctrl_pipe_info(hcd_port_handle_t port){
-    for (int i = 0; i < XESP_USBH_MAX_PIPES; i++){
-        if (open_pipes[i].port == port &&
-            open_pipes[i].is_control_pipe == true){
-            return &open_pipes[i];
-        }
+    hcd_pipe_state_t pipe_state = hcd_pipe_get_state(pipe);
+    ESP_LOGI(TAG, "(open) pipe state: %s", hcd_pipe_state_str(pipe_state));
+
+    esp_err_t rc = hcd_pipe_command(pipe, HCD_PIPE_CMD_RESET);
+    if (rc != ESP_OK) {
+        ESP_LOGE(TAG,"pipe reset failed");
     }
-    ESP_LOGE(TAG, "could not find ctrl pipe info for port %p", port);
-    return NULL;
+    ESP_LOGI(TAG, "(after reset) pipe state: %s", hcd_pipe_state_str(pipe_state));
 }
 
-hcd_pipe_handle_t xesp_usbh_open_endpoint(xesp_usb_device_t device, usb_desc_ep_t* ep){
-
-    bool is_ctrl_pipe = usb_util_is_control_ep(ep);
+// open the control pipe of a new device, at address 0, and add the device to the device table.
+// A 'hub_addr' of 0 is the root port. The device is published once it is enumerated.
+static xesp_usbh_dev_t* device_open(hcd_port_handle_t port, 
+                                    usb_speed_t speed, 
+                                    uint8_t hub_addr, 
+                                    uint8_t hub_port){
 
-    if (is_ctrl_pipe){
-        ESP_LOGI(TAG, "opening control pipe");
-    }
+    ESP_LOGI(TAG, "opening control pipe");
 
-    // determine the device address
-    xesp_open_pipe_t* ctrl_info = new_xesp_usbh_get_pipe_info(device.ctrl_pipe);
-    if (is_ctrl_pipe == false && ctrl_info == NULL) {
-        ESP_LOGE(TAG, "could not find control pipe info for pipe %p", device.ctrl_pipe);
+    xesp_usbh_dev_t* dev = calloc(1, sizeof(xesp_usbh_dev_t));
+    if (!dev) {
+        ESP_LOGE(TAG, "failed to alloc device");
         return NULL;
     }
 
-    uint8_t device_addr = ctrl_info->device_addr;
-    if (device_addr == 0 && !is_ctrl_pipe){
-        ESP_LOGE(TAG, "cant open pipe. device addess has not been set");
-        return NULL;
-    } else {
-        printf("device_addr %u\n", device_addr);
-    }
+    xSemaphoreTake(devices_mutex, portMAX_DELAY);
 
     // open the pipe / endpoint
-    hcd_pipe_handle_t pipe = xesp_usbh_xfer_open_endpoint(device.port, device_addr, ep);
-
+    hcd_pipe_handle_t pipe = xesp_usbh_xfer_open_endpoint(port, 0, speed, NULL);
     if (!pipe) {
         ESP_LOGE(TAG, "failed to open control pipe");
+        xSemaphoreGive(devices_mutex);
+        free(dev);
         return NULL;
     }
 
-    xSemaphoreTake(open_pipes_mutex, portMAX_DELAY);
+    dev->port = port;
+    dev->speed = speed;
+    dev->hub_addr = hub_addr;
+    dev->hub_port = hub_port;
+
+    // mps gets filled in when the user first asks for the device descriptor
+    dev->ctrl.pipe = pipe;
+    dev->ctrl.dev = dev;
+    ep_register(&dev->ctrl);
+
+    reset_pipe(pipe);
+
+    // link to the hub, or the root port
+    if (hub_addr) {
+        dev->parent = devices_by_addr[hub_addr];
+        if (dev->parent) {
+            dev->sibling = dev->parent->children;
+            dev->parent->children = dev;
+        }
+    } else {
+        root_device = dev;
+    }
+
+    // append to the device list
+    dev->nth_open = ++num_devices_opened;
+    dev->prev = devices_tail;
+    if (devices_tail) {
+        devices_tail->next = dev;
+    } else {
+        devices_head = dev;
+    }
+    devices_tail = dev;
+
+    ESP_LOGI(TAG, "num_devices_opened: %llu", num_devices_opened);
+
+    xSemaphoreGive(devices_mutex);
+
+    return dev;
+}
+
+hcd_pipe_handle_t xesp_usbh_open_endpoint(xesp_usb_device_t device, usb_desc_ep_t* ep){
 
-    // keep track of this pipe in the open_pipes gobal object
-    xesp_open_pipe_t* free = NULL;
-    for (int i = 0; i < XESP_USBH_MAX_PIPES; i++){
-        // find a free slot
-        if (open_pipes[i].port == NULL) {
-            free = &open_pipes[i];
-        } 
+    if (usb_util_is_control_ep(ep)) {
+        // the control pipe of the device on the root port.
+        // (devices behind a hub are opened by the hub task)
+        // Without a hub, the port speed is the device speed.
+        usb_speed_t speed = USB_SPEED_FULL;
+        if(ESP_OK != hcd_port_get_speed(device.port, &speed)){
+            ESP_LOGE(TAG, "could not get port speed. port: %p", device.port);
+        }
+        xesp_usbh_dev_t* dev = device_open(device.port, speed, 0, 0);
+        if (!dev) {
+            return NULL;
+        }
+        hcd_pipe_handle_t ctrl_pipe = dev->ctrl.pipe;
+        enum_start(dev, NULL);
+        return ctrl_pipe;
     }
 
-    if (free == NULL){
-        ESP_LOGE(TAG, "failed to open pipe. At max pipe capacity.");
-        xSemaphoreGive(open_pipes_mutex);
+    xesp_usbh_ep_t* xep = calloc(1, sizeof(xesp_usbh_ep_t));
+    if (!xep) {
+        ESP_LOGE(TAG, "failed to alloc endpoint");
         return NULL;
     }
 
-    // open pipe counter
-    if(is_ctrl_pipe) {
-        num_ctlr_pipes_opened++;
+    xSemaphoreTake(devices_mutex, portMAX_DELAY);
+
+    // the endpoint belongs to the same device as the control pipe
+    xesp_usbh_dev_t* dev = dev_of(device.ctrl_pipe);
+    if (dev == NULL) {
+        ESP_LOGE(TAG, "could not find device of control pipe %p", device.ctrl_pipe);
+        xSemaphoreGive(devices_mutex);
+        free(xep);
+        return NULL;
     }
 
-    ESP_LOGI(TAG, "num_ctlr_pipes_opened: %llu", num_ctlr_pipes_opened);
+    if (dev->device_addr == 0){
+        ESP_LOGE(TAG, "cant open pipe. device addess has not been set");
+        xSemaphoreGive(devices_mutex);
+        free(xep);
+        return NULL;
+    }
 
-    // assign the pipe to the free slot
-    free->port = device.port;
-    free->pipe = pipe;
-    free->nth_open = num_ctlr_pipes_opened;
-    free->is_control_pipe = is_ctrl_pipe;
-    free->device_addr = device_addr;
+    printf("device_addr %u\n", dev->device_addr);
 
-    if (ctrl_info) {
-        // take the max packet size from the control ep
-        free->bMaxPacketSize0 = ctrl_info->bMaxPacketSize0;
-    } else {
-        // this gets filled in when the user first asks for the device descriptor
-        free->bMaxPacketSize0 = 0; 
+    // open the pipe / endpoint
+    hcd_pipe_handle_t pipe = xesp_usbh_xfer_open_endpoint(dev->port, dev->device_addr, dev->speed, ep);
+    if (!pipe) {
+        ESP_LOGE(TAG, "failed to open pipe");
+        xSemaphoreGive(devices_mutex);
+        free(xep);
+        return NULL;
     }
 
-    hcd_pipe_state_t pipe_state = hcd_pipe_get_state(pipe);
-    ESP_LOGI(TAG, "(open) pipe state: %s", hcd_pipe_state_str(pipe_state));
+    // the device owns the endpoint
+    xep->pipe = pipe;
+    xep->dev = dev;
+    xep->mps = USB_DESC_EP_GET_MPS(ep);
+    xep->is_in = USB_DESC_EP_GET_EP_DIR(ep);
+    xep->next = dev->endpoints;
+    dev->endpoints = xep;
+    ep_register(xep);
 
-    esp_err_t rc = hcd_pipe_command(pipe, HCD_PIPE_CMD_RESET);
-    if (rc != ESP_OK) {
-        ESP_LOGE(TAG,"pipe reset failed");
-    }
-    ESP_LOGI(TAG, "(after reset) pipe state: %s", hcd_pipe_state_str(pipe_state));
+    reset_pipe(pipe);
 
-    xSemaphoreGive(open_pipes_mutex);
+    xSemaphoreGive(devices_mutex);
 
     return pipe;
 }
 
 bool xesp_usbh_close_endpoint(hcd_pipe_handle_t pipe){
 
-    xSemaphoreTake(open_pipes_mutex, portMAX_DELAY);
+    xSemaphoreTake(devices_mutex, portMAX_DELAY);
 
-    bool success = xesp_usbh_xfer_close_endpoint(pipe);
-    if (!success) {
-        ESP_LOGE(TAG, "failed to close pipe. hcd error");
-        xSemaphoreGive(open_pipes_mutex);
+    xesp_usbh_ep_t* ep = ep_of(pipe);
+    if (ep == NULL){
+        ESP_LOGE(TAG, "failed to close pipe. not found in registry");
+        xSemaphoreGive(devices_mutex);
         return false;
     }
 
-    bool found = false;
-    bool is_control_pipe = false;
-    for (int i = 0; i < XESP_USBH_MAX_PIPES; i++){
-        // clear this pipe
-        if (open_pipes[i].pipe == pipe) {
-            is_control_pipe = open_pipes[i].is_control_pipe;
-            open_pipes[i].port = NULL;
-            open_pipes[i].pipe = NULL;
-            open_pipes[i].nth_open = 0;
-            open_pipes[i].is_control_pipe = false;
-            open_pipes[i].device_addr = 0;
-            open_pipes[i].bMaxPacketSize0 = 0;
-            found = true;
+    xesp_usbh_dev_t* dev = ep->dev;
+    bool success;
+
+    if (ep == &dev->ctrl) {
+        // the device cant be used without its control pipe
+        success = device_close_locked(dev);
+    } else {
+        success = close_ep_pipe(ep);
+        if (success) {
+            xesp_usbh_ep_t** link = &dev->endpoints;
+            while (*link != ep) {
+                link = &(*link)->next;
+            }
+            *link = ep->next;
+            free(ep);
         }
     }
 
-    if (!found){
-        ESP_LOGE(TAG, "failed to close pipe. not found in registry");
-        xSemaphoreGive(open_pipes_mutex);
-        return false;
+    if (!success) {
+        ESP_LOGE(TAG, "failed to close pipe. hcd error");
     }
 
-    ESP_LOGI(TAG, "closed pipe %p control_pipe? %s", pipe, is_control_pipe ? "YES" : "NO");
+    xSemaphoreGive(devices_mutex);
+    return success;
+}
+
+uint8_t* xesp_usbh_alloc_dma_buffer(size_t length){
+    return heap_caps_aligned_calloc(USBH_HAL_DMA_MEM_ALIGN, 1, length, MALLOC_CAP_DMA);
+}
 
-    xSemaphoreGive(open_pipes_mutex);
-    return true;
+void xesp_usbh_free_dma_buffer(uint8_t* buffer){
+    heap_caps_free(buffer);
 }
 
-hcd_pipe_event_t xesp_usbh_xfer_to_pipe(hcd_pipe_handle_t pipe, uint8_t* data, uint16_t length){
-    return 0;
+// can the controller read this buffer directly?
+static bool xesp_usbh_is_dma_buffer(uint8_t* data){
+    return esp_ptr_dma_capable(data) &&
+        ((uintptr_t) data % USBH_HAL_DMA_MEM_ALIGN) == 0;
 }
 
-hcd_pipe_event_t xesp_usbh_xfer_from_pipe(hcd_pipe_handle_t pipe, 
-                                          uint8_t* data, 
-                                          uint16_t* num_bytes_transfered){
-    // blocks until an irp is available
-    usb_irp_t* irp = xesp_usbh_xfer_take_irp();
+// send 'length' bytes from 'data' in a single irp. blocks until done.
+// 'zero_copy' means the controller reads straight from 'data'
+static hcd_pipe_event_t xesp_usbh_xfer_out_irp(hcd_pipe_handle_t pipe, 
+                                               uint8_t* data, 
+                                               uint16_t length, 
+                                               bool zero_copy){
+    // blocks until an irp is available.
+    // zero copy doesnt use the irp buffer, so any size class will do
+    usb_irp_t* irp = xesp_usbh_xfer_take_irp(zero_copy ? 0 : length);
+    if (irp == NULL) {
+        return HCD_PIPE_EVENT_INVALID;
+    }
 
-    ESP_LOGI(TAG, "xfer from pipe: %p", pipe);
+    if (zero_copy) {
+        irp->data_buffer = data; // xesp_usbh_xfer_take_irp restores the irp buffer next time
+    } else if (length) {
+        memcpy(irp->data_buffer, data, length);
+    }
 
-    irp->num_bytes = 64;// smaller numbers cause crashes at time of writing... odd.
+    irp->num_bytes = length;
 
     // blocks until the irp is completed.
     hcd_pipe_event_t rc = xesp_usbh_xfer_irp(pipe, irp);
 
-    if (rc == XUSB_OK){
-        ESP_LOGI(TAG, "actual bytes transfered: %u", irp->actual_num_bytes);
-
-        *num_bytes_transfered = irp->actual_num_bytes;
-
-        uint8_t * data_returned = irp->data_buffer;// + sizeof(usb_ctrl_req_t);
-        memcpy(data, data_returned, irp->actual_num_bytes); 
-    } else {
-        *num_bytes_transfered = 0;
-    }
-
     // mark irp as available
     xesp_usbh_xfer_give_irp(irp);
 
     return rc;
 }
 
-//////////////////////////////////
-// Descriptors 
-//
+hcd_pipe_event_t xesp_usbh_xfer_to_pipe(hcd_pipe_handle_t pipe, uint8_t* data, uint16_t length){
 
-hcd_pipe_event_t xesp_usbh_get_device_descriptor(xesp_usb_device_t device, usb_desc_devc_t2* desc){
+    xSemaphoreTake(devices_mutex, portMAX_DELAY);
+    xesp_usbh_ep_t* ep = ep_of(pipe);
+    bool is_control = ep ? ep == &ep->dev->ctrl : false;
+    uint16_t mps = ep ? ep->mps : 0;
+    bool is_in = ep ? ep->is_in : false;
+    xSemaphoreGive(devices_mutex);
 
-    // blocks until an irp is available
-    usb_irp_t* irp = xesp_usbh_xfer_take_irp();
+    // control transfers need a setup packet. see the requests below
+    if (mps == 0 || is_in || is_control) {
+        ESP_LOGE(TAG, "xfer to pipe: %p is not an open OUT endpoint", pipe);
+        return HCD_PIPE_EVENT_INVALID;
+    }
 
-    ESP_LOGI(TAG, "get device description port %p pipe %p irp %u",
-         device.port, device.ctrl_pipe, xesp_usbh_xfer_irp_idx(irp));
+    ESP_LOGI(TAG, "xfer to pipe: %p length: %u", pipe, length);
 
-    USB_CTRL_REQ_INIT_GET_DEVC_DESC((usb_ctrl_req_t *) irp->data_buffer);
-    irp->num_bytes = 64;
+    hcd_pipe_event_t rc = XUSB_OK;
 
-    // blocks until the irp is completed.
-    hcd_pipe_event_t rc = xesp_usbh_xfer_irp(device.ctrl_pipe, irp);
+    if (xesp_usbh_is_dma_buffer(data)) {
+        // send straight from the caller's buffer. The controller
+        // splits it into wMaxPacketSize packets for us.
+        rc = xesp_usbh_xfer_out_irp(pipe, data, length, true);
 
-    if (rc == XUSB_OK){
-        // the data buffer always begins with the ctrl request struct
-        uint8_t * data_returned = irp->data_buffer + sizeof(usb_ctrl_req_t);
-        *desc = *(usb_desc_devc_t2*) data_returned;
+        // A transfer that is an exact multiple of wMaxPacketSize ends on a full packet,
+        // so the device cannot tell it has ended. Terminate it with a zero length packet. 
+        // (a zero length transfer was just a zero length packet)
+        if (rc == XUSB_OK && length > 0 && length % mps == 0) {
+            rc = xesp_usbh_xfer_out_irp(pipe, NULL, 0, false);
+        }
+    } else {
+        // copy through the irp buffers, several queued back to back.
+        // (this sends the zero length packet too)
+        xesp_usbh_iovec_t iov = {
+            .data = data,
+            .length = length,
+        };
+        rc = xesp_usbh_xfer_iov(pipe, &iov, 1, NULL);
     }
 
-    // mark irp as available
-    xesp_usbh_xfer_give_irp(irp);
+    if (rc != XUSB_OK) {
+        ESP_LOGE(TAG, "xfer to pipe: %p failed: %s", pipe, hcd_pipe_event_str(rc));
+    }
 
-    if (rc == XUSB_OK){
+    return rc;
+}
 
-        xSemaphoreTake(open_pipes_mutex, portMAX_DELAY);
+hcd_pipe_event_t xesp_usbh_lease_from_pipe(hcd_pipe_handle_t pipe, 
+                                            uint16_t num_bytes, 
+                                            xesp_usbh_lease_t* lease){
 
-        xesp_open_pipe_t* ctrl_info = new_xesp_usbh_get_ctrl_pipe_info(device.port);
+    lease->data = NULL;
+    lease->length = 0;
+    lease->_irp = NULL;
 
-        // set the max packet size
-        ctrl_info->bMaxPacketSize0 = desc->bMaxPacketSize0;
+    // blocks until an irp is available.
+    // The hcd only takes IN irps of whole packets, so a full packet can never overflow the buffer. 
+    // A short packet or zero length packet from the device completes the irp early.
+    usb_irp_t* irp = xesp_usbh_xfer_take_irp(num_bytes);
+    if (irp == NULL) {
+        return HCD_PIPE_EVENT_INVALID;
+    }
 
-        xSemaphoreGive(open_pipes_mutex);
+    ESP_LOGI(TAG, "xfer from pipe: %p num_bytes: %u", pipe, num_bytes);
 
-        // set the device address
-        if(ctrl_info->device_addr == 0){
-            // In the USB spec, the host must assign each device an 
-            // address after opening the control port
-            hcd_pipe_event_t rc = xesp_usb_set_addr_auto(device.port);
-            if(rc != XUSB_OK) {
-                ESP_LOGE(TAG, "could not set address");
-            }
-        }
+    // blocks until the irp is completed.
+    hcd_pipe_event_t rc = xesp_usbh_xfer_irp(pipe, irp);
+
+    if (rc != XUSB_OK){
+        // nothing to lease
+        xesp_usbh_xfer_give_irp(irp);
+        return rc;
     }
 
+    ESP_LOGI(TAG, "actual bytes transfered: %u", irp->actual_num_bytes);
+
+    // the caller now holds the irp until xesp_usbh_release_lease
+    lease->data = irp->data_buffer;
+    lease->length = irp->actual_num_bytes;
+    lease->_irp = irp;
+
     return rc;
 }
 
+void xesp_usbh_release_lease(xesp_usbh_lease_t* lease){
 
-hcd_pipe_event_t xesp_usbh_get_config_descriptor(xesp_usb_device_t device, 
-                                                 uint8_t config_idx,
-                                                 xesp_usb_config_descriptor_t** config){
+    if (lease->_irp == NULL) {
+        return; // nothing leased
+    }
 
-    // blocks until an irp is available
-    usb_irp_t* irp = xesp_usbh_xfer_take_irp();
+    // mark irp as available
+    xesp_usbh_xfer_give_irp(lease->_irp);
 
-    ESP_LOGI(TAG, "get config description port %p pipe %p irp %u", 
-        device.port, device.ctrl_pipe, xesp_usbh_xfer_irp_idx(irp));
+    lease->data = NULL;
+    lease->length = 0;
+    lease->_irp = NULL;
+}
 
-    USB_CTRL_REQ_INIT_GET_CFG_DESC((usb_ctrl_req_t *) irp->data_buffer, 1, XESP_USB_MAX_XFER_BYTES);
-    //important!! if is shorter than buffer and descriptor is longer than num_bytes, then it will stuck here
-    // so its best if both values are equal
-    irp->num_bytes = XESP_USB_MAX_XFER_BYTES;
+hcd_pipe_event_t xesp_usbh_xfer_from_pipe(hcd_pipe_handle_t pipe, 
+                                          uint8_t* data, 
+                                          uint16_t num_bytes,
+                                          uint16_t* num_bytes_transfered){
+    xesp_usbh_lease_t lease;
 
     // blocks until the irp is completed.
-    hcd_pipe_event_t rc = xesp_usbh_xfer_irp(device.ctrl_pipe, irp);
+    hcd_pipe_event_t rc = xesp_usbh_lease_from_pipe(pipe, num_bytes, &lease);
 
     if (rc == XUSB_OK){
-        ESP_LOGI(TAG, "actual bytes transfered: %u", irp->actual_num_bytes);
-
-        // the data buffer always begins with the ctrl request struct
-        uint8_t * data_returned = irp->data_buffer + sizeof(usb_ctrl_req_t);
-
-        // parse all the config data
-        *config = xesp_usbh_parse_config(data_returned, irp->actual_num_bytes);
+        *num_bytes_transfered = lease.length;
+        memcpy(data, lease.data, lease.length); 
+    } else {
+        *num_bytes_transfered = 0;
     }
 
-    // mark irp as available
-    xesp_usbh_xfer_give_irp(irp);
+    xesp_usbh_release_lease(&lease);
 
-    return XUSB_OK;
+    return rc;
 }
 
-void xesp_usbh_free_config_descriptor(xesp_usb_config_descriptor_t* config){
+xesp_usbh_stream_t* xesp_usbh_stream_from_pipe(hcd_pipe_handle_t pipe,
+                                               uint8_t num_irps,
+                                               uint16_t num_bytes,
+                                               xesp_usbh_stream_callback_t* cb,
+                                               void* ctx){
     // ^this func is just a wrapper
-    xesp_usbh_parse_free_config(config);
+    return xesp_usbh_xfer_stream_start(pipe, num_irps, num_bytes, cb, ctx);
 }
 
-hcd_pipe_event_t xesp_usbh_get_string_descriptor(xesp_usb_device_t device, 
-                                                 uint8_t string_idx,
-                                                char** str)
+void xesp_usbh_stream_stop(xesp_usbh_stream_t* stream){
+    // ^this func is just a wrapper
+    xesp_usbh_xfer_stream_stop(stream);
+}
+
+hcd_pipe_event_t xesp_usbh_xfer_iov_on_pipe(hcd_pipe_handle_t pipe, 
+                                            const xesp_usbh_iovec_t* iov, 
+                                            uint8_t iov_count,
+                                            size_t* actual_num_bytes){
+    // ^this func is just a wrapper
+    return xesp_usbh_xfer_iov(pipe, iov, iov_count, actual_num_bytes);
+}
+
+bool xesp_usbh_submit_iov(hcd_pipe_handle_t pipe, 
+                          const xesp_usbh_iovec_t* iov, 
+                          uint8_t iov_count,
+                          xesp_usbh_iov_callback_t* cb, 
+                          void* ctx){
+    // ^this func is just a wrapper
+    return xesp_usbh_xfer_submit_iov(pipe, iov, iov_count, cb, ctx);
+}
+
+//////////////////////////////////
+// IRPs (async)
+//
+
+usb_irp_t* xesp_usbh_take_irp(uint16_t num_bytes){
+    // ^this func is just a wrapper
+    return xesp_usbh_xfer_take_irp(num_bytes);
+}
+
+void xesp_usbh_give_irp(usb_irp_t* irp){
+    // ^this func is just a wrapper
+    xesp_usbh_xfer_give_irp(irp);
+}
+
+bool xesp_usbh_submit_irp(hcd_pipe_handle_t pipe, 
+                          usb_irp_t* irp, 
+                          xesp_usbh_irp_callback_t* cb, 
+                          void* ctx){
+    // ^this func is just a wrapper
+    return xesp_usbh_xfer_submit_irp(pipe, irp, cb, ctx);
+}
+
+bool xesp_usbh_cancel_irp(usb_irp_t* irp){
+    // ^this func is just a wrapper
+    return xesp_usbh_xfer_cancel_irp(irp);
+}
+
+//////////////////////////////////
+// Descriptors 
+//
+
+hcd_pipe_event_t xesp_usbh_get_device_descriptor(xesp_usb_device_t device, usb_desc_devc_t2* desc){
+
+    // a closed device's control pipe is freed, so don't submit on a stale handle
+    xSemaphoreTake(devices_mutex, portMAX_DELAY);
+    bool open = dev_of(device.ctrl_pipe) != NULL;
+    xSemaphoreGive(devices_mutex);
+    if (!open) {
+        ESP_LOGE(TAG, "device descriptor: %p is not an open control pipe", device.ctrl_pipe);
+        return HCD_PIPE_EVENT_INVALID;
+    }
+
+    // blocks until an irp is available
+    usb_irp_t* irp = xesp_usbh_xfer_take_irp(64);
+    if (irp == NULL) {
+        return HCD_PIPE_EVENT_INVALID;
+    }
+
+    ESP_LOGI(TAG, "get device description port %p pipe %p irp %u",
+         device.port, device.ctrl_pipe, xesp_usbh_xfer_irp_idx(irp));
+
+    USB_CTRL_REQ_INIT_GET_DEVC_DESC((usb_ctrl_req_t *) irp->data_buffer);
+    irp->timeout = XESP_USB_CTRL_XFER_TIMEOUT_MS;
+    irp->num_bytes = 64;
+
+    // blocks until the irp is completed.
+    hcd_pipe_event_t rc = xesp_usbh_xfer_irp(device.ctrl_pipe, irp);
+
+    if (rc == XUSB_OK){
+        // the data buffer always begins with the ctrl request struct
+        uint8_t * data_returned = irp->data_buffer + sizeof(usb_ctrl_req_t);
+        *desc = *(usb_desc_devc_t2*) data_returned;
+    }
+
+    // mark irp as available
+    xesp_usbh_xfer_give_irp(irp);
+
+    if (rc == XUSB_OK){
+
+        xSemaphoreTake(devices_mutex, portMAX_DELAY);
+
+        xesp_usbh_dev_t* dev = dev_of(device.ctrl_pipe);
+        if (dev == NULL) {
+            xSemaphoreGive(devices_mutex);
+            return HCD_PIPE_EVENT_INVALID;
+        }
+
+        // set the max packet size
+        dev->bMaxPacketSize0 = desc->bMaxPacketSize0;
+        dev->ctrl.mps = desc->bMaxPacketSize0;
+        uint8_t device_addr = dev->device_addr;
+
+        xSemaphoreGive(devices_mutex);
+
+        // set the device address
+        if(device_addr == 0){
+            // In the USB spec, the host must assign each device an 
+            // address after opening the control port
+            hcd_pipe_event_t rc = xesp_usb_set_addr_auto(device);
+            if(rc != XUSB_OK) {
+                ESP_LOGE(TAG, "could not set address");
+            }
+        }
+    }
+
+    return rc;
+}
+
+
+// wTotalLength of a config descriptor, from its first 'num_bytes' read. 
+// 0 if it is not a config descriptor, or its length is not one we will read.
+static uint16_t config_total_bytes(const uint8_t* data, uint32_t num_bytes){
+    const usb_desc_cfg_t* header = (const usb_desc_cfg_t*) data;
+    if (num_bytes < USB_DESC_CFG_SIZE ||
+        header->bDescriptorType != USB_W_VALUE_DT_CONFIG ||
+        header->wTotalLength < USB_DESC_CFG_SIZE ||
+        header->wTotalLength > XESP_USB_MAX_CONFIG_DESC_BYTES) {
+        ESP_LOGE(TAG, "bad config descriptor header. %u bytes, type %u, wTotalLength %u", 
+            (unsigned) num_bytes, 
+            num_bytes >= 2 ? header->bDescriptorType : 0,
+            num_bytes >= 4 ? header->wTotalLength : 0);
+        return 0;
+    }
+    return header->wTotalLength;
+}
+
+// read the first 'num_bytes' of config descriptor 'config_idx' into 'irp'. blocks until done.
+static hcd_pipe_event_t read_config_descriptor(hcd_pipe_handle_t ctrl_pipe, 
+                                               usb_irp_t* irp,
+                                               uint8_t config_idx, 
+                                               uint16_t num_bytes){
+
+    USB_CTRL_REQ_INIT_GET_CFG_DESC((usb_ctrl_req_t *) irp->data_buffer, config_idx, num_bytes);
+    irp->timeout = XESP_USB_CTRL_XFER_TIMEOUT_MS;
+    irp->num_bytes = num_bytes;
+
+    // blocks until the irp is completed.
+    return xesp_usbh_xfer_irp(ctrl_pipe, irp);
+}
+
+hcd_pipe_event_t xesp_usbh_get_config_descriptor(xesp_usb_device_t device, 
+                                                 uint8_t config_idx,
+                                                 xesp_usb_config_descriptor_t** config){
+
+    *config = NULL;
+
+    // first the 9 byte header, for wTotalLength
+    // blocks until an irp is available
+    usb_irp_t* irp = xesp_usbh_xfer_take_irp(USB_DESC_CFG_SIZE);
+    if (irp == NULL) {
+        return HCD_PIPE_EVENT_INVALID;
+    }
+
+    ESP_LOGI(TAG, "get config description %u port %p pipe %p irp %u", 
+        config_idx, device.port, device.ctrl_pipe, xesp_usbh_xfer_irp_idx(irp));
+
+    uint16_t total_bytes = 0;
+    hcd_pipe_event_t rc = read_config_descriptor(device.ctrl_pipe, irp, config_idx, USB_DESC_CFG_SIZE);
+
+    if (rc == XUSB_OK) {
+        // the data buffer always begins with the ctrl request struct
+        total_bytes = config_total_bytes(irp->data_buffer + sizeof(usb_ctrl_req_t), irp->actual_num_bytes);
+        if (total_bytes == 0) {
+            rc = HCD_PIPE_EVENT_ERROR_XFER;
+        }
+    }
+
+    // mark irp as available
+    xesp_usbh_xfer_give_irp(irp);
+
+    if (rc != XUSB_OK) {
+        return rc;
+    }
+
+    // then exactly wTotalLength bytes. 
+    // Too big for any irp: read straight into a buffer of its own
+    uint8_t* buffer = NULL;
+    if (total_bytes > XESP_USB_MAX_XFER_BYTES) {
+        buffer = xesp_usbh_alloc_dma_buffer(sizeof(usb_ctrl_req_t) + total_bytes);
+        if (buffer == NULL) {
+            ESP_LOGE(TAG, "could not allocate %u bytes for config descriptor", total_bytes);
+            return HCD_PIPE_EVENT_ERROR_IRP_NOT_AVAIL;
+        }
+    }
+
+    // blocks until an irp is available
+    irp = xesp_usbh_xfer_take_irp(buffer ? 0 : total_bytes);
+    if (irp == NULL) {
+        xesp_usbh_free_dma_buffer(buffer);
+        return HCD_PIPE_EVENT_INVALID;
+    }
+    if (buffer) {
+        irp->data_buffer = buffer; // xesp_usbh_xfer_take_irp restores the irp buffer next time
+    }
+
+    rc = read_config_descriptor(device.ctrl_pipe, irp, config_idx, total_bytes);
+
+    if (rc == XUSB_OK){
+        ESP_LOGI(TAG, "actual bytes transfered: %u of %u", irp->actual_num_bytes, total_bytes);
+
+        // the data buffer always begins with the ctrl request struct
+        uint8_t * data_returned = irp->data_buffer + sizeof(usb_ctrl_req_t);
+
+        // parse all the config data
+        *config = xesp_usbh_parse_config(data_returned, irp->actual_num_bytes);
+        if (*config == NULL) {
+            ESP_LOGE(TAG, "could not parse config descriptor %u", config_idx);
+            rc = HCD_PIPE_EVENT_ERROR_XFER;
+        }
+    }
+
+    // mark irp as available
+    xesp_usbh_xfer_give_irp(irp);
+
+    if (buffer) {
+        xesp_usbh_free_dma_buffer(buffer);
+    }
+
+    return rc;
+}
+
+void xesp_usbh_free_config_descriptor(xesp_usb_config_descriptor_t* config){
+    // ^this func is just a wrapper
+    xesp_usbh_parse_free_config(config);
+}
+
+// decode a string descriptor of 'num_bytes'
+static char* string_from_desc(uint8_t* data, uint16_t num_bytes){
+
+    usb_desc_str_t* desc = (usb_desc_str_t*) data;
+
+    // first 2 bytes are USB length and USB type
+    uint16_t len = num_bytes > 2 ? num_bytes - 2 : 0;
+
+    // copy to out str
+    char* str = calloc(1, len + 1); // guarentee null terminated
+    if (str && len) {
+        utf16_to_utf8((char*) &desc->val[2], str, len);
+    }
+    return str;
+}
+
+hcd_pipe_event_t xesp_usbh_get_string_descriptor(xesp_usb_device_t device, 
+                                                 uint8_t string_idx,
+                                                char** str)
 {
     // blocks until an irp is available
-    usb_irp_t* irp = xesp_usbh_xfer_take_irp();
+    usb_irp_t* irp = xesp_usbh_xfer_take_irp(XESP_USB_STRING_DESC_MAX_BYTES);
+    if (irp == NULL) {
+        return HCD_PIPE_EVENT_INVALID;
+    }
 
     ESP_LOGI(TAG, "get str %u port %p pipe %p irp %u", string_idx, 
         device.port, device.ctrl_pipe, xesp_usbh_xfer_irp_idx(irp));
 
     const int ENGLISH = 0;
-    USB_CTRL_REQ_INIT_GET_STRING((usb_ctrl_req_t *) irp->data_buffer, ENGLISH, string_idx, XESP_USB_MAX_XFER_BYTES);
-    irp->num_bytes = XESP_USB_MAX_XFER_BYTES;
+    USB_CTRL_REQ_INIT_GET_STRING((usb_ctrl_req_t *) irp->data_buffer, ENGLISH, string_idx, XESP_USB_STRING_DESC_MAX_BYTES);
+    irp->timeout = XESP_USB_CTRL_XFER_TIMEOUT_MS;
+    irp->num_bytes = XESP_USB_STRING_DESC_MAX_BYTES;
     
     // blocks until the irp is completed.
     hcd_pipe_event_t rc = xesp_usbh_xfer_irp(device.ctrl_pipe, irp);
@@ -585,14 +1213,7 @@ hcd_pipe_event_t xesp_usbh_get_string_descriptor(xesp_usb_device_t device,
     if (rc == XUSB_OK){
         // the data buffer always begins with the ctrl request struct
         uint8_t * data_returned = irp->data_buffer + sizeof(usb_ctrl_req_t);
-        usb_desc_str_t* desc = (usb_desc_str_t*) data_returned;
-
-        // first 2 bytes are USB length and USB type
-        uint16_t len = irp->actual_num_bytes - 2;
-
-        // copy to out str
-        *str = calloc(1, len + 1); // guarentee null terminated
-        utf16_to_utf8((char*) &desc->val[2], *str, len);
+        *str = string_from_desc(data_returned, irp->actual_num_bytes);
     }
 
     // mark irp as available
@@ -605,81 +1226,118 @@ hcd_pipe_event_t xesp_usbh_get_string_descriptor(xesp_usb_device_t device,
 // Set addr 
 //
 
+// move a device to a new usb address in the device table. 0 takes it out.
+// give 'dev' an address (or 0), and release its old one.
+// 'addr' must already be taken from addr_pool for this device, so that no
+// two devices share an address (see device_alloc_addr_locked, xesp_usbh_set_addr)
+static void device_set_addr_locked(xesp_usbh_dev_t* dev, uint8_t addr){
+    if (dev->device_addr == addr) {
+        return;
+    }
+    if (dev->device_addr && devices_by_addr[dev->device_addr] == dev) {
+        devices_by_addr[dev->device_addr] = NULL;
+        xesp_usb_addr_release(&addr_pool, dev->device_addr);
+    }
+    dev->device_addr = addr;
+    if (addr) {
+        devices_by_addr[addr] = dev;
+    }
+}
+
+// give 'dev' a free address, not recently used. returns 0 if every address is taken
+static uint8_t device_alloc_addr_locked(xesp_usbh_dev_t* dev){
+    uint8_t addr = xesp_usb_addr_alloc(&addr_pool);
+    if (addr) {
+        device_set_addr_locked(dev, addr);
+    }
+    return addr;
+}
+
 // set usb address of device, if needed
-hcd_pipe_event_t xesp_usb_set_addr_auto(hcd_port_handle_t port){
+hcd_pipe_event_t xesp_usb_set_addr_auto(xesp_usb_device_t device){
 
-    xSemaphoreTake(open_pipes_mutex, portMAX_DELAY);
+    xSemaphoreTake(devices_mutex, portMAX_DELAY);
 
-    // our ctlr pipe info 
-    xesp_open_pipe_t* ctrl_info = new_xesp_usbh_get_ctrl_pipe_info(port);
-    if (ctrl_info == NULL){
+    xesp_usbh_dev_t* dev = dev_of(device.ctrl_pipe);
+    if (dev == NULL){
         ESP_LOGE(TAG, "set addr auto failed. no ctrl pipe found");
+        xSemaphoreGive(devices_mutex);
         return HCD_PIPE_EVENT_INVALID;
     }
 
     // check if we already have a USB address
-    if (ctrl_info->device_addr != 0) {
-        xSemaphoreGive(open_pipes_mutex);
+    if (dev->device_addr != 0) {
+        xSemaphoreGive(devices_mutex);
         return XUSB_OK; // no work to do
     }
 
-    // loop through all devices and determine available addresses
-    bool taken_addrs[XESP_USBH_MAX_PIPES] = {0};
-    taken_addrs[0] = true; // cant use address 0
-
-    for(int i = 0; i < XESP_USBH_MAX_PIPES; i++){
-        int16_t addr = open_pipes[i].device_addr;
-        if (open_pipes[i].port != NULL) {
-            taken_addrs[addr] = true;
-        }
-    }
-
-    // determine an available USB address from the bitmask
-    int16_t new_addr = 0;
-    for (int i = 0; i < XESP_USBH_MAX_PIPES; i++){
-        if (taken_addrs[i] == false) {
-            new_addr = i;
-            break;
-        }
-    }
+    // an available USB address, not recently used.
+    // note: we reserve the address within the devices mutex
+    // so that only one thread later does the assignment
+    uint8_t new_addr = device_alloc_addr_locked(dev);
 
     if (new_addr == 0) {
-        // This should really never happen because there are 128 available device addresses. Thats a lot.
-        // If we hit this, its probably a bug somewhere.
         ESP_LOGE(TAG, "could not set device addr. no available USB address"); 
-        return HCD_PIPE_STATE_INVALID;
+        xSemaphoreGive(devices_mutex);
+        return HCD_PIPE_EVENT_INVALID;
     }
 
-    // note: we do this assignment within the open_pipes mutex
-    // so that only one thread later does the assignment
-    ctrl_info->device_addr = new_addr;
-
-    xesp_usb_device_t device;
-    device.port = port;
-    device.ctrl_pipe = ctrl_info->pipe;
+    xSemaphoreGive(devices_mutex);
 
     // set usb device address
     hcd_pipe_event_t rc = xesp_usbh_set_addr(device, new_addr);
     if (rc != XUSB_OK) {
         ESP_LOGE(TAG, "usb set addr failed"); 
-        ctrl_info->device_addr = 0;
+        xSemaphoreTake(devices_mutex, portMAX_DELAY);
+        device_set_addr_locked(dev, 0);
+        xSemaphoreGive(devices_mutex);
     }
 
-    xSemaphoreGive(open_pipes_mutex);
-
     return rc;
 }
 
 hcd_pipe_event_t xesp_usbh_set_addr(xesp_usb_device_t device, uint8_t addr){
 
+    if (addr == 0 || addr > XESP_USB_ADDR_MAX) {
+        ESP_LOGE(TAG, "set addr: %u is not a valid usb address", addr);
+        return HCD_PIPE_EVENT_INVALID;
+    }
+
+    xSemaphoreTake(devices_mutex, portMAX_DELAY);
+    xesp_usbh_dev_t* dev = dev_of(device.ctrl_pipe);
+    uint16_t bMaxPacketSize0 = dev ? dev->bMaxPacketSize0 : 0;
+    // reserve the address, so no other device is given it meanwhile.
+    // xesp_usb_set_addr_auto has already given it to this device
+    bool reserved = dev && dev->device_addr != addr && xesp_usb_addr_take(&addr_pool, addr);
+    bool taken = dev && dev->device_addr != addr && !reserved;
+    xSemaphoreGive(devices_mutex);
+
+    if (dev == NULL) {
+        ESP_LOGE(TAG, "set addr: %p is not an open control pipe", device.ctrl_pipe);
+        return HCD_PIPE_EVENT_INVALID;
+    }
+
+    // two devices answering to the same address would both reply to every request
+    if (taken) {
+        ESP_LOGE(TAG, "set addr: %u is used by another device", addr);
+        return HCD_PIPE_EVENT_INVALID;
+    }
+
     // blocks until an irp is available
-    usb_irp_t* irp = xesp_usbh_xfer_take_irp();
+    usb_irp_t* irp = xesp_usbh_xfer_take_irp(0);
+    if (irp == NULL) {
+        if (reserved) {
+            xSemaphoreTake(devices_mutex, portMAX_DELAY);
+            xesp_usb_addr_release(&addr_pool, addr);
+            xSemaphoreGive(devices_mutex);
+        }
+        return HCD_PIPE_EVENT_INVALID;
+    }
 
     ESP_LOGI(TAG, "set addr: %u port: %p pipe: %p", addr, device.port, device.ctrl_pipe);
 
-    xesp_open_pipe_t* info = new_xesp_usbh_get_pipe_info(device.ctrl_pipe);
-
     USB_CTRL_REQ_INIT_SET_ADDR((usb_ctrl_req_t *) irp->data_buffer, addr);
+    irp->timeout = XESP_USB_CTRL_XFER_TIMEOUT_MS;
 
     // set addr is special in that it *needs* this to be zero
     irp->num_bytes = 0;
@@ -690,14 +1348,24 @@ hcd_pipe_event_t xesp_usbh_set_addr(xesp_usb_device_t device, uint8_t addr){
     // mark irp as available
     xesp_usbh_xfer_give_irp(irp);
 
-    if(ESP_OK != hcd_pipe_update(device.ctrl_pipe, addr, info->bMaxPacketSize0)) {
+    bool updated = ESP_OK == hcd_pipe_update(device.ctrl_pipe, addr, bMaxPacketSize0);
+    if (!updated) {
         ESP_LOGE(TAG, "failed to update ctrl pipe addr");
     } else {
-        info->device_addr = addr; // update the address
         ESP_LOGI(TAG, "hcd_pipe_update pipe %p addr %u bMaxPacketSize0 %u", 
-            device.ctrl_pipe, addr, info->bMaxPacketSize0);
+            device.ctrl_pipe, addr, bMaxPacketSize0);
     }
 
+    // update the address. The device may have been closed meanwhile
+    xSemaphoreTake(devices_mutex, portMAX_DELAY);
+    dev = dev_of(device.ctrl_pipe);
+    if (updated && dev) {
+        device_set_addr_locked(dev, addr);
+    } else if (reserved) {
+        xesp_usb_addr_release(&addr_pool, addr);
+    }
+    xSemaphoreGive(devices_mutex);
+
     return rc;
 }
 
@@ -706,11 +1374,15 @@ hcd_pipe_event_t xesp_usbh_set_config(xesp_usb_device_t device,
 {
 
     // blocks until an irp is available
-    usb_irp_t* irp = xesp_usbh_xfer_take_irp();
+    usb_irp_t* irp = xesp_usbh_xfer_take_irp(0);
+    if (irp == NULL) {
+        return HCD_PIPE_EVENT_INVALID;
+    }
 
     ESP_LOGI(TAG, "set config: %u port: %p pipe: %p", config_idx, device.port, device.ctrl_pipe);
 
     USB_CTRL_REQ_INIT_SET_CONFIG((usb_ctrl_req_t *) irp->data_buffer, config_idx);
+    irp->timeout = XESP_USB_CTRL_XFER_TIMEOUT_MS;
 
     // set config is special in that it *needs* this to be zero
     irp->num_bytes = 0;
@@ -723,3 +1395,627 @@ hcd_pipe_event_t xesp_usbh_set_config(xesp_usb_device_t device,
 
     return rc;
 }
+
+//////////////////////////////////
+// Hubs 
+//
+
+bool xesp_usbh_attach_hub(xesp_usb_device_t device){
+
+    xSemaphoreTake(devices_mutex, portMAX_DELAY);
+    xesp_usbh_dev_t* dev = dev_of(device.ctrl_pipe);
+    uint8_t hub_addr = dev ? dev->device_addr : 0;
+    xSemaphoreGive(devices_mutex);
+
+    return xesp_usbh_hub_attach(device, hub_addr);
+}
+
+//////////////////////////////////
+// Enumeration
+//
+// Each step is submitted by enum_task, once the step before has completed,
+// so no other task waits on enumeration.
+// A step that has to wait (SET_ADDRESS recovery, or for a free irp) 
+// uses a timer, which hands the step back to enum_task.
+// Every submit holds devices_mutex and checks the device is still open,
+// because closing a device frees its control pipe. A close holds it
+// while the pipe is drained, so the steps never run on the pipe task.
+
+// Enumerations are kept for reuse, rather than freed, so their
+// timer is never deleted from its own callback
+static xesp_usbh_enum_t* enums_free = NULL;
+
+// enumerations with a step to carry on with, oldest first.
+// Each has one step in flight at most, so it is never in here twice
+static xesp_usbh_enum_t* enums_ready_head = NULL;
+static xesp_usbh_enum_t* enums_ready_tail = NULL;
+
+// protects enums_free and enums_ready
+static portMUX_TYPE enums_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static TaskHandle_t enum_task_handle = NULL;
+
+static void enum_irp_callback(usb_irp_t* irp, hcd_pipe_event_t event, void* ctx);
+static void enum_recovery_timer_cb(void* arg);
+static bool enum_from_cache(xesp_usbh_enum_t* e, uint8_t* config_header);
+
+static void free_device_info(xesp_usbh_device_info_t* info){
+    if (info->config) {
+        xesp_usbh_parse_free_config(info->config);
+    }
+    free(info->manufacturer);
+    free(info->product);
+    free(info->serial);
+    memset(info, 0, sizeof(xesp_usbh_device_info_t));
+}
+
+static xesp_usbh_enum_t* enum_alloc(){
+
+    portENTER_CRITICAL(&enums_lock);
+    xesp_usbh_enum_t* e = enums_free;
+    if (e) {
+        enums_free = e->next_free;
+    }
+    portEXIT_CRITICAL(&enums_lock);
+
+    if (e == NULL) {
+        e = calloc(1, sizeof(xesp_usbh_enum_t));
+        if (e == NULL) {
+            return NULL;
+        }
+        const esp_timer_create_args_t timer_args = {
+            .callback = enum_recovery_timer_cb,
+            .arg = e,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "usb_enum",
+        };
+        if (ESP_OK != esp_timer_create(&timer_args, &e->recovery_timer)) {
+            free(e);
+            return NULL;
+        }
+    }
+
+    return e;
+}
+
+static void enum_release(xesp_usbh_enum_t* e){
+    portENTER_CRITICAL(&enums_lock);
+    e->next_free = enums_free;
+    enums_free = e;
+    portEXIT_CRITICAL(&enums_lock);
+}
+
+// give back what the step that just completed used
+static void enum_put_irp(xesp_usbh_enum_t* e){
+    if (e->irp) {
+        xesp_usbh_xfer_give_irp(e->irp);
+        e->irp = NULL;
+    }
+    if (e->big_buffer) {
+        xesp_usbh_free_dma_buffer(e->big_buffer);
+        e->big_buffer = NULL;
+    }
+}
+
+static void enum_give_addressed(xesp_usbh_enum_t* e){
+    if (e->addressed) {
+        xSemaphoreGive(e->addressed);
+        e->addressed = NULL;
+    }
+}
+
+// hand the device what we found, and publish it. Or close it on failure.
+static void enum_finish(xesp_usbh_enum_t* e, bool success){
+
+    enum_give_addressed(e);
+
+    // remember a new device, for next time it connects
+    if (success && !e->cached && e->config_raw) {
+        xSemaphoreTake(desc_cache_mutex, portMAX_DELAY);
+        xesp_usb_desc_cache_put(&desc_cache, 
+                                (uint8_t*) &e->info.descriptor, 
+                                e->config_raw, 
+                                e->config_bytes,
+                                e->info.manufacturer, 
+                                e->info.product);
+        xSemaphoreGive(desc_cache_mutex);
+    }
+
+    // 'dev' is only cleared by a close, which holds devices_mutex the whole time.
+    // When it is already NULL, the device is gone, and there is nothing to hand over.
+    if (e->dev) {
+        xSemaphoreTake(devices_mutex, portMAX_DELAY);
+        xesp_usbh_dev_t* dev = e->dev;
+        if (dev) {
+            dev->enumeration = NULL;
+            e->dev = NULL;
+            if (success) {
+                dev->info = e->info;
+                memset(&e->info, 0, sizeof(xesp_usbh_device_info_t));
+                dev->published = true;
+                ESP_LOGI(TAG, "enumerated device addr %u", dev->device_addr);
+            } else {
+                ESP_LOGE(TAG, "enumeration failed at step %d. closing device", e->step);
+                device_close_locked(dev);
+            }
+        }
+        xSemaphoreGive(devices_mutex);
+
+        if (success && dev) {
+            ESP_LOGI(TAG, "xEventGroupSetBits CONNECT_BITS");
+            xEventGroupSetBits(connect_xEvent, CONNECT_BITS);
+        }
+    }
+
+    enum_put_irp(e);
+    free(e->config_raw);
+    e->config_raw = NULL;
+    free_device_info(&e->info); // anything not handed over
+    enum_release(e);
+}
+
+// skip the strings the device does not have
+static void enum_next_step(xesp_usbh_enum_t* e){
+    e->step++;
+    while ((e->step == ENUM_STR_MANUFACTURER && !e->info.descriptor.iManufacturer) ||
+           (e->step == ENUM_STR_PRODUCT && !e->info.descriptor.iProduct) ||
+           (e->step == ENUM_STR_SERIAL && !e->info.descriptor.iSerialNumber)) {
+        e->step++;
+    }
+}
+
+// the data bytes the request of the current step reads
+static uint16_t enum_step_bytes(xesp_usbh_enum_t* e){
+    switch (e->step) {
+        case ENUM_DEVC_DESC_SHORT:      return ENUM_DEVC_DESC_SHORT_BYTES;
+        case ENUM_SET_ADDR:             return 0;
+        case ENUM_DEVC_DESC:            return sizeof(usb_desc_devc_t2);
+        case ENUM_CONFIG_DESC_SHORT:    return USB_DESC_CFG_SIZE;
+        case ENUM_CONFIG_DESC:          return e->config_bytes;
+        default:                        return XESP_USB_STRING_DESC_MAX_BYTES; // strings
+    }
+}
+
+// submit the request of the current step
+static void enum_run(xesp_usbh_enum_t* e){
+
+    if (e->step == ENUM_DONE) {
+        enum_finish(e, true);
+        return;
+    }
+
+    // closed while we waited
+    if (e->dev == NULL) {
+        enum_finish(e, false);
+        return;
+    }
+
+    // the smallest irp that fits the step. Waiting for one would hold up
+    // every other enumeration, so try again later.
+    // A config descriptor too big for any irp is read into a buffer of its own.
+    uint16_t num_bytes = enum_step_bytes(e);
+    bool big = num_bytes > XESP_USB_MAX_XFER_BYTES;
+    usb_irp_t* irp = xesp_usbh_xfer_try_take_irp(big ? 0 : num_bytes);
+    if (irp == NULL) {
+        esp_timer_start_once(e->recovery_timer, ENUM_IRP_RETRY_US);
+        return;
+    }
+    e->irp = irp;
+
+    if (big) {
+        e->big_buffer = xesp_usbh_alloc_dma_buffer(sizeof(usb_ctrl_req_t) + num_bytes);
+        if (e->big_buffer == NULL) {
+            ESP_LOGE(TAG, "could not allocate %u bytes for config descriptor", num_bytes);
+            enum_finish(e, false);
+            return;
+        }
+        irp->data_buffer = e->big_buffer; // xesp_usbh_xfer_take_irp restores the irp buffer next time
+    }
+
+    usb_ctrl_req_t* req = (usb_ctrl_req_t *) irp->data_buffer;
+    const int ENGLISH = 0;
+
+    switch (e->step) {
+        case ENUM_DEVC_DESC_SHORT:
+            USB_CTRL_REQ_INIT_GET_DEVC_DESC(req);
+            req->wLength = num_bytes;
+            break;
+        case ENUM_SET_ADDR:
+            USB_CTRL_REQ_INIT_SET_ADDR(req, e->device_addr);
+            break;
+        case ENUM_DEVC_DESC:
+            USB_CTRL_REQ_INIT_GET_DEVC_DESC(req);
+            break;
+        case ENUM_CONFIG_DESC_SHORT:
+            USB_CTRL_REQ_INIT_GET_CFG_DESC(req, 0, num_bytes);
+            break;
+        case ENUM_CONFIG_DESC:
+            USB_CTRL_REQ_INIT_GET_CFG_DESC(req, 0, num_bytes);
+            break;
+        case ENUM_STR_MANUFACTURER:
+            USB_CTRL_REQ_INIT_GET_STRING(req, ENGLISH, e->info.descriptor.iManufacturer, num_bytes);
+            break;
+        case ENUM_STR_PRODUCT:
+            USB_CTRL_REQ_INIT_GET_STRING(req, ENGLISH, e->info.descriptor.iProduct, num_bytes);
+            break;
+        default: // ENUM_STR_SERIAL
+            USB_CTRL_REQ_INIT_GET_STRING(req, ENGLISH, e->info.descriptor.iSerialNumber, num_bytes);
+            break;
+    }
+
+    irp->num_bytes = num_bytes;
+    irp->actual_num_bytes = 0;
+    irp->timeout = XESP_USB_CTRL_XFER_TIMEOUT_MS;
+
+    xSemaphoreTake(devices_mutex, portMAX_DELAY);
+    bool submitted = e->dev && xesp_usbh_xfer_submit_irp(e->ctrl_pipe, irp, enum_irp_callback, e);
+    xSemaphoreGive(devices_mutex);
+
+    if (!submitted) {
+        enum_finish(e, false);
+    }
+}
+
+// have enum_task carry on with the enumeration. Never blocks
+static void enum_post(xesp_usbh_enum_t* e){
+    portENTER_CRITICAL(&enums_lock);
+    e->next_ready = NULL;
+    if (enums_ready_tail) {
+        enums_ready_tail->next_ready = e;
+    } else {
+        enums_ready_head = e;
+    }
+    enums_ready_tail = e;
+    portEXIT_CRITICAL(&enums_lock);
+
+    xTaskNotifyGive(enum_task_handle);
+}
+
+// on the pipe event task (or on a thread closing the device, holding devices_mutex).
+// The step is handled by enum_task
+static void enum_irp_callback(usb_irp_t* irp, hcd_pipe_event_t event, void* ctx){
+    xesp_usbh_enum_t* e = (xesp_usbh_enum_t*) ctx;
+    e->event = event;
+    enum_post(e);
+}
+
+// the step that just completed, on enum_task
+static void enum_step_done(xesp_usbh_enum_t* e){
+
+    usb_irp_t* irp = e->irp;
+    hcd_pipe_event_t event = e->event;
+
+    if (event != XUSB_OK) {
+        ESP_LOGE(TAG, "enumeration step %d failed: %s", e->step, hcd_pipe_event_str(event));
+        enum_finish(e, false);
+        return;
+    }
+
+    // the data buffer always begins with the ctrl request struct
+    uint8_t* data = irp->data_buffer + sizeof(usb_ctrl_req_t);
+
+    switch (e->step) {
+        case ENUM_DEVC_DESC_SHORT: {
+            uint8_t mps0 = ((usb_desc_devc_t2*) data)->bMaxPacketSize0;
+            if (irp->actual_num_bytes < ENUM_DEVC_DESC_SHORT_BYTES || mps0 == 0) {
+                ESP_LOGE(TAG, "enumeration: bad device descriptor");
+                enum_finish(e, false);
+                return;
+            }
+            e->info.descriptor.bMaxPacketSize0 = mps0;
+
+            // reserve an address, and talk to EP0 with its real packet size
+            xSemaphoreTake(devices_mutex, portMAX_DELAY);
+            xesp_usbh_dev_t* dev = e->dev;
+            if (dev && ESP_OK == hcd_pipe_update(e->ctrl_pipe, 0, mps0)) {
+                dev->bMaxPacketSize0 = mps0;
+                dev->ctrl.mps = mps0;
+                e->device_addr = device_alloc_addr_locked(dev);
+            }
+            xSemaphoreGive(devices_mutex);
+
+            if (!e->device_addr) {
+                ESP_LOGE(TAG, "enumeration: could not reserve an address");
+                enum_finish(e, false);
+                return;
+            }
+            break;
+        }
+        case ENUM_SET_ADDR: {
+            xSemaphoreTake(devices_mutex, portMAX_DELAY);
+            bool updated = e->dev && ESP_OK == hcd_pipe_update(e->ctrl_pipe, e->device_addr, 
+                                                              e->info.descriptor.bMaxPacketSize0);
+            xSemaphoreGive(devices_mutex);
+
+            if (!updated) {
+                enum_finish(e, false);
+                return;
+            }
+
+            // off address 0
+            enum_give_addressed(e);
+
+            // carry on once the device has recovered
+            enum_put_irp(e);
+            enum_next_step(e);
+            esp_timer_start_once(e->recovery_timer, ENUM_SET_ADDR_RECOVERY_US);
+            return;
+        }
+        case ENUM_DEVC_DESC: {
+            // the whole descriptor, with the packet size the pipe was set up with
+            usb_desc_devc_t2* desc = (usb_desc_devc_t2*) data;
+            if (irp->actual_num_bytes < sizeof(usb_desc_devc_t2) || 
+                desc->bLength < sizeof(usb_desc_devc_t2) ||
+                desc->bDescriptorType != USB_W_VALUE_DT_DEVICE ||
+                desc->bMaxPacketSize0 != e->info.descriptor.bMaxPacketSize0) {
+                ESP_LOGE(TAG, "enumeration: bad device descriptor");
+                enum_finish(e, false);
+                return;
+            }
+            e->info.descriptor = *desc;
+            break;
+        }
+        case ENUM_CONFIG_DESC_SHORT: {
+            e->config_bytes = config_total_bytes(data, irp->actual_num_bytes);
+            if (e->config_bytes == 0) {
+                enum_finish(e, false);
+                return;
+            }
+
+            // seen before. only the serial number is left to read
+            if (enum_from_cache(e, data)) {
+                e->step = ENUM_STR_SERIAL - 1;
+            }
+            break;
+        }
+        case ENUM_CONFIG_DESC: {
+            usb_desc_cfg_t* cfg = (usb_desc_cfg_t*) data;
+            e->info.config = xesp_usbh_parse_config(data, irp->actual_num_bytes);
+
+            // only a complete descriptor is worth caching
+            if (e->info.config && 
+                irp->actual_num_bytes == e->config_bytes &&
+                cfg->wTotalLength == e->config_bytes) {
+                e->config_raw = malloc(e->config_bytes);
+                if (e->config_raw) {
+                    memcpy(e->config_raw, data, e->config_bytes);
+                }
+            }
+            break;
+        }
+        case ENUM_STR_MANUFACTURER:
+            e->info.manufacturer = string_from_desc(data, irp->actual_num_bytes);
+            break;
+        case ENUM_STR_PRODUCT:
+            e->info.product = string_from_desc(data, irp->actual_num_bytes);
+            break;
+        default: // ENUM_STR_SERIAL
+            e->info.serial = string_from_desc(data, irp->actual_num_bytes);
+            break;
+    }
+
+    enum_put_irp(e);
+    enum_next_step(e);
+    enum_run(e);
+}
+
+// fill in the config descriptor and strings from the descriptor cache. 
+// 'config_header' is the first 9 bytes of the device's config descriptor.
+// An entry that no longer matches the device is dropped.
+static bool enum_from_cache(xesp_usbh_enum_t* e, uint8_t* config_header){
+
+    xSemaphoreTake(desc_cache_mutex, portMAX_DELAY);
+
+    xesp_usb_desc_cache_entry_t* entry = 
+        xesp_usb_desc_cache_find(&desc_cache, (uint8_t*) &e->info.descriptor);
+
+    if (entry && memcmp(entry->config, config_header, USB_DESC_CFG_SIZE) != 0) {
+        ESP_LOGW(TAG, "cached config descriptor is stale. reading it again");
+        xesp_usb_desc_cache_remove(&desc_cache, entry);
+        entry = NULL;
+    }
+
+    bool cached = false;
+    if (entry) {
+        xesp_usb_config_descriptor_t* config = xesp_usbh_parse_config(entry->config, entry->config_bytes);
+        char* manufacturer = entry->manufacturer ? strdup(entry->manufacturer) : NULL;
+        char* product = entry->product ? strdup(entry->product) : NULL;
+
+        cached = config && 
+                 (manufacturer || !entry->manufacturer) && 
+                 (product || !entry->product);
+
+        if (cached) {
+            e->info.config = config;
+            e->info.manufacturer = manufacturer;
+            e->info.product = product;
+        } else {
+            // out of memory. read them from the device instead
+            if (config) {
+                xesp_usbh_parse_free_config(config);
+            }
+            free(manufacturer);
+            free(product);
+        }
+    }
+
+    xSemaphoreGive(desc_cache_mutex);
+
+    e->cached = cached;
+    return e->cached;
+}
+
+// on the esp_timer task, which every timer shares. enum_run can block 
+// (on devices_mutex, and the pipe's enqueue mutex), so carry on from enum_task
+static void enum_recovery_timer_cb(void* arg){
+    enum_post((xesp_usbh_enum_t*) arg);
+}
+
+// runs the steps of every enumeration, as their irps complete or their timers fire
+static void enum_task(void* arg){
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (true) {
+            portENTER_CRITICAL(&enums_lock);
+            xesp_usbh_enum_t* e = enums_ready_head;
+            if (e) {
+                enums_ready_head = e->next_ready;
+                if (enums_ready_head == NULL) {
+                    enums_ready_tail = NULL;
+                }
+            }
+            portEXIT_CRITICAL(&enums_lock);
+
+            if (e == NULL) {
+                break;
+            }
+
+            // a completed step still holds its irp. A timer step has none
+            if (e->irp) {
+                enum_step_done(e);
+            } else {
+                enum_run(e);
+            }
+        }
+    }
+}
+
+static bool enum_setup(){
+    return pdPASS == xTaskCreate(enum_task, "usb_enum_task", 4*1024, NULL, ENUM_TASK_PRIORITY, &enum_task_handle);
+}
+
+// enumerate a device that was just opened at address 0. Returns right away.
+// 'addressed' (can be NULL) is given once the device has an address, or enumeration has failed.
+// On failure the device is closed. returns false if enumeration could not start.
+static bool enum_start(xesp_usbh_dev_t* dev, SemaphoreHandle_t addressed){
+
+    xesp_usbh_enum_t* e = enum_alloc();
+
+    xSemaphoreTake(devices_mutex, portMAX_DELAY);
+
+    if (e == NULL) {
+        ESP_LOGE(TAG, "could not start enumeration");
+        device_close_locked(dev);
+        xSemaphoreGive(devices_mutex);
+        return false;
+    }
+
+    e->dev = dev;
+    e->ctrl_pipe = dev->ctrl.pipe;
+    e->irp = NULL;
+    e->step = ENUM_DEVC_DESC_SHORT;
+    e->device_addr = 0;
+    e->config_bytes = 0;
+    e->config_raw = NULL;
+    e->big_buffer = NULL;
+    e->cached = false;
+    e->addressed = addressed;
+    dev->enumeration = e;
+
+    xSemaphoreGive(devices_mutex);
+
+    enum_run(e);
+    return true;
+}
+
+
+//////////////////////////////////
+// Descriptor cache
+//
+
+// replace the cache with the one saved in NVS. Nothing saved yet is not an error.
+static bool desc_cache_load(){
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(DESC_CACHE_NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        return true; // never saved
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "could not load the descriptor cache from nvs: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    size_t size = 0;
+    err = nvs_get_blob(handle, DESC_CACHE_NVS_KEY, NULL, &size);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        nvs_close(handle);
+        return true;
+    }
+
+    uint8_t* blob = (err == ESP_OK) ? malloc(size) : NULL;
+    if (blob) {
+        err = nvs_get_blob(handle, DESC_CACHE_NVS_KEY, blob, &size);
+    }
+    nvs_close(handle);
+
+    if (blob == NULL || err != ESP_OK) {
+        ESP_LOGE(TAG, "could not read the descriptor cache: %s", esp_err_to_name(err));
+        free(blob);
+        return false;
+    }
+
+    xSemaphoreTake(desc_cache_mutex, portMAX_DELAY);
+    bool ok = xesp_usb_desc_cache_deserialize(&desc_cache, blob, size);
+    xSemaphoreGive(desc_cache_mutex);
+
+    free(blob);
+
+    if (!ok) {
+        ESP_LOGW(TAG, "saved descriptor cache is not valid. ignoring it");
+    }
+    return ok;
+}
+
+bool xesp_usbh_save_descriptor_cache(){
+
+    xSemaphoreTake(desc_cache_mutex, portMAX_DELAY);
+
+    if (!desc_cache.dirty) {
+        xSemaphoreGive(desc_cache_mutex);
+        return true;
+    }
+
+    size_t size = xesp_usb_desc_cache_serialize(&desc_cache, NULL, 0);
+    uint8_t* blob = malloc(size);
+    if (blob) {
+        xesp_usb_desc_cache_serialize(&desc_cache, blob, size);
+    }
+
+    xSemaphoreGive(desc_cache_mutex);
+
+    if (blob == NULL) {
+        ESP_LOGE(TAG, "could not allocate %u bytes to save the descriptor cache", (unsigned) size);
+        return false;
+    }
+
+    // write to flash outside the lock, so enumeration is not held up
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(DESC_CACHE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(handle, DESC_CACHE_NVS_KEY, blob, size);
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+
+    free(blob);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "could not save the descriptor cache: %s", esp_err_to_name(err));
+        // try again next time
+        xSemaphoreTake(desc_cache_mutex, portMAX_DELAY);
+        desc_cache.dirty = true;
+        xSemaphoreGive(desc_cache_mutex);
+        return false;
+    }
+    return true;
+}
+
+void xesp_usbh_clear_descriptor_cache(){
+    xSemaphoreTake(desc_cache_mutex, portMAX_DELAY);
+    xesp_usb_desc_cache_clear(&desc_cache);
+    xSemaphoreGive(desc_cache_mutex);
+}
@@ -12,7 +12,8 @@
 // Init
 //
 
-// init buffers, FreeRTOS objects, etc
+// init buffers, FreeRTOS objects, etc, load the descriptor cache from NVS,
+// then power the port. Call nvs_flash_init first, or the cache starts empty.
 void xesp_usbh_init();
 
 
@@ -24,12 +25,37 @@ void xesp_usbh_init();
 // Multiple thread can wait on this next device, and all threads
 // will open the connected device simultaneously.
 //
+// Devices are enumerated in the background as soon as they connect
+// (addressed, descriptors and strings read), and only returned once that is done.
+// see xesp_usbh_get_device_info.
+//
 // open_count is an in / out parameter that we use to keep track
 // of which connection events you have already been informed of. It should start at 0.
 xesp_usb_device_t xesp_usbh_open_device(uint64_t* open_count);
 
 bool xesp_usbh_close_device(xesp_usb_device_t device);
 
+// What was read from the device when it was enumerated: its device descriptor,
+// first configuration and strings. No usb traffic. Owned by the library, do not free.
+// Valid until the device is closed. NULL if the device is not open.
+const xesp_usbh_device_info_t* xesp_usbh_get_device_info(xesp_usb_device_t device);
+
+//////////////////////////////////
+// Descriptor cache
+//
+
+// Devices that were enumerated before are recognised from their device descriptor,
+// and their config descriptor and strings are taken from the cache (see XESP_USBH_DESC_CACHE_ENTRIES).
+// The cache lives in RAM. xesp_usbh_init reads it back from NVS, before any device
+// can enumerate, and xesp_usbh_save_descriptor_cache saves it, so it survives reboots.
+
+// save the cache to NVS, if it changed since it was last saved or loaded.
+// Writes flash, so call it from a task that can wait (e.g. after opening a device).
+bool xesp_usbh_save_descriptor_cache();
+
+// forget every device. Call xesp_usbh_save_descriptor_cache to clear NVS too.
+void xesp_usbh_clear_descriptor_cache();
+
 //////////////////////////////////
 // Endpoints
 //
@@ -38,9 +64,98 @@ hcd_pipe_handle_t xesp_usbh_open_endpoint(xesp_usb_device_t device, usb_desc_ep_
 
 bool xesp_usbh_close_endpoint(hcd_pipe_handle_t pipe);
 
+// Send data to a bulk OUT endpoint. Blocks until sent.
+// If 'data' is DMA capable and aligned to USBH_HAL_DMA_MEM_ALIGN (i.e. from 
+// xesp_usbh_alloc_dma_buffer) it is sent in place, without a copy. 
+// A zero length packet is appended when 'length' is a multiple of wMaxPacketSize.
 hcd_pipe_event_t xesp_usbh_xfer_to_pipe(hcd_pipe_handle_t pipe, uint8_t* data, uint16_t length);
 
-hcd_pipe_event_t xesp_usbh_xfer_from_pipe(hcd_pipe_handle_t pipe, uint8_t* data, uint16_t* num_bytes_transfered);
+// allocate a buffer that xesp_usbh_xfer_to_pipe can send without a copy
+uint8_t* xesp_usbh_alloc_dma_buffer(size_t length);
+
+void xesp_usbh_free_dma_buffer(uint8_t* buffer);
+
+// Receive up to 'num_bytes' from an IN endpoint. Blocks until received.
+// 'num_bytes' must be a multiple of the endpoint's max packet size, 
+// and at most XESP_USB_MAX_XFER_BYTES. The read completes as soon as the device 
+// sends a short packet (or a zero length packet), so a large 'num_bytes' 
+// does not delay small messages. 'num_bytes_transfered' is what was actually sent.
+// copies into 'data'. see xesp_usbh_lease_from_pipe to avoid the copy.
+hcd_pipe_event_t xesp_usbh_xfer_from_pipe(hcd_pipe_handle_t pipe, 
+                                          uint8_t* data, 
+                                          uint16_t num_bytes,
+                                          uint16_t* num_bytes_transfered);
+
+// Receive up to 'num_bytes' from an IN endpoint without copying it. Blocks until received.
+// 'num_bytes' follows the same rules as xesp_usbh_xfer_from_pipe.
+// On success, 'lease' points straight into the irp's DMA buffer. 
+// You *must* call xesp_usbh_release_lease when done parsing, 
+// because the irp is not returned to the pool until then.
+// On failure, there is nothing to release.
+hcd_pipe_event_t xesp_usbh_lease_from_pipe(hcd_pipe_handle_t pipe, 
+                                           uint16_t num_bytes, 
+                                           xesp_usbh_lease_t* lease);
+
+// return the leased irp to the pool. lease->data is invalid afterwards.
+void xesp_usbh_release_lease(xesp_usbh_lease_t* lease);
+
+// Streaming read. Keeps 'num_irps' reads of 'num_bytes' each queued on the 
+// IN pipe at all times, so there is no idle time between packets.
+// 'num_bytes' must be a multiple of the endpoint's max packet size.
+// 'cb' is called from the pipe event task for every completed read.
+// returns NULL on failure.
+xesp_usbh_stream_t* xesp_usbh_stream_from_pipe(hcd_pipe_handle_t pipe,
+                                               uint8_t num_irps,
+                                               uint16_t num_bytes,
+                                               xesp_usbh_stream_callback_t* cb,
+                                               void* ctx);
+
+// stop a stream. blocks until all its irps are returned.
+void xesp_usbh_stream_stop(xesp_usbh_stream_t* stream);
+
+// Scatter-gather transfer of any length, to or from a bulk endpoint. Blocks until done.
+// The buffers in 'iov' are split into irps (OUT ones queued back to back), 
+// so multi-kilobyte payloads need no chunking loop.
+// 'actual_num_bytes' (can be NULL) is the total moved. IN transfers end early on a short packet,
+// and never read past it.
+hcd_pipe_event_t xesp_usbh_xfer_iov_on_pipe(hcd_pipe_handle_t pipe, 
+                                            const xesp_usbh_iovec_t* iov, 
+                                            uint8_t iov_count,
+                                            size_t* actual_num_bytes);
+
+// Non-blocking version of xesp_usbh_xfer_iov_on_pipe. 'cb' runs once, from the pipe 
+// event task, when the whole transfer is done. 'iov' and its buffers
+// must stay valid until then. returns false if nothing was submitted.
+bool xesp_usbh_submit_iov(hcd_pipe_handle_t pipe, 
+                          const xesp_usbh_iovec_t* iov, 
+                          uint8_t iov_count,
+                          xesp_usbh_iov_callback_t* cb, 
+                          void* ctx);
+
+//////////////////////////////////
+// IRPs (async)
+//
+
+// blocks until an irp that can hold 'num_bytes' of data is available.
+// returns NULL if 'num_bytes' is more than XESP_USB_MAX_XFER_BYTES
+usb_irp_t* xesp_usbh_take_irp(uint16_t num_bytes);
+
+// mark irp as available
+void xesp_usbh_give_irp(usb_irp_t* irp);
+
+// Non-blocking. Enqueue the irp and return right away.
+// 'cb' runs from the pipe event task when the irp completes,
+// so a single task can keep many endpoints busy at once.
+// returns false if the irp could not be enqueued ('cb' will not run).
+// Set irp->timeout (ms) to have the irp cancelled if it takes too long.
+bool xesp_usbh_submit_irp(hcd_pipe_handle_t pipe, 
+                          usb_irp_t* irp, 
+                          xesp_usbh_irp_callback_t* cb, 
+                          void* ctx);
+
+// Non-blocking. Cancel a submitted irp, even one that is in flight.
+// Its callback still runs, with HCD_PIPE_EVENT_ERROR_IRP_NOT_AVAIL.
+bool xesp_usbh_cancel_irp(usb_irp_t* irp);
 
 //////////////////////////////////
 // Descriptors 
@@ -51,7 +166,10 @@ hcd_pipe_event_t xesp_usbh_xfer_from_pipe(hcd_pipe_handle_t pipe, uint8_t* data,
 hcd_pipe_event_t xesp_usbh_get_device_descriptor(xesp_usb_device_t device, usb_desc_devc_t2* descriptor);
 
 // get Nth config descriptor (...and the interface / endpoints within that config).
-// returns HCD_PIPE_EVENT_IRP_DONE on success.
+// 'config_idx' starts at 0, up to bNumConfigurations - 1. It is not bConfigurationValue.
+// Reads the 9 byte header first, then exactly wTotalLength bytes, 
+// up to XESP_USB_MAX_CONFIG_DESC_BYTES.
+// returns HCD_PIPE_EVENT_IRP_DONE on success. 'config' is NULL on failure.
 // ALLOCATION! The caller must free this object.
 hcd_pipe_event_t xesp_usbh_get_config_descriptor(xesp_usb_device_t device, 
                                                  uint8_t config_idx,
@@ -80,3 +198,14 @@ hcd_pipe_event_t xesp_usbh_set_config(xesp_usb_device_t device,
 // see docs in xesp_usb_interface_t.
 void xesp_usbh_set_active_interface_alt_setting(xesp_usb_interface_t* interface, 
                                                int alternate_setting);
+
+
+//////////////////////////////////
+//  Hubs
+//
+
+// Take over an external hub (its device descriptor has bDeviceClass USB_CLASS_HUB).
+// Sets the hub configuration and powers its ports. From then on, devices plugged
+// into the hub are reset and addressed in the background, and returned by
+// xesp_usbh_open_device like any other device. Closing the hub closes them too.
+bool xesp_usbh_attach_hub(xesp_usb_device_t device);
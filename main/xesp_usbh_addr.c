@@ -0,0 +1,63 @@
+#include "xesp_usbh_addr.h"
+
+#define ADDR_WORDS ((XESP_USB_ADDR_MAX + 1) / 32)
+
+#define ADDR_WORD(addr) ((addr) / 32)
+#define ADDR_BIT(addr) (1u << ((addr) % 32))
+
+void xesp_usb_addr_init(xesp_usb_addr_pool_t* pool){
+    for (int w = 0; w < ADDR_WORDS; w++) {
+        pool->free[w] = 0xFFFFFFFF;
+    }
+    pool->free[0] &= ~ADDR_BIT(0); // the default address
+    pool->next = 1;
+}
+
+uint8_t xesp_usb_addr_alloc(xesp_usb_addr_pool_t* pool){
+
+    int w = ADDR_WORD(pool->next);
+
+    // the free addresses from 'next' onwards in its word
+    uint32_t bits = pool->free[w] & ~(ADDR_BIT(pool->next) - 1);
+
+    // then the following words, wrapping around back to the
+    // start of the first one. At most ADDR_WORDS + 1 words.
+    for (int i = 0; bits == 0 && i < ADDR_WORDS; i++) {
+        w = (w + 1) % ADDR_WORDS;
+        bits = pool->free[w];
+    }
+
+    if (bits == 0) {
+        return 0; // all taken
+    }
+
+    uint8_t addr = w * 32 + __builtin_ctz(bits);
+
+    pool->free[w] &= ~ADDR_BIT(addr);
+    pool->next = (addr == XESP_USB_ADDR_MAX) ? 1 : addr + 1;
+
+    return addr;
+}
+
+bool xesp_usb_addr_take(xesp_usb_addr_pool_t* pool, uint8_t addr){
+
+    if (addr == 0 || addr > XESP_USB_ADDR_MAX) {
+        return false;
+    }
+
+    if (!(pool->free[ADDR_WORD(addr)] & ADDR_BIT(addr))) {
+        return false;
+    }
+
+    pool->free[ADDR_WORD(addr)] &= ~ADDR_BIT(addr);
+    return true;
+}
+
+void xesp_usb_addr_release(xesp_usb_addr_pool_t* pool, uint8_t addr){
+
+    if (addr == 0 || addr > XESP_USB_ADDR_MAX) {
+        return;
+    }
+
+    pool->free[ADDR_WORD(addr)] |= ADDR_BIT(addr);
+}
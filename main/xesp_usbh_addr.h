@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+
+A bitmap allocator for usb device addresses (1 to 127).
+
+Address 0 is the default address that every device answers to 
+until it is given one, so it is never handed out.
+
+Finding a free address is a few find-first-set instructions, 
+no matter how many devices are connected. The search starts just 
+after the last address handed out, so a released address is the 
+last to be reused. A device that was just unplugged may still be 
+answering to it, or the host may still have stale state for it.
+
+Not thread safe. The caller holds its own lock.
+
+This file is plain C11, with no FreeRTOS, so it can be built on a host.
+
+*/
+
+#define XESP_USB_ADDR_MAX 127
+
+struct xesp_usb_addr_pool_t{
+    uint32_t free[(XESP_USB_ADDR_MAX + 1) / 32]; // bit n is set if address n is free
+    uint8_t next; // where the next search starts
+};
+
+typedef struct xesp_usb_addr_pool_t xesp_usb_addr_pool_t;
+
+// starts with every address free
+void xesp_usb_addr_init(xesp_usb_addr_pool_t* pool);
+
+// returns 0 if every address is taken
+uint8_t xesp_usb_addr_alloc(xesp_usb_addr_pool_t* pool);
+
+// mark a specific address as taken (e.g. set by hand). 
+// returns false if it was already taken, or is not a valid address
+bool xesp_usb_addr_take(xesp_usb_addr_pool_t* pool, uint8_t addr);
+
+// give an address back. Addresses that are not taken are ignored.
+void xesp_usb_addr_release(xesp_usb_addr_pool_t* pool, uint8_t addr);
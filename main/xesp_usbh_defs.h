@@ -3,12 +3,68 @@
 #include "usb.h"
 #include "hcd.h"
 
+#include "usb_utils.h"
+
 
 #define XESP_USBH_PORT_COUNT 1 // we have only 1 port on the hardware
 
 #define XUSB_OK HCD_PIPE_EVENT_IRP_DONE
 
-#define XESP_USB_MAX_XFER_BYTES 256
+// The irp pool is split into size classes. Each class has its own DMA buffers and 
+// freelist, so small control requests dont tie up large buffers.
+// Sizes are data bytes. Every buffer also has room for a control request header.
+// The counts can be overridden with compile definitions.
+#define XESP_USB_IRP_SMALL_BYTES 64
+#define XESP_USB_IRP_MEDIUM_BYTES 512
+#define XESP_USB_IRP_LARGE_BYTES 4096
+
+#ifndef XESP_USB_IRP_SMALL_COUNT
+#define XESP_USB_IRP_SMALL_COUNT 8
+#endif
+
+#ifndef XESP_USB_IRP_MEDIUM_COUNT
+#define XESP_USB_IRP_MEDIUM_COUNT 4
+#endif
+
+#ifndef XESP_USB_IRP_LARGE_COUNT
+#define XESP_USB_IRP_LARGE_COUNT 2
+#endif
+
+// the most data a single irp can hold
+#define XESP_USB_MAX_XFER_BYTES XESP_USB_IRP_LARGE_BYTES
+
+// every irp has room for this many isochronous packet descriptors (irp->iso_packet_desc).
+// The hcd caps an isochronous irp at 32 frames, so more than 32 is never used.
+#ifndef XESP_USB_IRP_ISO_PACKETS
+#define XESP_USB_IRP_ISO_PACKETS 8
+#endif
+
+// An idle bulk IN endpoint just NAKs, and polling it keeps a hardware channel busy.
+// After POLL frames (1ms each) without data the pipe gives up its channel, and polls
+// again REARM frames later. Raising POLL lowers latency, raising REARM frees up the bus.
+// POLL of 0 polls for as long as a read is posted.
+#ifndef XESP_USBH_BULK_IN_NAK_POLL_FRAMES
+#define XESP_USBH_BULK_IN_NAK_POLL_FRAMES 2
+#endif
+
+#ifndef XESP_USBH_BULK_IN_NAK_REARM_FRAMES
+#define XESP_USBH_BULK_IN_NAK_REARM_FRAMES 4
+#endif
+
+// the longest config descriptor (wTotalLength) we read. The length comes from the device, 
+// and one longer than an irp gets a DMA buffer of its own, so a bad device could ask for 64KB.
+#ifndef XESP_USB_MAX_CONFIG_DESC_BYTES
+#define XESP_USB_MAX_CONFIG_DESC_BYTES 8192
+#endif
+
+// the most time a device gets to answer a standard control request (usb 2.0 9.2.6.4)
+#define XESP_USB_CTRL_XFER_TIMEOUT_MS 5000
+
+// how many devices the descriptor cache remembers. 0 turns it off.
+// A device seen before is enumerated without re-reading its config descriptor and strings.
+#ifndef XESP_USBH_DESC_CACHE_ENTRIES
+#define XESP_USBH_DESC_CACHE_ENTRIES 8
+#endif
 
 //////////////////////////////
 // Definitions
@@ -21,6 +77,44 @@ struct xesp_usb_device_t{
 
 typedef struct xesp_usb_device_t xesp_usb_device_t;
 
+// called from the pipe event task when a submitted irp completes.
+// event is HCD_PIPE_EVENT_IRP_DONE on success.
+// The callback owns the irp: it must give it back or submit it again.
+// Keep it short, it runs on the task that dispatches every pipe event.
+typedef void(xesp_usbh_irp_callback_t)(usb_irp_t* irp, hcd_pipe_event_t event, void* ctx);
+
+// A read-only view into the DMA buffer of a completed IN irp.
+// The irp stays out of the pool until the lease is released.
+struct xesp_usbh_lease_t{
+    uint8_t* data;
+    uint16_t length;
+    usb_irp_t* _irp; // used internally
+};
+
+typedef struct xesp_usbh_lease_t xesp_usbh_lease_t;
+
+// A stream keeps several irps queued on an IN endpoint.
+// see xesp_usbh_stream_from_pipe
+typedef struct xesp_usbh_stream_t xesp_usbh_stream_t;
+
+// called from the pipe event task for every completed stream irp, in order.
+// 'data' is only valid until the callback returns.
+// on error, 'length' is 0 and that irp is retired from the stream.
+typedef void(xesp_usbh_stream_callback_t)(uint8_t* data, uint16_t length, hcd_pipe_event_t event, void* ctx);
+
+// one buffer of a scatter-gather transfer
+struct xesp_usbh_iovec_t{
+    uint8_t* data;
+    uint16_t length;
+};
+
+typedef struct xesp_usbh_iovec_t xesp_usbh_iovec_t;
+
+// called once, when a whole scatter-gather transfer is done.
+// 'actual_num_bytes' is the total moved across all buffers. 
+// 'event' is HCD_PIPE_EVENT_IRP_DONE, or the first error.
+typedef void(xesp_usbh_iov_callback_t)(size_t actual_num_bytes, hcd_pipe_event_t event, void* ctx);
+
 struct xesp_usb_endpoint_descriptor_t{
     usb_desc_ep_t val; // the endpoint descriptor
     // class specified endpoints follow after the main endpoint descriptor ('val')
@@ -79,4 +173,16 @@ struct xesp_usb_config_descriptor_t{
 
 typedef struct xesp_usb_config_descriptor_t xesp_usb_config_descriptor_t;
 
+// What the library read from a device when it was connected (see xesp_usbh_get_device_info).
+// Owned by the library, and valid until the device is closed.
+struct xesp_usbh_device_info_t{
+    usb_desc_devc_t2 descriptor; // the device descriptor
+    xesp_usb_config_descriptor_t* config; // the first configuration
+    char* manufacturer; // NULL if the device has no such string
+    char* product;
+    char* serial;
+};
+
+typedef struct xesp_usbh_device_info_t xesp_usbh_device_info_t;
+
 typedef struct usb_desc_device_t usb_desc_device_t;
\ No newline at end of file
@@ -0,0 +1,302 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "xesp_usbh_desc_cache.h"
+
+// offsets into the raw device descriptor (usb 2.0 table 9-8)
+#define DEVC_ID_VENDOR 8 // then idProduct and bcdDevice
+#define DEVC_I_SERIAL_NUMBER 16
+
+// the config descriptor header (usb 2.0 table 9-10)
+#define CONFIG_HEADER_BYTES 9
+#define CONFIG_W_TOTAL_LENGTH 2
+
+// blob layout:
+//   magic (2), version (1), entry count (1),
+//   then per entry: devc (18), config_bytes (2), 2 string lengths (2 each),
+//   config, strings. little endian. A string length of NO_STRING is a NULL string.
+#define BLOB_MAGIC_0 'X'
+#define BLOB_MAGIC_1 'D'
+#define BLOB_VERSION 1
+#define BLOB_HEADER_BYTES 4
+#define BLOB_STRINGS 2 // manufacturer, product
+#define BLOB_ENTRY_HEADER_BYTES (XESP_USB_DESC_CACHE_DEVC_BYTES + 2 + BLOB_STRINGS * 2)
+#define NO_STRING 0xFFFF
+
+static bool same_key(const uint8_t* a, const uint8_t* b){
+    return memcmp(a + DEVC_ID_VENDOR, b + DEVC_ID_VENDOR, 6) == 0 &&
+           a[DEVC_I_SERIAL_NUMBER] == b[DEVC_I_SERIAL_NUMBER];
+}
+
+static uint16_t get_u16(const uint8_t* p){
+    return p[0] | (p[1] << 8);
+}
+
+// a whole config descriptor: at least its header, and as long as that says
+static bool valid_config(const uint8_t* config, uint16_t config_bytes){
+    return config != NULL &&
+           config_bytes >= CONFIG_HEADER_BYTES &&
+           get_u16(config + CONFIG_W_TOTAL_LENGTH) == config_bytes;
+}
+
+static void entry_free(xesp_usb_desc_cache_entry_t* entry){
+    free(entry->config);
+    free(entry->manufacturer);
+    free(entry->product);
+    memset(entry, 0, sizeof(xesp_usb_desc_cache_entry_t));
+}
+
+static bool entry_used(const xesp_usb_desc_cache_entry_t* entry){
+    return entry->config != NULL;
+}
+
+// copy of 'len' bytes of 'str', null terminated
+static char* str_dup(const char* str, size_t len){
+    char* out = malloc(len + 1);
+    if (out) {
+        memcpy(out, str, len);
+        out[len] = 0;
+    }
+    return out;
+}
+
+static bool dup_string(const char* str, char** out){
+    *out = NULL;
+    if (str == NULL) {
+        return true;
+    }
+    *out = str_dup(str, strlen(str));
+    return *out != NULL;
+}
+
+bool xesp_usb_desc_cache_init(xesp_usb_desc_cache_t* cache, uint8_t capacity){
+    memset(cache, 0, sizeof(xesp_usb_desc_cache_t));
+    if (capacity == 0) {
+        return true;
+    }
+    cache->entries = calloc(capacity, sizeof(xesp_usb_desc_cache_entry_t));
+    if (cache->entries == NULL) {
+        return false;
+    }
+    cache->capacity = capacity;
+    return true;
+}
+
+void xesp_usb_desc_cache_clear(xesp_usb_desc_cache_t* cache){
+    for (int i = 0; i < cache->capacity; i++) {
+        if (entry_used(&cache->entries[i])) {
+            entry_free(&cache->entries[i]);
+            cache->dirty = true;
+        }
+    }
+}
+
+xesp_usb_desc_cache_entry_t* xesp_usb_desc_cache_find(xesp_usb_desc_cache_t* cache, const uint8_t* devc){
+    for (int i = 0; i < cache->capacity; i++) {
+        xesp_usb_desc_cache_entry_t* entry = &cache->entries[i];
+        if (entry_used(entry) && same_key(entry->devc, devc)) {
+            if (memcmp(entry->devc, devc, XESP_USB_DESC_CACHE_DEVC_BYTES) != 0) {
+                return NULL; // same key, different device descriptor
+            }
+            entry->last_used = ++cache->clock;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+bool xesp_usb_desc_cache_put(xesp_usb_desc_cache_t* cache,
+                             const uint8_t* devc,
+                             const uint8_t* config,
+                             uint16_t config_bytes,
+                             const char* manufacturer,
+                             const char* product)
+{
+    if (cache->capacity == 0 || !valid_config(config, config_bytes)) {
+        return false;
+    }
+
+    // the entry with the same key, else a free one, else the least recently used
+    xesp_usb_desc_cache_entry_t* slot = NULL;
+    for (int i = 0; i < cache->capacity; i++) {
+        xesp_usb_desc_cache_entry_t* entry = &cache->entries[i];
+        if (entry_used(entry) && same_key(entry->devc, devc)) {
+            slot = entry;
+            break;
+        }
+        if (slot == NULL ||
+            (entry_used(slot) && (!entry_used(entry) || entry->last_used < slot->last_used))) {
+            slot = entry;
+        }
+    }
+
+    entry_free(slot);
+    cache->dirty = true;
+
+    memcpy(slot->devc, devc, XESP_USB_DESC_CACHE_DEVC_BYTES);
+    slot->config = malloc(config_bytes);
+    if (slot->config == NULL ||
+        !dup_string(manufacturer, &slot->manufacturer) ||
+        !dup_string(product, &slot->product)) {
+        entry_free(slot);
+        return false;
+    }
+    memcpy(slot->config, config, config_bytes);
+    slot->config_bytes = config_bytes;
+    slot->last_used = ++cache->clock;
+
+    return true;
+}
+
+void xesp_usb_desc_cache_remove(xesp_usb_desc_cache_t* cache, xesp_usb_desc_cache_entry_t* entry){
+    entry_free(entry);
+    cache->dirty = true;
+}
+
+//////////////////////////////////
+// Serialize
+//
+
+static void put_u16(uint8_t* p, uint16_t v){
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static uint16_t string_len(const char* str){
+    return str ? strlen(str) : NO_STRING;
+}
+
+static size_t string_bytes(const char* str){
+    return str ? strlen(str) : 0;
+}
+
+size_t xesp_usb_desc_cache_serialize(xesp_usb_desc_cache_t* cache, uint8_t* buf, size_t size){
+
+    size_t needed = BLOB_HEADER_BYTES;
+    uint8_t count = 0;
+    for (int i = 0; i < cache->capacity; i++) {
+        xesp_usb_desc_cache_entry_t* entry = &cache->entries[i];
+        if (entry_used(entry)) {
+            needed += BLOB_ENTRY_HEADER_BYTES + entry->config_bytes +
+                      string_bytes(entry->manufacturer) +
+                      string_bytes(entry->product);
+            count++;
+        }
+    }
+
+    if (buf == NULL || size < needed) {
+        return needed;
+    }
+
+    uint8_t* p = buf;
+    *p++ = BLOB_MAGIC_0;
+    *p++ = BLOB_MAGIC_1;
+    *p++ = BLOB_VERSION;
+    *p++ = count;
+
+    for (int i = 0; i < cache->capacity; i++) {
+        xesp_usb_desc_cache_entry_t* entry = &cache->entries[i];
+        if (!entry_used(entry)) {
+            continue;
+        }
+
+        const char* strings[BLOB_STRINGS] = {entry->manufacturer, entry->product};
+
+        memcpy(p, entry->devc, XESP_USB_DESC_CACHE_DEVC_BYTES);
+        p += XESP_USB_DESC_CACHE_DEVC_BYTES;
+        put_u16(p, entry->config_bytes);
+        p += 2;
+        for (int s = 0; s < BLOB_STRINGS; s++) {
+            put_u16(p, string_len(strings[s]));
+            p += 2;
+        }
+
+        memcpy(p, entry->config, entry->config_bytes);
+        p += entry->config_bytes;
+        for (int s = 0; s < BLOB_STRINGS; s++) {
+            if (strings[s]) {
+                size_t len = strlen(strings[s]);
+                memcpy(p, strings[s], len);
+                p += len;
+            }
+        }
+    }
+
+    cache->dirty = false;
+    return needed;
+}
+
+bool xesp_usb_desc_cache_deserialize(xesp_usb_desc_cache_t* cache, const uint8_t* buf, size_t size){
+
+    xesp_usb_desc_cache_clear(cache);
+
+    if (size < BLOB_HEADER_BYTES ||
+        buf[0] != BLOB_MAGIC_0 ||
+        buf[1] != BLOB_MAGIC_1 ||
+        buf[2] != BLOB_VERSION) {
+        return false;
+    }
+
+    uint8_t count = buf[3];
+    const uint8_t* p = buf + BLOB_HEADER_BYTES;
+    const uint8_t* end = buf + size;
+
+    for (int i = 0; i < count; i++) {
+
+        if (end - p < BLOB_ENTRY_HEADER_BYTES) {
+            goto invalid;
+        }
+
+        const uint8_t* devc = p;
+        p += XESP_USB_DESC_CACHE_DEVC_BYTES;
+        uint16_t config_bytes = get_u16(p);
+        p += 2;
+        uint16_t lens[BLOB_STRINGS];
+        size_t data_bytes = config_bytes;
+        for (int s = 0; s < BLOB_STRINGS; s++) {
+            lens[s] = get_u16(p);
+            p += 2;
+            data_bytes += (lens[s] == NO_STRING) ? 0 : lens[s];
+        }
+
+        if ((size_t) (end - p) < data_bytes) {
+            goto invalid;
+        }
+
+        const uint8_t* config = p;
+        if (!valid_config(config, config_bytes)) {
+            goto invalid;
+        }
+
+        p += config_bytes;
+
+        // strings are not null terminated in the blob
+        char* strings[BLOB_STRINGS] = {NULL, NULL};
+        bool ok = true;
+        for (int s = 0; s < BLOB_STRINGS; s++) {
+            if (lens[s] != NO_STRING) {
+                strings[s] = str_dup((const char*) p, lens[s]);
+                ok = ok && strings[s];
+                p += lens[s];
+            }
+        }
+
+        // if the capacity shrank since the blob was saved, some entries are replaced
+        if (ok) {
+            xesp_usb_desc_cache_put(cache, devc, config, config_bytes,
+                                    strings[0], strings[1]);
+        }
+
+        for (int s = 0; s < BLOB_STRINGS; s++) {
+            free(strings[s]);
+        }
+    }
+
+    cache->dirty = false;
+    return true;
+
+invalid:
+    xesp_usb_desc_cache_clear(cache);
+    cache->dirty = false;
+    return false;
+}
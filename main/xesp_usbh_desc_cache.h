@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+
+A cache of the raw descriptors of devices we have already enumerated.
+
+Entries are keyed by idVendor, idProduct, bcdDevice and iSerialNumber.
+A lookup also compares the whole device descriptor, and the caller checks
+the config descriptor's wTotalLength against the cached copy, which
+is cheap enough to catch a device whose firmware changed under the same key.
+
+The serial number string is not cached. Two units of the same product
+share a key, so it is always read from the device.
+
+The cache holds a fixed number of entries. When it is full,
+the least recently used entry is replaced.
+
+It can be serialized to a single blob (e.g. an NVS key) so that
+it survives reboots.
+
+Not thread safe. The caller holds its own lock.
+
+This file is plain C11, with no FreeRTOS, so it can be built on a host.
+
+*/
+
+#define XESP_USB_DESC_CACHE_DEVC_BYTES 18
+
+struct xesp_usb_desc_cache_entry_t{
+    uint8_t devc[XESP_USB_DESC_CACHE_DEVC_BYTES]; // raw device descriptor. Holds the key
+    uint8_t* config; // raw first config descriptor, wTotalLength bytes. NULL if unused
+    uint16_t config_bytes;
+    char* manufacturer; // utf8 strings. NULL if the device has none
+    char* product;
+    uint32_t last_used;
+};
+
+typedef struct xesp_usb_desc_cache_entry_t xesp_usb_desc_cache_entry_t;
+
+struct xesp_usb_desc_cache_t{
+    xesp_usb_desc_cache_entry_t* entries;
+    uint8_t capacity;
+    uint32_t clock; // bumped on every use, for lru
+    bool dirty; // changed since the last serialize
+};
+
+typedef struct xesp_usb_desc_cache_t xesp_usb_desc_cache_t;
+
+// starts empty. returns false if out of memory. A capacity of 0 caches nothing.
+bool xesp_usb_desc_cache_init(xesp_usb_desc_cache_t* cache, uint8_t capacity);
+
+// drop every entry
+void xesp_usb_desc_cache_clear(xesp_usb_desc_cache_t* cache);
+
+// the entry for a device with this raw device descriptor, or NULL.
+// Only valid until the cache is next changed.
+xesp_usb_desc_cache_entry_t* xesp_usb_desc_cache_find(xesp_usb_desc_cache_t* cache, const uint8_t* devc);
+
+// add (or replace) the entry for a device. Everything is copied.
+// returns false if out of memory, or 'config' is not a whole config descriptor
+// (shorter than its header, or not wTotalLength bytes)
+bool xesp_usb_desc_cache_put(xesp_usb_desc_cache_t* cache,
+                             const uint8_t* devc,
+                             const uint8_t* config,
+                             uint16_t config_bytes,
+                             const char* manufacturer,
+                             const char* product);
+
+// e.g. an entry that no longer matches its device
+void xesp_usb_desc_cache_remove(xesp_usb_desc_cache_t* cache, xesp_usb_desc_cache_entry_t* entry);
+
+// write the cache into 'buf'. returns the bytes needed, or written.
+// Pass a NULL 'buf' to get the size. Clears 'dirty' once written.
+size_t xesp_usb_desc_cache_serialize(xesp_usb_desc_cache_t* cache, uint8_t* buf, size_t size);
+
+// replace the cache with the entries in a blob from xesp_usb_desc_cache_serialize.
+// returns false if the blob is not valid, or holds an entry put would refuse
+// (the cache is left empty).
+bool xesp_usb_desc_cache_deserialize(xesp_usb_desc_cache_t* cache, const uint8_t* buf, size_t size);
@@ -0,0 +1,54 @@
+#include "xesp_usbh_freelist.h"
+
+// head layout
+#define HEAD_IDX_MASK 0x0000FFFF
+#define HEAD_TAG_ONE  0x00010000
+
+// indices are stored + 1, so that 0 can mean "empty"
+#define HEAD_TOP(head) ((uint16_t) ((head) & HEAD_IDX_MASK))
+#define HEAD_NEW(head, top) ((((head) & ~HEAD_IDX_MASK) + HEAD_TAG_ONE) | (top))
+
+void xesp_freelist_init(xesp_freelist_t* list, _Atomic uint16_t* next){
+    list->next = next;
+    atomic_store(&list->head, 0);
+}
+
+void xesp_freelist_push(xesp_freelist_t* list, uint16_t idx){
+
+    uint32_t head = atomic_load_explicit(&list->head, memory_order_relaxed);
+
+    do {
+        // nobody else can touch next[idx] while we own idx
+        atomic_store_explicit(&list->next[idx], HEAD_TOP(head), memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&list->head, &head, 
+                HEAD_NEW(head, idx + 1), 
+                memory_order_release, 
+                memory_order_relaxed));
+}
+
+bool xesp_freelist_pop(xesp_freelist_t* list, uint16_t* idx){
+
+    uint32_t head = atomic_load_explicit(&list->head, memory_order_acquire);
+
+    uint16_t top;
+    uint16_t below;
+
+    do {
+        top = HEAD_TOP(head);
+        if (top == 0) {
+            return false; // empty
+        }
+
+        // if another task pops 'top' before us, this read is stale,
+        // but then the tag has changed, and the swap below fails
+        below = atomic_load_explicit(&list->next[top - 1], memory_order_relaxed);
+
+    } while (!atomic_compare_exchange_weak_explicit(&list->head, &head, 
+                HEAD_NEW(head, below), 
+                memory_order_acquire, 
+                memory_order_acquire));
+
+    *idx = top - 1;
+
+    return true;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/*
+
+A lock-free stack of free indices (a Treiber stack).
+
+Used by the irp pool so that taking and giving an irp 
+doesnt need a mutex. Any number of tasks can push and pop at once.
+
+The head is a single 32 bit word: the top index in the low 16 bits,
+and a tag in the high 16 bits. The tag is bumped on every change, so
+a pop that raced with a pop + push of the same index fails its
+compare-and-swap instead of corrupting the stack (the ABA problem).
+
+This file is plain C11, with no FreeRTOS, so it can be built and 
+benchmarked on a host. See host_test/freelist_bench.
+
+*/
+
+// the stack does not own its storage. 
+// 'next' must have an entry for every index that will ever be pushed.
+struct xesp_freelist_t{
+    _Atomic uint32_t head;
+    _Atomic uint16_t* next; // next[idx] is the index below idx (+ 1). 0 is the bottom.
+};
+
+typedef struct xesp_freelist_t xesp_freelist_t;
+
+// starts empty
+void xesp_freelist_init(xesp_freelist_t* list, _Atomic uint16_t* next);
+
+// idx must be less than 0xFFFF
+void xesp_freelist_push(xesp_freelist_t* list, uint16_t idx);
+
+// returns false if the stack is empty. Never blocks.
+bool xesp_freelist_pop(xesp_freelist_t* list, uint16_t* idx);
@@ -0,0 +1,478 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "hcd.h"
+
+#include "usb_utils.h"
+#include "xesp_usbh_xfer.h"
+#include "xesp_usbh.h"
+
+#include "xesp_usbh_hub.h"
+
+// hub class requests (usb 2.0 11.24.2)
+#define HUB_DESCRIPTOR_TYPE          0x29
+#define HUB_REQ_TYPE_HUB_IN          (USB_B_REQUEST_TYPE_DIR_IN | USB_B_REQUEST_TYPE_TYPE_CLASS | USB_B_REQUEST_TYPE_RECIP_DEVICE)
+#define HUB_REQ_TYPE_HUB_OUT         (USB_B_REQUEST_TYPE_DIR_OUT | USB_B_REQUEST_TYPE_TYPE_CLASS | USB_B_REQUEST_TYPE_RECIP_DEVICE)
+#define HUB_REQ_TYPE_PORT_IN         (USB_B_REQUEST_TYPE_DIR_IN | USB_B_REQUEST_TYPE_TYPE_CLASS | USB_B_REQUEST_TYPE_RECIP_OTHER)
+#define HUB_REQ_TYPE_PORT_OUT        (USB_B_REQUEST_TYPE_DIR_OUT | USB_B_REQUEST_TYPE_TYPE_CLASS | USB_B_REQUEST_TYPE_RECIP_OTHER)
+
+// hub feature selectors (usb 2.0 table 11-17)
+#define HUB_FEAT_C_HUB_LOCAL_POWER   0
+#define HUB_FEAT_C_HUB_OVER_CURRENT  1
+#define HUB_FEAT_PORT_RESET          4
+#define HUB_FEAT_PORT_POWER          8
+#define HUB_FEAT_C_PORT_CONNECTION   16
+#define HUB_FEAT_C_PORT_ENABLE       17
+#define HUB_FEAT_C_PORT_SUSPEND      18
+#define HUB_FEAT_C_PORT_OVER_CURRENT 19
+#define HUB_FEAT_C_PORT_RESET        20
+
+// wPortStatus bits (usb 2.0 table 11-21)
+#define HUB_PORT_STAT_CONNECTION     (1 << 0)
+#define HUB_PORT_STAT_ENABLE         (1 << 1)
+#define HUB_PORT_STAT_LOW_SPEED      (1 << 9)
+
+// wPortChange bits (usb 2.0 table 11-22)
+#define HUB_PORT_CHANGE_CONNECTION   (1 << 0)
+#define HUB_PORT_CHANGE_ENABLE       (1 << 1)
+#define HUB_PORT_CHANGE_SUSPEND      (1 << 2)
+#define HUB_PORT_CHANGE_OVER_CURRENT (1 << 3)
+#define HUB_PORT_CHANGE_RESET        (1 << 4)
+
+// wHubChange bits (usb 2.0 table 11-20)
+#define HUB_CHANGE_LOCAL_POWER       (1 << 0)
+#define HUB_CHANGE_OVER_CURRENT      (1 << 1)
+
+// a hub has at most 255 ports, but bigger than 15 is unheard of
+#define HUB_MAX_PORTS                15
+
+// usb 2.0 7.1.7.3: wait for the connection to be stable before resetting it
+#define HUB_CONNECT_DEBOUNCE_MS      100
+
+// usb 2.0 7.1.7.5: reset recovery time, before the device is addressed
+#define HUB_RESET_RECOVERY_MS        10
+
+#define HUB_TASK_PRIORITY            6
+
+static const char* TAG = "xesp usb hub";
+
+struct xesp_usbh_hub_t{
+    xesp_usb_device_t device;
+    uint8_t hub_addr;
+    hcd_pipe_handle_t status_pipe; // interrupt IN, one bit per port that changed
+    uint16_t status_mps;
+    uint8_t num_ports;
+    uint32_t children; // bit n is set when port n has a device we reported
+};
+
+typedef struct xesp_usbh_hub_t xesp_usbh_hub_t;
+
+// a completed status irp
+struct hub_event_msg_t{
+    xesp_usbh_hub_t* hub;
+    usb_irp_t* irp;
+    hcd_pipe_event_t event;
+};
+
+typedef struct hub_event_msg_t hub_event_msg_t;
+
+static xesp_usbh_hub_child_callback_t* child_callback;
+
+// each hub has one status irp outstanding, so the queue never fills
+static QueueHandle_t hub_evt_queue;
+
+//////////////////////////////////
+// Requests
+//
+
+// blocking hub class request. On success, 'data' (can be NULL) gets up to 'wLength' bytes.
+static hcd_pipe_event_t hub_ctrl_xfer(xesp_usbh_hub_t* hub,
+                                      uint8_t bRequestType,
+                                      uint8_t bRequest,
+                                      uint16_t wValue,
+                                      uint16_t wIndex,
+                                      uint8_t* data,
+                                      uint16_t wLength)
+{
+    // blocks until an irp is available
+    usb_irp_t* irp = xesp_usbh_xfer_take_irp(wLength);
+    if (irp == NULL) {
+        return HCD_PIPE_EVENT_INVALID;
+    }
+
+    usb_ctrl_req_t* req = (usb_ctrl_req_t *) irp->data_buffer;
+    req->bRequestType = bRequestType;
+    req->bRequest = bRequest;
+    req->wValue = wValue;
+    req->wIndex = wIndex;
+    req->wLength = wLength;
+
+    irp->timeout = XESP_USB_CTRL_XFER_TIMEOUT_MS;
+    irp->num_bytes = wLength;
+
+    // blocks until the irp is completed.
+    hcd_pipe_event_t rc = xesp_usbh_xfer_irp(hub->device.ctrl_pipe, irp);
+
+    if (rc == XUSB_OK && data){
+        // the data buffer always begins with the ctrl request struct
+        uint16_t len = irp->actual_num_bytes < wLength ? irp->actual_num_bytes : wLength;
+        memcpy(data, irp->data_buffer + sizeof(usb_ctrl_req_t), len);
+    }
+
+    // mark irp as available
+    xesp_usbh_xfer_give_irp(irp);
+
+    return rc;
+}
+
+static hcd_pipe_event_t hub_set_port_feature(xesp_usbh_hub_t* hub, uint8_t port_num, uint16_t feature){
+    return hub_ctrl_xfer(hub, HUB_REQ_TYPE_PORT_OUT, USB_B_REQUEST_SET_FEATURE, feature, port_num, NULL, 0);
+}
+
+static hcd_pipe_event_t hub_clear_port_feature(xesp_usbh_hub_t* hub, uint8_t port_num, uint16_t feature){
+    return hub_ctrl_xfer(hub, HUB_REQ_TYPE_PORT_OUT, USB_B_REQUEST_CLEAR_FEATURE, feature, port_num, NULL, 0);
+}
+
+// 'port_num' 0 is the hub itself
+static hcd_pipe_event_t hub_get_status(xesp_usbh_hub_t* hub, uint8_t port_num,
+                                       uint16_t* status, uint16_t* change)
+{
+    uint8_t data[4] = {0};
+    uint8_t bRequestType = port_num ? HUB_REQ_TYPE_PORT_IN : HUB_REQ_TYPE_HUB_IN;
+
+    hcd_pipe_event_t rc = hub_ctrl_xfer(hub, bRequestType, USB_B_REQUEST_GET_STATUS, 0, port_num, data, sizeof(data));
+
+    *status = data[0] | (data[1] << 8);
+    *change = data[2] | (data[3] << 8);
+
+    return rc;
+}
+
+//////////////////////////////////
+// Events
+//
+
+static void hub_status_irp_callback(usb_irp_t* irp, hcd_pipe_event_t event, void* ctx);
+
+static bool hub_submit_status_irp(xesp_usbh_hub_t* hub, usb_irp_t* irp){
+    irp->num_bytes = hub->status_mps; // interrupt IN irps are whole packets
+    irp->timeout = 0; // a hub can stay quiet forever
+    return xesp_usbh_xfer_submit_irp(hub->status_pipe, irp, hub_status_irp_callback, hub);
+}
+
+// runs on the pipe event task. The hub task does the work.
+static void hub_status_irp_callback(usb_irp_t* irp, hcd_pipe_event_t event, void* ctx){
+    hub_event_msg_t msg = {
+        .hub = (xesp_usbh_hub_t*) ctx,
+        .irp = irp,
+        .event = event,
+    };
+    xQueueSend(hub_evt_queue, &msg, portMAX_DELAY);
+}
+
+static void hub_child_gone(xesp_usbh_hub_t* hub, uint8_t port_num){
+    if (hub->children & (1 << port_num)) {
+        hub->children &= ~(1 << port_num);
+        ESP_LOGI(TAG, "hub %u port %u disconnected", hub->hub_addr, port_num);
+        child_callback(hub->device.port, hub->hub_addr, port_num, false, USB_SPEED_FULL);
+    }
+}
+
+// handle whatever changed on one downstream port
+static void hub_port_event(xesp_usbh_hub_t* hub, uint8_t port_num){
+
+    uint16_t status, change;
+    if (hub_get_status(hub, port_num, &status, &change) != XUSB_OK) {
+        ESP_LOGE(TAG, "hub %u could not get port %u status", hub->hub_addr, port_num);
+        return;
+    }
+
+    ESP_LOGI(TAG, "hub %u port %u status 0x%04x change 0x%04x", hub->hub_addr, port_num, status, change);
+
+    if (change & HUB_PORT_CHANGE_CONNECTION) {
+
+        hub_clear_port_feature(hub, port_num, HUB_FEAT_C_PORT_CONNECTION);
+
+        // whatever was there before is gone
+        hub_child_gone(hub, port_num);
+
+        if (status & HUB_PORT_STAT_CONNECTION) {
+            vTaskDelay(pdMS_TO_TICKS(HUB_CONNECT_DEBOUNCE_MS));
+
+            // the hub tells us when the reset is done, with C_PORT_RESET
+            if (hub_set_port_feature(hub, port_num, HUB_FEAT_PORT_RESET) != XUSB_OK) {
+                ESP_LOGE(TAG, "hub %u could not reset port %u", hub->hub_addr, port_num);
+            }
+        }
+    }
+
+    if (change & HUB_PORT_CHANGE_RESET) {
+
+        hub_clear_port_feature(hub, port_num, HUB_FEAT_C_PORT_RESET);
+
+        if ((status & HUB_PORT_STAT_CONNECTION) &&
+            (status & HUB_PORT_STAT_ENABLE) &&
+            !(hub->children & (1 << port_num))) {
+
+            vTaskDelay(pdMS_TO_TICKS(HUB_RESET_RECOVERY_MS));
+
+            // a high speed device behind a hub talks full speed to us
+            usb_speed_t speed = (status & HUB_PORT_STAT_LOW_SPEED) ? USB_SPEED_LOW : USB_SPEED_FULL;
+
+            ESP_LOGI(TAG, "hub %u port %u connected. %s speed", hub->hub_addr, port_num,
+                speed == USB_SPEED_LOW ? "low" : "full");
+
+            hub->children |= (1 << port_num);
+            child_callback(hub->device.port, hub->hub_addr, port_num, true, speed);
+        }
+    }
+
+    if (change & HUB_PORT_CHANGE_ENABLE) {
+        // the hub disables a port on babble, for example
+        hub_clear_port_feature(hub, port_num, HUB_FEAT_C_PORT_ENABLE);
+        if (!(status & HUB_PORT_STAT_ENABLE)) {
+            hub_child_gone(hub, port_num);
+        }
+    }
+
+    if (change & HUB_PORT_CHANGE_SUSPEND) {
+        hub_clear_port_feature(hub, port_num, HUB_FEAT_C_PORT_SUSPEND);
+    }
+
+    if (change & HUB_PORT_CHANGE_OVER_CURRENT) {
+        ESP_LOGE(TAG, "hub %u port %u overcurrent", hub->hub_addr, port_num);
+        hub_clear_port_feature(hub, port_num, HUB_FEAT_C_PORT_OVER_CURRENT);
+    }
+}
+
+// handle a change on the hub itself
+static void hub_hub_event(xesp_usbh_hub_t* hub){
+
+    uint16_t status, change;
+    if (hub_get_status(hub, 0, &status, &change) != XUSB_OK) {
+        ESP_LOGE(TAG, "hub %u could not get hub status", hub->hub_addr);
+        return;
+    }
+
+    if (change & HUB_CHANGE_LOCAL_POWER) {
+        hub_ctrl_xfer(hub, HUB_REQ_TYPE_HUB_OUT, USB_B_REQUEST_CLEAR_FEATURE, HUB_FEAT_C_HUB_LOCAL_POWER, 0, NULL, 0);
+    }
+
+    if (change & HUB_CHANGE_OVER_CURRENT) {
+        ESP_LOGE(TAG, "hub %u overcurrent", hub->hub_addr);
+        hub_ctrl_xfer(hub, HUB_REQ_TYPE_HUB_OUT, USB_B_REQUEST_CLEAR_FEATURE, HUB_FEAT_C_HUB_OVER_CURRENT, 0, NULL, 0);
+    }
+}
+
+static void hub_release(xesp_usbh_hub_t* hub, usb_irp_t* irp){
+
+    ESP_LOGI(TAG, "hub %u released", hub->hub_addr);
+
+    xesp_usbh_xfer_give_irp(irp);
+
+    // usually the hub was closed, which closed its children too.
+    // This is a no-op for them.
+    for (uint8_t p = 1; p <= hub->num_ports; p++) {
+        hub_child_gone(hub, p);
+    }
+
+    free(hub);
+}
+
+static void hub_event_task(void* p)
+{
+    ESP_LOGI(TAG, "hub event task started");
+
+    hub_event_msg_t msg;
+    while(1){
+        xQueueReceive(hub_evt_queue, &msg, portMAX_DELAY);
+
+        xesp_usbh_hub_t* hub = msg.hub;
+
+        if (msg.event != XUSB_OK) {
+            // the hub was closed or is misbehaving
+            ESP_LOGI(TAG, "hub %u status event %s", hub->hub_addr, hcd_pipe_event_str(msg.event));
+            hub_release(hub, msg.irp);
+            continue;
+        }
+
+        // bit 0 is the hub, bit n is port n
+        uint8_t* bitmap = msg.irp->data_buffer;
+        uint16_t num_bits = msg.irp->actual_num_bytes * 8;
+
+        if (num_bits && (bitmap[0] & 1)) {
+            hub_hub_event(hub);
+        }
+
+        for (uint8_t p = 1; p <= hub->num_ports && p < num_bits; p++) {
+            if (bitmap[p / 8] & (1 << (p % 8))) {
+                hub_port_event(hub, p);
+            }
+        }
+
+        // listen for the next change
+        if (!hub_submit_status_irp(hub, msg.irp)) {
+            ESP_LOGE(TAG, "hub %u could not resubmit status irp", hub->hub_addr);
+            hub_release(hub, msg.irp);
+        }
+    }
+}
+
+//////////////////////////////////
+// Setup
+//
+
+bool xesp_usbh_hub_setup(xesp_usbh_hub_child_callback_t* callback)
+{
+    ESP_LOGI(TAG, "hub setup");
+
+    child_callback = callback;
+    if(!child_callback){
+        ESP_LOGE(TAG, "you must provide a callback");
+        return false;
+    }
+
+    hub_evt_queue = xQueueCreate(XESP_USBH_MAX_HUBS, sizeof(hub_event_msg_t));
+    if(!hub_evt_queue){
+        ESP_LOGE(TAG, "failed to create hub event queue");
+        return false;
+    }
+
+    bool success = xTaskCreate(hub_event_task, "hub_task", 4*1024, NULL, HUB_TASK_PRIORITY, NULL);
+    if (!success){
+        ESP_LOGE(TAG, "failed to create hub task");
+        return false;
+    }
+
+    return true;
+}
+
+// the interrupt IN endpoint of the hub interface
+static xesp_usb_endpoint_descriptor_t* hub_find_status_ep(xesp_usb_config_descriptor_t* config){
+    for (int iIntf = 0; iIntf < config->interface_count; iIntf++){
+        xesp_usb_interface_descriptor_t* intf = config->interfaces[iIntf]->altSettings[0];
+        if (intf->val.bInterfaceClass != USB_CLASS_HUB) {
+            continue;
+        }
+        for (int iEp = 0; iEp < intf->endpoint_count; iEp++){
+            xesp_usb_endpoint_descriptor_t* ep = intf->endpoints[iEp];
+            if (USB_DESC_EP_GET_XFERTYPE(&ep->val) == USB_BM_ATTRIBUTES_XFER_INT &&
+                USB_DESC_EP_GET_EP_DIR(&ep->val)) {
+                return ep;
+            }
+        }
+    }
+    return NULL;
+}
+
+bool xesp_usbh_hub_attach(xesp_usb_device_t device, uint8_t hub_addr)
+{
+    ESP_LOGI(TAG, "attach hub %u", hub_addr);
+
+    if (hub_addr == 0) {
+        ESP_LOGE(TAG, "cant attach hub. device address has not been set");
+        return false;
+    }
+
+    xesp_usbh_hub_t* hub = calloc(1, sizeof(xesp_usbh_hub_t));
+    if (!hub) {
+        ESP_LOGE(TAG, "cant attach hub. out of memory");
+        return false;
+    }
+
+    hub->device = device;
+    hub->hub_addr = hub_addr;
+
+    // the status endpoint is in the config descriptor
+    xesp_usb_config_descriptor_t* config = NULL;
+    hcd_pipe_event_t rc = xesp_usbh_get_config_descriptor(device, 0, &config);
+    if (rc != XUSB_OK || config == NULL) {
+        ESP_LOGE(TAG, "hub %u could not get config descriptor", hub_addr);
+        free(hub);
+        return false;
+    }
+
+    xesp_usb_endpoint_descriptor_t* status_ep = hub_find_status_ep(config);
+    if (!status_ep) {
+        ESP_LOGE(TAG, "hub %u has no status endpoint. Not a hub?", hub_addr);
+        xesp_usbh_free_config_descriptor(config);
+        free(hub);
+        return false;
+    }
+
+    uint8_t bConfigurationValue = config->val.bConfigurationValue;
+    usb_desc_ep_t ep = status_ep->val;
+    xesp_usbh_free_config_descriptor(config);
+
+    rc = xesp_usbh_set_config(device, bConfigurationValue);
+    if (rc != XUSB_OK) {
+        ESP_LOGE(TAG, "hub %u could not set config", hub_addr);
+        free(hub);
+        return false;
+    }
+
+    // hub descriptor: bLength, bDescriptorType, bNbrPorts, wHubCharacteristics, bPwrOn2PwrGood, ...
+    uint8_t hub_desc[8] = {0};
+    rc = hub_ctrl_xfer(hub, HUB_REQ_TYPE_HUB_IN, USB_B_REQUEST_GET_DESCRIPTOR,
+        HUB_DESCRIPTOR_TYPE << 8, 0, hub_desc, sizeof(hub_desc));
+    if (rc != XUSB_OK || hub_desc[1] != HUB_DESCRIPTOR_TYPE) {
+        ESP_LOGE(TAG, "hub %u could not get hub descriptor", hub_addr);
+        free(hub);
+        return false;
+    }
+
+    hub->num_ports = hub_desc[2];
+    if (hub->num_ports > HUB_MAX_PORTS) {
+        ESP_LOGW(TAG, "hub %u has %u ports. only using %u", hub_addr, hub->num_ports, HUB_MAX_PORTS);
+        hub->num_ports = HUB_MAX_PORTS;
+    }
+
+    uint32_t power_good_ms = hub_desc[5] * 2;
+
+    ESP_LOGI(TAG, "hub %u ports: %u power good: %ums", hub_addr, hub->num_ports, power_good_ms);
+
+    // power every port. Devices already plugged in show up as connection changes.
+    for (uint8_t p = 1; p <= hub->num_ports; p++) {
+        if (hub_set_port_feature(hub, p, HUB_FEAT_PORT_POWER) != XUSB_OK) {
+            ESP_LOGE(TAG, "hub %u could not power port %u", hub_addr, p);
+        }
+    }
+
+    vTaskDelay(pdMS_TO_TICKS(power_good_ms));
+
+    // closed along with the hub device
+    hub->status_pipe = xesp_usbh_open_endpoint(device, &ep);
+    if (!hub->status_pipe) {
+        ESP_LOGE(TAG, "hub %u could not open status endpoint", hub_addr);
+        free(hub);
+        return false;
+    }
+
+    hub->status_mps = USB_DESC_EP_GET_MPS(&ep);
+
+    usb_irp_t* irp = xesp_usbh_xfer_take_irp(hub->status_mps);
+    if (!irp) {
+        xesp_usbh_close_endpoint(hub->status_pipe);
+        free(hub);
+        return false;
+    }
+
+    // from now on, the hub task owns the hub
+    if (!hub_submit_status_irp(hub, irp)) {
+        ESP_LOGE(TAG, "hub %u could not submit status irp", hub_addr);
+        xesp_usbh_xfer_give_irp(irp);
+        xesp_usbh_close_endpoint(hub->status_pipe);
+        free(hub);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "hcd.h"
+#include "usb.h"
+
+#include "xesp_usbh_defs.h"
+
+/*
+
+All the code in this file has to do with external hubs (USB 2.0 chapter 11)
+
+    - reading the hub descriptor and powering the downstream ports
+    - listening on the hub's status change (interrupt IN) endpoint
+    - resetting downstream ports and reporting their devices
+
+WARNING: Do not use this code directly. You should use xesp_usbh.h which wraps these.
+
+*/
+
+// the most hubs that can be attached at once
+#define XESP_USBH_MAX_HUBS 4
+
+// A device on a downstream port of a hub connected or disconnected.
+// 'hub_addr' is the usb address of the hub. 'hub_port' starts at 1.
+// 'speed' is only valid when 'connected' is true.
+// Called from the hub task, one event at a time, so only one
+// downstream device is ever at address 0.
+typedef void(xesp_usbh_hub_child_callback_t)(hcd_port_handle_t port,
+                                              uint8_t hub_addr,
+                                              uint8_t hub_port,
+                                              bool connected,
+                                              usb_speed_t speed);
+
+// start the hub task
+bool xesp_usbh_hub_setup(xesp_usbh_hub_child_callback_t* callback);
+
+// Take over a hub. 'hub_addr' is its usb address.
+// Blocks while the hub is configured and its ports are powered.
+// Afterwards, downstream devices are reported to the callback as they come and go.
+// The hub is released once its device is closed.
+bool xesp_usbh_hub_attach(xesp_usb_device_t device, uint8_t hub_addr);
@@ -21,6 +21,10 @@
 
 #define PORT_EVENT_QUEUE_LEN         10
 
+// the hcd runs port & pipe callbacks from a task of this priority,
+// instead of from its ISR. Above the port & pipe tasks that consume the events.
+#define HCD_DEFER_TASK_PRIORITY      12
+
 struct event_msg_t{
     hcd_port_handle_t port;
     hcd_port_event_t event;
@@ -61,9 +65,19 @@ static bool port_isr_callback(hcd_port_handle_t port, hcd_port_event_t event, vo
         .event = event,
     };
 
-    BaseType_t xTaskWoken = pdFALSE;
-    xQueueSendFromISR(port_evt_queue, &msg, &xTaskWoken);
-    return (xTaskWoken == pdTRUE);
+    if (in_isr) {
+        BaseType_t xTaskWoken = pdFALSE;
+        xQueueSendFromISR(port_evt_queue, &msg, &xTaskWoken);
+        return (xTaskWoken == pdTRUE);
+    } else {
+        // on the hcd's bottom half task, which must not block: the port task 
+        // frees pipes, which waits for the bottom half task.
+        // Port events are rare, so a full queue means the port task is stuck anyway
+        if (!xQueueSend(port_evt_queue, &msg, 0)) {
+            ESP_LOGE(TAG, "port event queue full. dropped %s", hcd_port_event_str(event));
+        }
+        return false;
+    }
 }
 
 static void port_event_task(void* p)
@@ -121,6 +135,7 @@ hcd_port_handle_t xesp_usbh_port_setup(xesp_usbh_port_callback_t* callback)
         .callback = port_isr_callback,
         .callback_arg = (void *)port_evt_queue,
         .context = NULL,
+        .defer_task_priority = HCD_DEFER_TASK_PRIORITY,
     };
 
     // initialize the port
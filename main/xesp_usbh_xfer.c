@@ -5,7 +5,6 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
-#include "freertos/event_groups.h"
 
 #include "hal/usbh_ll.h"
 #include "hcd.h"
@@ -20,39 +19,186 @@
 #include "xesp_usbh.h"
 
 #include "xesp_usbh_xfer.h"
+#include "xesp_usbh_freelist.h"
 
-#define PIPE_EVENT_QUEUE_LEN         10
+#define XESP_USB_NUM_IRP_CLASSES 3
 
-#define XESP_USB_MAX_SIMULTANEOUS_XFERS 2
+#define XESP_USB_MAX_SIMULTANEOUS_XFERS (XESP_USB_IRP_SMALL_COUNT + \
+                                         XESP_USB_IRP_MEDIUM_COUNT + \
+                                         XESP_USB_IRP_LARGE_COUNT)
 
-static usb_irp_t irps[XESP_USB_MAX_SIMULTANEOUS_XFERS]; // the irps themselves
+// a stream can never take every irp of its class. Otherwise other transfers would starve.
+#define XESP_USB_MAX_STREAM_IRPS 8
 
-static uint8_t *irp_data_buffers[XESP_USB_MAX_SIMULTANEOUS_XFERS]; // the IO data
+// usb_irp_t ends in a flexible array of iso packet descriptors,
+// so each irp is followed by room for XESP_USB_IRP_ISO_PACKETS of them
+union xfer_irp_slot_t{
+    usb_irp_t irp;
+    uint8_t bytes[sizeof(usb_irp_t) + XESP_USB_IRP_ISO_PACKETS * sizeof(usb_iso_packet_desc_t)];
+};
 
-// keep track of which IRPS are free for use
-static uint8_t irps_freelist_count;
-static uint8_t irps_freelist[XESP_USB_MAX_SIMULTANEOUS_XFERS]; // the index of the irp that is free
+typedef union xfer_irp_slot_t xfer_irp_slot_t;
 
-// used by freertos waitBits
-#define XFER_DONE_BIT 1 
-#define XFER_ERROR_INVALID_BIT 4
-#define XFER_ERROR_IRP_NOT_AVAIL_BIT 8
-#define XFER_ERROR_OVERFLOW_BIT 16 
-#define XFER_ERROR_XFER_BIT 32 
+static xfer_irp_slot_t irps[XESP_USB_MAX_SIMULTANEOUS_XFERS]; // the irps themselves
 
-static EventGroupHandle_t irp_xfer_done_xEvents[XESP_USB_MAX_SIMULTANEOUS_XFERS];// notify when xfer done
-static SemaphoreHandle_t irp_freelist_xMutex;
-static SemaphoreHandle_t irp_counting_xSemaphore;
-static SemaphoreHandle_t irp_enqueue_xSemaphore;
+static uint8_t *irp_data_buffers[XESP_USB_MAX_SIMULTANEOUS_XFERS]; // the IO data
 
-typedef struct {
-    hcd_port_handle_t port;
+// links of the free irp stacks. Each irp belongs to exactly one class's stack.
+static _Atomic uint16_t irps_freelist_next[XESP_USB_MAX_SIMULTANEOUS_XFERS];
+
+// a size class of the irp pool
+struct irp_class_t{
+    uint16_t num_bytes; // data capacity of each irp in this class
+    uint16_t count;
+    uint16_t first_idx; // the class owns irps[first_idx] to irps[first_idx + count - 1]
+    // keep track of which IRPS are free for use (lock-free)
+    xesp_freelist_t freelist;
+    // counts the irps in the freelist. So we can block until one is free.
+    SemaphoreHandle_t counting_xSemaphore;
+};
+
+typedef struct irp_class_t irp_class_t;
+
+// ordered smallest to largest
+static irp_class_t irp_classes[XESP_USB_NUM_IRP_CLASSES] = {
+    { .num_bytes = XESP_USB_IRP_SMALL_BYTES,  .count = XESP_USB_IRP_SMALL_COUNT,  
+      .first_idx = 0 },
+    { .num_bytes = XESP_USB_IRP_MEDIUM_BYTES, .count = XESP_USB_IRP_MEDIUM_COUNT, 
+      .first_idx = XESP_USB_IRP_SMALL_COUNT },
+    { .num_bytes = XESP_USB_IRP_LARGE_BYTES,  .count = XESP_USB_IRP_LARGE_COUNT,  
+      .first_idx = XESP_USB_IRP_SMALL_COUNT + XESP_USB_IRP_MEDIUM_COUNT },
+};
+
+// a task blocked in xesp_usbh_xfer_irp. Lives on the waiting task's stack.
+// The completion stores the event here, then wakes the task with a task notification.
+struct irp_waiter_t{
+    TaskHandle_t task;
+    hcd_pipe_event_t event;
+    size_t actual_num_bytes; // only used by scatter-gather transfers
+    volatile bool done;
+};
+
+typedef struct irp_waiter_t irp_waiter_t;
+
+// completion callback and deadline of each submitted irp
+struct irp_callback_t{
+    xesp_usbh_irp_callback_t* cb;
+    void* ctx;
+    hcd_pipe_handle_t pipe;
+    struct xfer_pipe_t* xpipe; // submission state of 'pipe'
+    uint32_t generation; // of xpipe when submitted
+    bool has_deadline; // irp->timeout was set
+    TickType_t deadline; // tick count at which the pipe task cancels the irp
+    bool timed_out;
+};
+
+typedef struct irp_callback_t irp_callback_t;
+
+static irp_callback_t irp_callbacks[XESP_USB_MAX_SIMULTANEOUS_XFERS]; // indexed by irp idx
+
+// protects irp_callbacks. They are read by the pipe task when checking deadlines.
+static portMUX_TYPE irp_callbacks_lock = portMUX_INITIALIZER_UNLOCKED;
+// submission state of an open pipe. Stored as the hcd pipe context.
+// Closing a pipe only fences submissions to that pipe.
+struct xfer_pipe_t{
+    hcd_pipe_handle_t pipe; // NULL until the pipe is alloc'd
+    volatile bool closing;
+    SemaphoreHandle_t enqueue_xMutex; // only 1 thread enqueues to this pipe at a time. Held for the whole close
+    volatile uint32_t generation; // bumped once the pipe is freed. Set under enqueue_xMutex
+    bool is_control;
+    bool is_in;
+    uint16_t mps; // wMaxPacketSize. (0 for control pipes)
+    // for the pipe task (see xfer_pipe_post). Protected by pipe_events_lock
+    bool event_pending;
+    hcd_pipe_event_t event; // the weightiest since the pipe task last looked. NONE for a kick
+    uint32_t event_generation; // of the pipe the event is about
+    struct xfer_pipe_t* next_free; // protected by xfer_pipes_lock
+    struct xfer_pipe_t* next_all; // set once, when allocated
+};
+
+typedef struct xfer_pipe_t xfer_pipe_t;
+
+// Submission states are allocated as pipes are opened, and never freed:
+// a task can still be blocked on the enqueue mutex of a pipe being closed.
+// Closed ones are reused by the next pipe opened.
+static xfer_pipe_t* xfer_pipes_free = NULL;
+
+// every submission state ever allocated, newest first. Protected by xfer_pipes_lock
+static xfer_pipe_t* xfer_pipes_all = NULL;
+
+static portMUX_TYPE xfer_pipes_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// The pipe itself can be freed while an event about it is pending,
+// so events are kept in the submission state, which never is,
+// tagged with the generation of the pipe they are about.
+// Set once some pipe has an event pending.
+static _Atomic bool pipe_events_pending = false;
+static portMUX_TYPE pipe_events_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// scatter-gather transfers are split into irps of this size class, 
+// and keep up to all but one irp of the class queued back to back
+#define XESP_USB_IOV_IRP_BYTES XESP_USB_IRP_MEDIUM_BYTES
+#define XESP_USB_MAX_IOV_IRPS (XESP_USB_IRP_MEDIUM_COUNT > 1 ? XESP_USB_IRP_MEDIUM_COUNT - 1 : 1)
+
+typedef struct xfer_iov_t xfer_iov_t;
+
+// the part of a scatter-gather transfer carried by one irp
+struct iov_piece_t{
+    xfer_iov_t* xfer;
+    usb_irp_t* irp; // NULL once given back
+    uint8_t seg;     // where the piece starts in the iov
+    uint16_t offset;
+    uint16_t length; // bytes of the iov it covers
+};
+
+typedef struct iov_piece_t iov_piece_t;
+
+// a transfer split across several irps, with one completion
+struct xfer_iov_t{
+    hcd_pipe_handle_t pipe;
+    bool is_in;
+    uint16_t mps;
+    uint16_t piece_max; // the most bytes per irp. a multiple of mps
+    uint8_t max_irps; // the most irps queued at once
+    const xesp_usbh_iovec_t* iov;
+    uint8_t iov_count;
+    xesp_usbh_iov_callback_t* cb;
+    void* ctx;
+    // the rest is protected by iov_lock
+    uint8_t next_seg; // next byte to hand to an irp
+    uint16_t next_offset;
+    size_t bytes_left; // not yet handed to an irp
+    bool zlp_pending; // OUT: a zero length packet still has to be sent
+    bool finished; // error, cancel or short packet. no more pieces
+    uint8_t num_irps; // irps owned by the transfer
+    size_t actual_num_bytes;
+    hcd_pipe_event_t event; // first error, or IRP_DONE
+    iov_piece_t pieces[XESP_USB_MAX_IOV_IRPS];
+};
+
+static portMUX_TYPE iov_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// keeps 'num_irps' irps queued on an IN pipe at all times
+struct xesp_usbh_stream_t{
     hcd_pipe_handle_t pipe;
-    hcd_pipe_event_t pipe_event;
-} pipe_event_msg_t;
+    xesp_usbh_stream_callback_t* cb;
+    void* ctx;
+    uint16_t num_bytes; // bytes requested per irp
+    uint8_t num_irps;
+    usb_irp_t* irps[XESP_USB_MAX_STREAM_IRPS]; // NULL once retired. protected by stream_lock
+    volatile uint8_t num_irps_queued; // protected by stream_lock
+    volatile bool stopping;
+    SemaphoreHandle_t retired_xSemaphore; // given when the last irp is retired
+};
+
+static portMUX_TYPE stream_lock = portMUX_INITIALIZER_UNLOCKED;
 
 static TaskHandle_t pipe_task_handle = NULL;
-static QueueHandle_t pipe_evt_queue;
+
+// calls queued for the pipe task (see xesp_usbh_xfer_run_on_pipe_task), oldest first
+static xesp_usbh_xfer_work_t* work_head = NULL;
+static xesp_usbh_xfer_work_t* work_tail = NULL;
+static portMUX_TYPE work_lock = portMUX_INITIALIZER_UNLOCKED;
 
 // forward declaration
 bool xesp_usbh_allocate_irps();
@@ -63,69 +209,315 @@ static const char * TAG = "xesp_usb_xfer";
 // Callbacks
 //
 
-static bool pipe_isr_callback(hcd_pipe_handle_t pipe, 
-                          hcd_pipe_event_t pipe_event,
-                          void *user_arg, 
-                          bool in_isr)
+// the event to report for a dequeued irp, based on its own status
+// (the pipe event belongs to whichever irp triggered it)
+static hcd_pipe_event_t xfer_irp_event(usb_irp_t* irp)
+{
+    switch (irp->status) {
+        case USB_TRANSFER_STATUS_COMPLETED: return HCD_PIPE_EVENT_IRP_DONE;
+        case USB_TRANSFER_STATUS_STALL:     return HCD_PIPE_EVENT_ERROR_STALL;
+        case USB_TRANSFER_STATUS_OVERFLOW:  return HCD_PIPE_EVENT_ERROR_OVERFLOW;
+        case USB_TRANSFER_STATUS_NO_DEVICE: return HCD_PIPE_EVENT_INVALID;
+        case USB_TRANSFER_STATUS_CANCELLED: return HCD_PIPE_EVENT_ERROR_IRP_NOT_AVAIL;
+        case USB_TRANSFER_STATUS_ERROR:
+        case USB_TRANSFER_STATUS_TIMED_OUT:
+        default:                            return HCD_PIPE_EVENT_ERROR_XFER;
+    }
+}
+
+// how much the pipe task has to do for an event. 
+// A pending event is only replaced by a weightier one
+static int xfer_event_weight(hcd_pipe_event_t event)
+{
+    switch (event) {
+        case HCD_PIPE_EVENT_NONE:                   return 0; // a kick. just dequeue
+        case HCD_PIPE_EVENT_IRP_DONE:               return 1;
+        case HCD_PIPE_EVENT_ERROR_IRP_NOT_AVAIL:
+        case HCD_PIPE_EVENT_ERROR_OVERFLOW:         return 2; // logged
+        default:                                    return 3; // the pipe is reset
+    }
+}
+
+// record an event for the pipe task, and wake it. 
+// Never blocks: the hcd delivers events from its bottom half task, 
+// and a pipe cannot be freed until that task is done delivering. 
+// A pipe's events coalesce, since the pipe task dequeues all of its irps anyway.
+// returns true if a higher priority task was woken (in_isr only)
+static bool xfer_pipe_post(xfer_pipe_t* xpipe, hcd_pipe_event_t event, bool in_isr)
 {
-    pipe_event_msg_t msg = {
-        .port = (hcd_pipe_handle_t)user_arg,
-        .pipe = pipe,
-        .pipe_event = pipe_event,
-    };
+    if (in_isr) {
+        portENTER_CRITICAL_ISR(&pipe_events_lock);
+    } else {
+        portENTER_CRITICAL(&pipe_events_lock);
+    }
+    if (!xpipe->event_pending || 
+        xpipe->event_generation != xpipe->generation ||
+        xfer_event_weight(event) > xfer_event_weight(xpipe->event)) {
+        xpipe->event = event;
+        xpipe->event_generation = xpipe->generation;
+    }
+    xpipe->event_pending = true;
+    if (in_isr) {
+        portEXIT_CRITICAL_ISR(&pipe_events_lock);
+    } else {
+        portEXIT_CRITICAL(&pipe_events_lock);
+    }
+
+    atomic_store(&pipe_events_pending, true);
+
     if (in_isr) {
         BaseType_t xTaskWoken = pdFALSE;
-        xQueueSendFromISR(pipe_evt_queue, &msg, &xTaskWoken);
+        vTaskNotifyGiveFromISR(pipe_task_handle, &xTaskWoken);
         return (xTaskWoken == pdTRUE);
+    }
+    xTaskNotifyGive(pipe_task_handle);
+    return false;
+}
+
+// wake the pipe task so it dequeues irps that completed without
+// a pipe event (i.e. irps retired by hcd_irp_abort).
+// Never blocks, so completion callbacks (on the pipe task) can kick too.
+// Only touches the submission state, so it is safe on a pipe being closed.
+static void xfer_pipe_kick_xpipe(xfer_pipe_t* xpipe)
+{
+    // the close dequeues everything itself
+    if (xpipe->closing) {
+        return;
+    }
+
+    xfer_pipe_post(xpipe, HCD_PIPE_EVENT_NONE, false);
+}
+
+static void xfer_pipe_kick(hcd_pipe_handle_t pipe)
+{
+    xfer_pipe_kick_xpipe((xfer_pipe_t*) hcd_pipe_get_ctx(pipe));
+}
+
+// run the completion callback of a dequeued irp
+static void xfer_irp_complete(usb_irp_t* irp, hcd_pipe_event_t event)
+{
+    uint16_t irp_idx = xesp_usbh_xfer_irp_idx(irp);
+
+    portENTER_CRITICAL(&irp_callbacks_lock);
+    irp_callback_t done = irp_callbacks[irp_idx];
+    irp_callbacks[irp_idx] = (irp_callback_t) {0};
+    portEXIT_CRITICAL(&irp_callbacks_lock);
+
+    // the pipe task cancelled it because its deadline passed
+    if (done.timed_out && irp->status == USB_TRANSFER_STATUS_CANCELLED) {
+        irp->status = USB_TRANSFER_STATUS_TIMED_OUT;
+        event = HCD_PIPE_EVENT_ERROR_XFER;
+    }
+
+    if (done.cb) {
+        done.cb(irp, event, done.ctx);
     } else {
-        xQueueSend(pipe_evt_queue, &msg, portMAX_DELAY);
+        ESP_LOGE(TAG, "irp %u completed without a callback", irp_idx);
+    }
+}
+
+// the pipe, if it is still the one 'generation' refers to, with its enqueue_xMutex held.
+// A close holds the mutex until the pipe is freed, so the pipe task can use the pipe
+// until it gives the mutex back. returns NULL (not held) if the pipe was closed.
+static hcd_pipe_handle_t xfer_pipe_lock(xfer_pipe_t* xpipe, uint32_t generation)
+{
+    xSemaphoreTake(xpipe->enqueue_xMutex, portMAX_DELAY);
+    if (xpipe->generation != generation || xpipe->closing || xpipe->pipe == NULL) {
+        xSemaphoreGive(xpipe->enqueue_xMutex);
+        return NULL;
+    }
+    return xpipe->pipe;
+}
+
+// dequeue every retired irp of a pipe, and hand each to whoever submitted it.
+// The mutex is not held during callbacks: they can submit, or even close the pipe.
+static void xfer_pipe_drain(xfer_pipe_t* xpipe, uint32_t generation)
+{
+    while (1) {
+        hcd_pipe_handle_t pipe = xfer_pipe_lock(xpipe, generation);
+        if (pipe == NULL) {
+            return; // closed. The close retired its irps
+        }
+        usb_irp_t *irp = hcd_irp_dequeue(pipe);
+        xSemaphoreGive(xpipe->enqueue_xMutex);
+
+        if (irp == NULL) {
+            return;
+        }
+        xfer_irp_complete(irp, xfer_irp_event(irp));
+    }
+}
+
+// make the calls queued for the pipe task.
+// returns false if there were none
+static bool xfer_run_work()
+{
+    portENTER_CRITICAL(&work_lock);
+    xesp_usbh_xfer_work_t* work = work_head;
+    work_head = NULL;
+    work_tail = NULL;
+    portEXIT_CRITICAL(&work_lock);
+
+    if (work == NULL) {
         return false;
     }
+
+    while (work) {
+        // the call can queue its work again
+        xesp_usbh_xfer_work_t* next = work->next;
+        work->fn(work->arg);
+        work = next;
+    }
+    return true;
 }
 
+// handle the event a pipe reported, then dequeue its retired irps
+static void xfer_pipe_handle_event(xfer_pipe_t* xpipe, hcd_pipe_event_t event, uint32_t generation)
+{
+    hcd_pipe_handle_t pipe;
 
-static void pipe_event_task(void* unused)
+    switch (event)
+    {
+        case HCD_PIPE_EVENT_NONE: // a kick, just dequeue
+        case HCD_PIPE_EVENT_IRP_DONE:
+            break;
+        case HCD_PIPE_EVENT_ERROR_IRP_NOT_AVAIL:
+        case HCD_PIPE_EVENT_ERROR_OVERFLOW:
+            ESP_LOGE(TAG, "%s pipe: %p", hcd_pipe_event_str(event), xpipe->pipe);
+            break;
+        case HCD_PIPE_EVENT_ERROR_XFER:
+        case HCD_PIPE_EVENT_INVALID:
+        case HCD_PIPE_EVENT_ERROR_STALL:
+            // the pipe may have been closed (and freed) since
+            if ((pipe = xfer_pipe_lock(xpipe, generation)) != NULL) {
+                ESP_LOGE(TAG, "Ressetting pipe. %s pipe: %p", hcd_pipe_event_str(event), pipe);
+                hcd_pipe_command(pipe, HCD_PIPE_CMD_RESET);
+                xSemaphoreGive(xpipe->enqueue_xMutex);
+            }
+            break;
+    }
+
+    // A pipe can have many irps queued, and one event can retire 
+    // several of them (i.e. a reset retires every pending irp). 
+    // So we dequeue all of them. Events whose irp was 
+    // already dequeued this way simply find nothing.
+    xfer_pipe_drain(xpipe, generation);
+}
+
+// handle the events of every pipe that has one.
+// returns false if there were none
+static bool xfer_handle_pipe_events()
 {
-    ESP_LOGI(TAG, "started pipe event task");
+    if (!atomic_exchange(&pipe_events_pending, false)) {
+        return false;
+    }
 
-    pipe_evt_queue = xQueueCreate(PIPE_EVENT_QUEUE_LEN, sizeof(pipe_event_msg_t));
+    portENTER_CRITICAL(&xfer_pipes_lock);
+    xfer_pipe_t* xpipe = xfer_pipes_all;
+    portEXIT_CRITICAL(&xfer_pipes_lock);
 
-    while(1){
-        pipe_event_msg_t msg;
+    for (; xpipe; xpipe = xpipe->next_all) {
+        portENTER_CRITICAL(&pipe_events_lock);
+        bool pending = xpipe->event_pending;
+        hcd_pipe_event_t event = xpipe->event;
+        uint32_t generation = xpipe->event_generation;
+        xpipe->event_pending = false;
+        portEXIT_CRITICAL(&pipe_events_lock);
 
-        xQueueReceive(pipe_evt_queue, &msg, portMAX_DELAY);
+        if (pending) {
+            xfer_pipe_handle_event(xpipe, event, generation);
+        }
+    }
 
-        //ESP_LOGI(TAG, "pipe: %p event: %s", msg.pipe, hcd_pipe_event_str(msg.pipe_event));
+    return true;
+}
 
-        usb_irp_t *irp = hcd_irp_dequeue(msg.pipe);
+// cancel every irp that is past its deadline.
+// returns the ticks until the next deadline, or portMAX_DELAY if there is none
+static TickType_t xfer_expire_irps()
+{
+    TickType_t now = xTaskGetTickCount();
+    TickType_t wait = portMAX_DELAY;
+
+    for (int i = 0; i < XESP_USB_MAX_SIMULTANEOUS_XFERS; i++) {
 
-        if(irp == NULL){
-            ESP_LOGE(TAG, "pipe event task: irp null");
-            continue;
+        xfer_pipe_t* expired_xpipe = NULL;
+        uint32_t generation = 0;
+
+        portENTER_CRITICAL(&irp_callbacks_lock);
+        irp_callback_t* state = &irp_callbacks[i];
+        if (state->has_deadline) {
+            TickType_t left = state->deadline - now; // wraps safely
+            if ((int32_t) left <= 0) {
+                state->has_deadline = false;
+                state->timed_out = true;
+                expired_xpipe = state->xpipe;
+                generation = state->generation;
+            } else if (left < wait) {
+                wait = left;
+            }
+        }
+        portEXIT_CRITICAL(&irp_callbacks_lock);
+
+        // a close that got to the pipe first retires the irp itself
+        hcd_pipe_handle_t expired_pipe = expired_xpipe ? xfer_pipe_lock(expired_xpipe, generation) : NULL;
+        if (expired_pipe) {
+            ESP_LOGE(TAG, "irp %u timed out. pipe: %p", i, expired_pipe);
+            // in-flight irps are retired once the channel halts, which sends us a pipe event. 
+            // pending irps are retired right away, without one.
+            hcd_irp_abort(&irps[i].irp);
+            xSemaphoreGive(expired_xpipe->enqueue_xMutex);
+            xfer_pipe_drain(expired_xpipe, generation);
         }
+    }
 
-        switch (msg.pipe_event)
-        {
-            case HCD_PIPE_EVENT_IRP_DONE:
-                break;
-            case HCD_PIPE_EVENT_ERROR_IRP_NOT_AVAIL:
-            case HCD_PIPE_EVENT_ERROR_OVERFLOW:
-                ESP_LOGE(TAG, "%s pipe: %p", hcd_pipe_event_str(msg.pipe_event), msg.pipe);
-                break;
-            case HCD_PIPE_EVENT_NONE:
-            case HCD_PIPE_EVENT_ERROR_XFER:
-            case HCD_PIPE_EVENT_INVALID:
-            case HCD_PIPE_EVENT_ERROR_STALL:
-                ESP_LOGE(TAG, "Ressetting pipe. %s pipe: %p", hcd_pipe_event_str(msg.pipe_event), msg.pipe);
-                hcd_pipe_command(msg.pipe, HCD_PIPE_CMD_RESET);
-                break;
+    return wait;
+}
+
+static bool pipe_isr_callback(hcd_pipe_handle_t pipe, 
+                          hcd_pipe_event_t pipe_event,
+                          void *user_arg, 
+                          bool in_isr)
+{
+    return xfer_pipe_post((xfer_pipe_t*) user_arg, pipe_event, in_isr);
+}
+
+
+static void pipe_event_task(void* unused)
+{
+    ESP_LOGI(TAG, "started pipe event task");
+
+    TickType_t wait = portMAX_DELAY;
+
+    while(1){
+
+        // completion callbacks (and queued calls) can kick pipes, and submit irps with a deadline
+        while (xfer_run_work() || xfer_handle_pipe_events()) {
+            wait = xfer_expire_irps();
         }
 
-        uint16_t irp_idx = irp - &irps[0];
-        xEventGroupSetBits(irp_xfer_done_xEvents[irp_idx], (uint32_t) msg.pipe_event);
+        // woken by xfer_pipe_post and xesp_usbh_xfer_run_on_pipe_task, 
+        // and for the next irp deadline
+        ulTaskNotifyTake(pdTRUE, wait);
+
+        wait = xfer_expire_irps();
+    }
+}
+
+void xesp_usbh_xfer_run_on_pipe_task(xesp_usbh_xfer_work_t* work)
+{
+    work->next = NULL;
 
-        //ESP_LOGI(TAG, "irp: %u set bits", irp_idx);
+    portENTER_CRITICAL(&work_lock);
+    if (work_tail) {
+        work_tail->next = work;
+    } else {
+        work_head = work;
     }
+    work_tail = work;
+    portEXIT_CRITICAL(&work_lock);
+
+    xTaskNotifyGive(pipe_task_handle);
 }
 
 
@@ -142,28 +534,12 @@ void xesp_usbh_xfer_init()
         // should PDASSERT...
     }
 
-   irp_counting_xSemaphore = xSemaphoreCreateCounting(XESP_USB_MAX_SIMULTANEOUS_XFERS, XESP_USB_MAX_SIMULTANEOUS_XFERS);
-   if( irp_counting_xSemaphore == NULL ){
-        ESP_LOGE(TAG, "could not create irp counting xSemaphore");
-        // should PDASSERT...
-   }
-
-   irp_enqueue_xSemaphore = xSemaphoreCreateMutex();
-   if( irp_enqueue_xSemaphore == NULL ){
-        ESP_LOGE(TAG, "could not create irp enqueue xSemaphore");
-        // should PDASSERT...
-   }
-
-   irp_freelist_xMutex = xSemaphoreCreateMutex();
-   if( irp_freelist_xMutex == NULL ){
-        ESP_LOGE(TAG, "could not create irp freelist xMutex");
-        // should PDASSERT...
-   }
+   for(int c = 0; c < XESP_USB_NUM_IRP_CLASSES; c++){
+        irp_class_t* cls = &irp_classes[c];
 
-   for(int i = 0; i < XESP_USB_MAX_SIMULTANEOUS_XFERS; i++){
-        irp_xfer_done_xEvents[i] = xEventGroupCreate();
-        if( irp_xfer_done_xEvents[i] == NULL ){
-            ESP_LOGE(TAG, "could not create xfer done xEvent");
+        cls->counting_xSemaphore = xSemaphoreCreateCounting(cls->count, cls->count);
+        if( cls->counting_xSemaphore == NULL ){
+            ESP_LOGE(TAG, "could not create irp counting xSemaphore");
             // should PDASSERT...
         }
    }
@@ -198,30 +574,37 @@ bool xesp_usbh_allocate_irps(){
 
     ESP_LOGI(TAG, "allocating IRPS");
 
-    for (int i = 0; i < XESP_USB_MAX_SIMULTANEOUS_XFERS; i++) {
+    for (int c = 0; c < XESP_USB_NUM_IRP_CLASSES; c++) {
+
+        irp_class_t* cls = &irp_classes[c];
+
+        for (int i = cls->first_idx; i < cls->first_idx + cls->count; i++) {
+
+            // data buffers
+            size_t length = sizeof(usb_ctrl_req_t) + cls->num_bytes;
+            irp_data_buffers[i] = heap_caps_calloc(1, length, MALLOC_CAP_DMA);
+            if(NULL == irp_data_buffers[i]){
+                ESP_LOGE(TAG,"alloc irp data buffer failed. (%u bytes)", length);
+                for (int k = 0; k < i; k++) { // free prev iterations
+                    heap_caps_free(irp_data_buffers[k]); 
+                } 
+                return false;
+            }
 
-        // data buffers
-        size_t length = sizeof(usb_ctrl_req_t) + XESP_USB_MAX_XFER_BYTES;
-        irp_data_buffers[i] = heap_caps_calloc(1, length, MALLOC_CAP_DMA);
-        if(NULL == irp_data_buffers[i]){
-            ESP_LOGE(TAG,"alloc irp data buffer failed.");
-            for (int k = 0; k < i; k++) { // free prev iterations
-                heap_caps_free(irp_data_buffers[k]); 
-            } 
-            return false;
+            //Initialize IRP and IRP list
+            irps[i].irp.data_buffer = irp_data_buffers[i];
+            irps[i].irp.num_iso_packets = 0;
+            irps[i].irp.num_bytes = cls->num_bytes; // worst case
         }
 
-        //Initialize IRP and IRP list
-        irps[i].data_buffer = irp_data_buffers[i];
-        irps[i].num_iso_packets = 0;
-        irps[i].num_bytes = XESP_USB_MAX_XFER_BYTES; // worst case max packet size
-    }
+        // initialize this class's freelist
+        xesp_freelist_init(&cls->freelist, irps_freelist_next);
+        for (int i = cls->first_idx + cls->count - 1; i >= cls->first_idx; i--) {
+            xesp_freelist_push(&cls->freelist, i);
+        }
 
-    // initialize freelist
-    for (int i = 0; i < XESP_USB_MAX_SIMULTANEOUS_XFERS; i++) {
-        irps_freelist[i] = i;
+        ESP_LOGI(TAG, "irp class: %u bytes x %u", cls->num_bytes, cls->count);
     }
-    irps_freelist_count = XESP_USB_MAX_SIMULTANEOUS_XFERS;
 
     return true;
 }
@@ -230,17 +613,58 @@ bool xesp_usbh_allocate_irps(){
 // Endpoints
 //
 
-hcd_pipe_handle_t xesp_usbh_xfer_open_endpoint(hcd_port_handle_t port, uint8_t device_addr, usb_desc_ep_t* ep)
+// reserve the submission state for a new pipe
+static xfer_pipe_t* xfer_pipe_claim()
 {
-    ESP_LOGI(TAG, "open endpoint");
+    portENTER_CRITICAL(&xfer_pipes_lock);
+    xfer_pipe_t* xpipe = xfer_pipes_free;
+    if (xpipe) {
+        xfer_pipes_free = xpipe->next_free;
+    }
+    portEXIT_CRITICAL(&xfer_pipes_lock);
+
+    if (xpipe == NULL) {
+        xpipe = calloc(1, sizeof(xfer_pipe_t));
+        if (xpipe == NULL) {
+            return NULL;
+        }
+        xpipe->enqueue_xMutex = xSemaphoreCreateMutex();
+        if (xpipe->enqueue_xMutex == NULL) {
+            ESP_LOGE(TAG, "could not create pipe enqueue xMutex");
+            free(xpipe);
+            return NULL;
+        }
 
-    // Esspressif doesn't support hubs yet. 
-    // Therefore, getting the speed of a port implicitly determines the speed of the device.
-    usb_speed_t port_speed;
-    if(ESP_OK != hcd_port_get_speed(port, &port_speed)){
-        ESP_LOGE(TAG, "could not get port speed. port: %p", port);
+        portENTER_CRITICAL(&xfer_pipes_lock);
+        xpipe->next_all = xfer_pipes_all;
+        xfer_pipes_all = xpipe;
+        portEXIT_CRITICAL(&xfer_pipes_lock);
     }
 
+    portENTER_CRITICAL(&pipe_events_lock);
+    xpipe->event_pending = false;
+    portEXIT_CRITICAL(&pipe_events_lock);
+    xpipe->closing = false;
+    xpipe->pipe = NULL;
+
+    return xpipe;
+}
+
+static void xfer_pipe_release(xfer_pipe_t* xpipe)
+{
+    portENTER_CRITICAL(&xfer_pipes_lock);
+    xpipe->next_free = xfer_pipes_free;
+    xfer_pipes_free = xpipe;
+    portEXIT_CRITICAL(&xfer_pipes_lock);
+}
+
+hcd_pipe_handle_t xesp_usbh_xfer_open_endpoint(hcd_port_handle_t port, 
+                                               uint8_t device_addr, 
+                                               usb_speed_t dev_speed, 
+                                               usb_desc_ep_t* ep)
+{
+    ESP_LOGI(TAG, "open endpoint");
+
     // control endpoint?
     bool is_control = usb_util_is_control_ep(ep);
 
@@ -250,13 +674,22 @@ hcd_pipe_handle_t xesp_usbh_xfer_open_endpoint(hcd_port_handle_t port, uint8_t d
         usb_util_print_ep(ep);
     }
 
+    xfer_pipe_t* xpipe = xfer_pipe_claim();
+    if (xpipe == NULL) {
+        ESP_LOGE(TAG, "could not alloc pipe state");
+        return NULL;
+    }
+
     hcd_pipe_config_t config = {
         .callback = pipe_isr_callback,
-        .callback_arg = (void *)port,
-        .context = NULL,
+        .callback_arg = (void *)xpipe,
+        .context = xpipe,
         .ep_desc = is_control ? NULL : ep, // null signals ep0 (control)
         .dev_addr = device_addr,
-        .dev_speed = port_speed,
+        .dev_speed = dev_speed,
+        // only used by bulk IN pipes
+        .nak_poll_frames = XESP_USBH_BULK_IN_NAK_POLL_FRAMES,
+        .nak_rearm_frames = XESP_USBH_BULK_IN_NAK_REARM_FRAMES,
     };
 
     hcd_pipe_handle_t pipe = NULL;
@@ -264,13 +697,20 @@ hcd_pipe_handle_t xesp_usbh_xfer_open_endpoint(hcd_port_handle_t port, uint8_t d
 
     if(err != ESP_OK){
         ESP_LOGE(TAG, "cant alloc pipe");
+        xfer_pipe_release(xpipe);
         return NULL;
     }
     if(pipe == NULL) {
         ESP_LOGE(TAG, "pipe is NULL, err: %i", err);
+        xfer_pipe_release(xpipe);
         return NULL;
     }
 
+    xpipe->pipe = pipe;
+    xpipe->is_control = is_control;
+    xpipe->is_in = is_control ? false : (ep->bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_DIR_MASK);
+    xpipe->mps = is_control ? 0 : USB_DESC_EP_GET_MPS(ep);
+
     ESP_LOGI(TAG, "pipe alloc'd %p", pipe);
 
     return pipe;
@@ -278,8 +718,28 @@ hcd_pipe_handle_t xesp_usbh_xfer_open_endpoint(hcd_port_handle_t port, uint8_t d
 
 bool xesp_usbh_xfer_close_endpoint(hcd_pipe_handle_t pipe){
 
-    // prevent additional enqueues
-    xSemaphoreTake(irp_enqueue_xSemaphore, portMAX_DELAY);
+    xfer_pipe_t* xpipe = (xfer_pipe_t*) hcd_pipe_get_ctx(pipe);
+
+    // prevent additional enqueues to this pipe
+    xSemaphoreTake(xpipe->enqueue_xMutex, portMAX_DELAY);
+    xpipe->closing = true;
+
+    // Stop whatever is still queued (e.g. a read waiting on a device that was unplugged
+    // from a hub), since the hcd only frees an empty pipe. Pending irps are retired right away,
+    // an in-flight irp once its channel halts.
+    for (int i = 0; i < XESP_USB_MAX_SIMULTANEOUS_XFERS; i++) {
+        portENTER_CRITICAL(&irp_callbacks_lock);
+        bool on_pipe = irp_callbacks[i].cb && irp_callbacks[i].pipe == pipe;
+        portEXIT_CRITICAL(&irp_callbacks_lock);
+        if (on_pipe) {
+            hcd_irp_abort(&irps[i].irp);
+        }
+    }
+
+    // waits for the halt, and retires anything left.
+    // Fails harmlessly if the device is gone, in which case the hcd already retired them.
+    // The halt still queues a pipe event. The pipe task finds it stale once we are done.
+    hcd_pipe_command(pipe, HCD_PIPE_CMD_ABORT);
 
     //Dequeue transfer requests
     do{
@@ -287,18 +747,26 @@ bool xesp_usbh_xfer_close_endpoint(hcd_pipe_handle_t pipe){
 
         if(irp == NULL) break;
 
-        uint16_t irp_idx = irp - &irps[0];
-        xEventGroupSetBits(irp_xfer_done_xEvents[irp_idx], HCD_PIPE_EVENT_ERROR_IRP_NOT_AVAIL); 
+        // note: runs the callback on the closing thread, not the pipe task
+        xfer_irp_complete(irp, HCD_PIPE_EVENT_ERROR_IRP_NOT_AVAIL);
     }while(1);
 
     //Delete the pipe
     if(ESP_OK != hcd_pipe_free(pipe)) {
         ESP_LOGE(TAG, "err to free pipes");
-        xSemaphoreGive(irp_enqueue_xSemaphore);
+        xpipe->closing = false; // still open
+        xSemaphoreGive(xpipe->enqueue_xMutex);
         return false;
     }
 
-    xSemaphoreGive(irp_enqueue_xSemaphore);
+    // messages still queued for the pipe are stale from now on.
+    // The pipe task only uses a pipe with the mutex held, so it is not using it now.
+    xpipe->pipe = NULL;
+    xpipe->generation++;
+
+    xSemaphoreGive(xpipe->enqueue_xMutex);
+
+    xfer_pipe_release(xpipe);
 
     return true;
 }
@@ -309,115 +777,263 @@ bool xesp_usbh_xfer_close_endpoint(hcd_pipe_handle_t pipe){
 //
 
 
-uint8_t xesp_usbh_xfer_irp_idx(usb_irp_t* irp){
+uint16_t xesp_usbh_xfer_irp_idx(usb_irp_t* irp){
     // determine the index of the irp
-    return irp - &irps[0];
+    return (xfer_irp_slot_t*) irp - irps;
 }
 
 
-// blocks until an irp is available
-usb_irp_t* xesp_usbh_xfer_take_irp(){
-    // counting semaphore - ensures we can only have X simultaneous transfers
-    xSemaphoreTake(irp_counting_xSemaphore, portMAX_DELAY);
+// the smallest class that can hold 'num_bytes', or NULL if none can
+static irp_class_t* irp_class_for_bytes(uint16_t num_bytes){
+    for (int c = 0; c < XESP_USB_NUM_IRP_CLASSES; c++) {
+        if (num_bytes <= irp_classes[c].num_bytes) {
+            return &irp_classes[c];
+        }
+    }
+    return NULL;
+}
+
+// the class that owns this irp
+static irp_class_t* irp_class_of(usb_irp_t* irp){
+    uint16_t idx = xesp_usbh_xfer_irp_idx(irp);
+    for (int c = 0; c < XESP_USB_NUM_IRP_CLASSES; c++) {
+        if (idx < irp_classes[c].first_idx + irp_classes[c].count) {
+            return &irp_classes[c];
+        }
+    }
+    assert(false); // not one of our irps
+    return NULL;
+}
+
+uint16_t xesp_usbh_xfer_irp_capacity(usb_irp_t* irp){
+    return irp_class_of(irp)->num_bytes;
+}
+
+// waits up to 'wait' for an irp to be available
+static usb_irp_t* xfer_take_irp(uint16_t num_bytes, TickType_t wait){
+
+    irp_class_t* cls = irp_class_for_bytes(num_bytes);
+    if (cls == NULL) {
+        ESP_LOGE(TAG, "no irp can hold %u bytes. max: %u", num_bytes, XESP_USB_MAX_XFER_BYTES);
+        return NULL;
+    }
 
-    // at this point, 1 or more irp are available
+    // counting semaphore - ensures we can only have X simultaneous transfers per class
+    if (!xSemaphoreTake(cls->counting_xSemaphore, wait)) {
+        return NULL;
+    }
 
-    // mutex - only 1 thread can be accessing the freelist
-    xSemaphoreTake(irp_freelist_xMutex, portMAX_DELAY);
+    // at this point, 1 or more irp are available, and reserved for us.
+    // so the pop cannot fail.
+    uint16_t idx = 0;
+    bool popped = xesp_freelist_pop(&cls->freelist, &idx);
+    assert(popped);
+    (void) popped;
 
-    uint8_t idx = irps_freelist[irps_freelist_count - 1]; 
-    irps_freelist_count -= 1;
+    //ESP_LOGI(TAG, "took irp %u (idx)", idx);
 
     // make sure these are reset each time
-    usb_irp_t* irp = &irps[idx];
+    usb_irp_t* irp = &irps[idx].irp;
 
-    memset(irp, 0, sizeof(usb_irp_t)); // clear
+    memset(&irps[idx], 0, sizeof(xfer_irp_slot_t)); // clear, with its iso packet descriptors
 
     irp->actual_num_bytes = 0;
-    irp->num_bytes = XESP_USB_MAX_XFER_BYTES; //1 worst case MPS
+    irp->num_bytes = num_bytes;
     irp->data_buffer = irp_data_buffers[idx];
     irp->num_iso_packets = 0;
 
-    memset(irp->data_buffer, 0, XESP_USB_MAX_XFER_BYTES);
-
-    //ESP_LOGI(TAG, "took irp %u (idx). free: %u (count)", idx, irps_freelist_count);
+    // only clear what the caller asked for
+    memset(irp->data_buffer, 0, sizeof(usb_ctrl_req_t) + num_bytes);
 
-    xSemaphoreGive(irp_freelist_xMutex);
     return irp;
 }
 
+// blocks until an irp is available
+usb_irp_t* xesp_usbh_xfer_take_irp(uint16_t num_bytes){
+    return xfer_take_irp(num_bytes, portMAX_DELAY);
+}
+
+usb_irp_t* xesp_usbh_xfer_try_take_irp(uint16_t num_bytes){
+    return xfer_take_irp(num_bytes, 0);
+}
+
 // mark irp as available
 void xesp_usbh_xfer_give_irp(usb_irp_t* irp){
 
-    uint16_t idx = irp - &irps[0];
-
-    //ESP_LOGI(TAG,"returning irp %u", idx);
+    uint16_t idx = xesp_usbh_xfer_irp_idx(irp);
 
-    xSemaphoreTake(irp_freelist_xMutex, portMAX_DELAY); // freelist
+    irp_class_t* cls = irp_class_of(irp);
 
-    irps_freelist_count++;
-    irps_freelist[irps_freelist_count - 1] = idx;
+    //ESP_LOGI(TAG,"returning irp %u", idx);
 
-    //ESP_LOGI(TAG,"returned irp %u (idx). free: %u (count)", idx, irps_freelist_count);
-    xSemaphoreGive(irp_freelist_xMutex); // freelist
+    xesp_freelist_push(&cls->freelist, idx);
 
     // mark an irp as available 
-    xSemaphoreGive(irp_counting_xSemaphore);
+    xSemaphoreGive(cls->counting_xSemaphore);
 }
 
-// transfer
-hcd_pipe_event_t xesp_usbh_xfer_irp(hcd_pipe_handle_t pipe, usb_irp_t* irp){
+// undo the bookkeeping of an irp that failed to enqueue
+static void xfer_irp_forget(uint16_t idx)
+{
+    portENTER_CRITICAL(&irp_callbacks_lock);
+    irp_callbacks[idx] = (irp_callback_t) {0};
+    portEXIT_CRITICAL(&irp_callbacks_lock);
+}
+
+// enqueue an irp. The caller holds the pipe's enqueue_xMutex
+static bool xfer_enqueue_locked(xfer_pipe_t* xpipe, hcd_pipe_handle_t pipe, usb_irp_t* irp, 
+                                xesp_usbh_irp_callback_t* cb, void* ctx){
 
-    // this semaphore makes sure only 1 thread enqueues at a time,
-    // so that we can empty the queue when needed by aquiring this semaphore
-    xSemaphoreTake(irp_enqueue_xSemaphore, portMAX_DELAY);
+    uint16_t idx = xesp_usbh_xfer_irp_idx(irp);
 
-    uint16_t idx = irp - &irps[0];
+    // closed while we waited for the mutex
+    if (xpipe->closing || xpipe->pipe != pipe) {
+        ESP_LOGE(TAG, "xfer irp enqueue error: pipe %p is closed", pipe);
+        return false;
+    }
+
+    // the irp can complete before hcd_irp_enqueue even returns,
+    // so the callback must be in place first
+    portENTER_CRITICAL(&irp_callbacks_lock);
+    irp_callbacks[idx] = (irp_callback_t) {
+        .cb = cb,
+        .ctx = ctx,
+        .pipe = pipe,
+        .xpipe = xpipe,
+        .generation = xpipe->generation,
+        .has_deadline = irp->timeout != 0,
+        .deadline = xTaskGetTickCount() + pdMS_TO_TICKS(irp->timeout),
+        .timed_out = false,
+    };
+    portEXIT_CRITICAL(&irp_callbacks_lock);
 
     // debug
-    //ESP_LOGI(TAG,"enqueued xfer irp %u. waiting.", idx);
-    //usb_util_print_irp(&irps[idx]);
+    //ESP_LOGI(TAG,"enqueued xfer irp %u.", idx);
+    //usb_util_print_irp(irp);
 
     //Enqueue the transfer request
     esp_err_t err;
-    if(ESP_OK != (err = hcd_irp_enqueue(pipe, &irps[idx]))) {
+    if(ESP_OK != (err = hcd_irp_enqueue(pipe, irp))) {
         ESP_LOGE(TAG, "xfer irp enqueue error: %d - %s", err, esp_err_to_name(err));
-        xSemaphoreGive(irp_enqueue_xSemaphore);
+        xfer_irp_forget(idx);
         return false;
     }
 
-    xSemaphoreGive(irp_enqueue_xSemaphore);
+    return true;
+}
 
-    ESP_LOGI(TAG,"enqueued.");
+// enqueue, but dont wait
+bool xesp_usbh_xfer_submit_irp(hcd_pipe_handle_t pipe, usb_irp_t* irp, 
+                               xesp_usbh_irp_callback_t* cb, void* ctx){
 
-    EventBits_t uxBits = 0;
+    xfer_pipe_t* xpipe = (xfer_pipe_t*) hcd_pipe_get_ctx(pipe);
 
-    while(!uxBits) {
-        uxBits = xEventGroupWaitBits(
-                irp_xfer_done_xEvents[idx],   /* The event group being tested. */
-                0x00FFFFFF,           /* The bits within the event group to wait for. */
-                pdTRUE,        /* clear the bits after 'wait' completes */
-                pdFALSE,       /* Wait for all bits? */
-                portMAX_DELAY); 
+    // the pipe is being closed. Fail fast, without waiting on the mutex,
+    // so completion callbacks run by the closing thread can't deadlock.
+    if (xpipe->closing) {
+        ESP_LOGE(TAG, "xfer irp enqueue error: pipe %p is closing", pipe);
+        return false;
+    }
 
-        // ^ portMAX_DELAY is requred for now. 
-        // For some reason if we allow timeouts, then the next time we 
-        // get an event we crash on hcd_irp_dequeue
-        if (!uxBits) { // timeout
-            usb_irp_t *irp2 = hcd_irp_dequeue(pipe);
-            hcd_pipe_state_t pipe_state = hcd_pipe_get_state(pipe);
-            ESP_LOGE(TAG, "xfer timeout irp:%u pipe: %p pipe_state: %s %s", idx,
-                pipe, hcd_pipe_state_str(pipe_state), irp2 ? "IRP Dequeued" : "No more IRPs");
-            return HCD_PIPE_EVENT_ERROR_XFER;
-        }
+    // the packet descriptors live in the irp's slot of the pool
+    if (irp->num_iso_packets > XESP_USB_IRP_ISO_PACKETS) {
+        ESP_LOGE(TAG, "xfer irp enqueue error: %d iso packets. max: %u", irp->num_iso_packets, XESP_USB_IRP_ISO_PACKETS);
+        return false;
+    }
+
+    // this mutex makes sure only 1 thread enqueues to this pipe at a time,
+    // so that we can empty its queue when needed by aquiring this mutex.
+    // other pipes are not affected.
+    xSemaphoreTake(xpipe->enqueue_xMutex, portMAX_DELAY);
+    bool enqueued = xfer_enqueue_locked(xpipe, pipe, irp, cb, ctx);
+    xSemaphoreGive(xpipe->enqueue_xMutex);
+
+    if (!enqueued) {
+        return false;
+    }
+
+    // the pipe task must recompute when it next needs to wake up
+    if (irp->timeout) {
+        xfer_pipe_kick(pipe);
+    }
+
+    return true;
+}
+
+bool xesp_usbh_xfer_cancel_irp(usb_irp_t* irp){
+
+    uint16_t idx = xesp_usbh_xfer_irp_idx(irp);
+
+    portENTER_CRITICAL(&irp_callbacks_lock);
+    xfer_pipe_t* xpipe = irp_callbacks[idx].cb ? irp_callbacks[idx].xpipe : NULL;
+    uint32_t generation = irp_callbacks[idx].generation;
+    portEXIT_CRITICAL(&irp_callbacks_lock);
+
+    // a close racing with us retires the irp itself, and may free its pipe
+    if (xpipe == NULL || xfer_pipe_lock(xpipe, generation) == NULL) {
+        ESP_LOGE(TAG, "cancel irp %u: not submitted", idx);
+        return false;
+    }
+
+    esp_err_t err = hcd_irp_abort(irp);
+    xSemaphoreGive(xpipe->enqueue_xMutex);
+    if (err != ESP_OK) {
+        // it finished and was dequeued already
+        ESP_LOGE(TAG, "cancel irp %u: %s", idx, esp_err_to_name(err));
+        return false;
     }
 
-    hcd_pipe_event_t event = (hcd_pipe_event_t) uxBits;
+    // a pending irp is retired without a pipe event
+    xfer_pipe_kick_xpipe(xpipe);
+
+    return true;
+}
+
+// runs on the pipe event task. wakes up the thread blocked in xesp_usbh_xfer_irp
+static void xfer_irp_blocking_cb(usb_irp_t* irp, hcd_pipe_event_t event, void* ctx){
+    irp_waiter_t* waiter = (irp_waiter_t*) ctx;
+
+    // the waiter can return as soon as 'done' is set, 
+    // taking 'waiter' with it. So read the task first.
+    TaskHandle_t task = waiter->task;
+
+    waiter->event = event;
+    waiter->done = true;
+
+    xTaskNotifyGive(task);
+}
+
+// transfer
+hcd_pipe_event_t xesp_usbh_xfer_irp(hcd_pipe_handle_t pipe, usb_irp_t* irp){
+
+    uint16_t idx = xesp_usbh_xfer_irp_idx(irp);
+
+    irp_waiter_t waiter = {
+        .task = xTaskGetCurrentTaskHandle(),
+        .event = HCD_PIPE_EVENT_NONE,
+        .done = false,
+    };
+
+    if (!xesp_usbh_xfer_submit_irp(pipe, irp, xfer_irp_blocking_cb, &waiter)) {
+        return HCD_PIPE_EVENT_INVALID;
+    }
+
+    ESP_LOGI(TAG,"enqueued.");
+
+    // loop, in case someone else notified this task.
+    // No timeout is needed here: if irp->timeout is set, the pipe task
+    // cancels the irp at its deadline, which completes it.
+    while(!waiter.done) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+
+    hcd_pipe_event_t event = waiter.event;
 
     if (event != HCD_PIPE_EVENT_IRP_DONE){
         hcd_pipe_state_t state = hcd_pipe_get_state(pipe);
-        ESP_LOGE(TAG, "xfer irp:%u pipe: %p pipe_state: %s error %s", idx,
-            pipe, hcd_pipe_state_str(state), hcd_pipe_event_str(event));
+        ESP_LOGE(TAG, "xfer irp:%u pipe: %p pipe_state: %s error %s%s", idx,
+            pipe, hcd_pipe_state_str(state), hcd_pipe_event_str(event),
+            irp->status == USB_TRANSFER_STATUS_TIMED_OUT ? " (timed out)" : "");
     } else {
         ESP_LOGI(TAG, "irp %i xfer done", idx);
     }
@@ -425,3 +1041,578 @@ hcd_pipe_event_t xesp_usbh_xfer_irp(hcd_pipe_handle_t pipe, usb_irp_t* irp){
     return event;
 }
 
+
+
+/////////////////////////////////
+// Streams
+//
+
+// re-arm a stream irp with a fresh read request
+static void stream_irp_reset(xesp_usbh_stream_t* stream, usb_irp_t* irp){
+    irp->num_bytes = stream->num_bytes;
+    irp->actual_num_bytes = 0;
+    irp->num_iso_packets = 0;
+}
+
+// an irp leaves the stream, and goes back to the pool
+static void stream_retire_irp(xesp_usbh_stream_t* stream, usb_irp_t* irp){
+    portENTER_CRITICAL(&stream_lock);
+    // once given back, the irp can be someone else's. stop must not abort it
+    for (int i = 0; i < stream->num_irps; i++) {
+        if (stream->irps[i] == irp) {
+            stream->irps[i] = NULL;
+        }
+    }
+    stream->num_irps_queued--;
+    bool all_retired = (stream->num_irps_queued == 0);
+    portEXIT_CRITICAL(&stream_lock);
+
+    xesp_usbh_xfer_give_irp(irp);
+
+    if (all_retired) {
+        xSemaphoreGive(stream->retired_xSemaphore);
+    }
+}
+
+// runs on the pipe task for every completed stream irp
+static void stream_irp_cb(usb_irp_t* irp, hcd_pipe_event_t event, void* ctx){
+
+    xesp_usbh_stream_t* stream = (xesp_usbh_stream_t*) ctx;
+
+    if (!stream->stopping) {
+        uint16_t length = (event == HCD_PIPE_EVENT_IRP_DONE) ? irp->actual_num_bytes : 0;
+        stream->cb(irp->data_buffer, length, event, stream->ctx);
+    }
+
+    // requeue right away, so the pipe stays primed
+    if (event == HCD_PIPE_EVENT_IRP_DONE && !stream->stopping) {
+
+        stream_irp_reset(stream, irp);
+
+        if (xesp_usbh_xfer_submit_irp(stream->pipe, irp, stream_irp_cb, stream)) {
+            // xesp_usbh_xfer_stream_stop may have run between our 'stopping' check
+            // and the submit. If so, it did not see this irp as enqueued.
+            if (stream->stopping && hcd_irp_abort(irp) == ESP_OK) {
+                xfer_pipe_kick(stream->pipe);
+            }
+            return;
+        }
+
+        ESP_LOGE(TAG, "stream could not requeue irp %u", xesp_usbh_xfer_irp_idx(irp));
+    }
+
+    // errors retire the irp. The user was already told about the error above.
+    if (event != HCD_PIPE_EVENT_IRP_DONE && !stream->stopping) {
+        ESP_LOGE(TAG, "stream irp %u retired: %s", xesp_usbh_xfer_irp_idx(irp), hcd_pipe_event_str(event));
+    }
+
+    stream_retire_irp(stream, irp);
+}
+
+xesp_usbh_stream_t* xesp_usbh_xfer_stream_start(hcd_pipe_handle_t pipe,
+                                                uint8_t num_irps,
+                                                uint16_t num_bytes,
+                                                xesp_usbh_stream_callback_t* cb,
+                                                void* ctx){
+
+    irp_class_t* cls = irp_class_for_bytes(num_bytes);
+    if (num_bytes == 0 || cls == NULL) {
+        ESP_LOGE(TAG, "stream irp size must be 1 to %u bytes, not %u", XESP_USB_MAX_XFER_BYTES, num_bytes);
+        return NULL;
+    }
+
+    // an IN irp ends on any short packet, so one that is not a whole number of
+    // packets either ends every transfer early or overflows (babbles) on the last packet
+    xfer_pipe_t* xpipe = (xfer_pipe_t*) hcd_pipe_get_ctx(pipe);
+    if (xpipe->is_in && xpipe->mps && num_bytes % xpipe->mps != 0) {
+        ESP_LOGE(TAG, "stream irp size %u is not a multiple of wMaxPacketSize %u", num_bytes, xpipe->mps);
+        return NULL;
+    }
+
+    // always leave at least 1 irp of the class for everyone else
+    uint16_t max_irps = cls->count - 1;
+    if (max_irps > XESP_USB_MAX_STREAM_IRPS) {
+        max_irps = XESP_USB_MAX_STREAM_IRPS;
+    }
+
+    if (num_irps == 0 || num_irps > max_irps) {
+        ESP_LOGE(TAG, "stream of %u byte irps needs 1 to %u irps, not %u", num_bytes, max_irps, num_irps);
+        return NULL;
+    }
+
+    xesp_usbh_stream_t* stream = calloc(1, sizeof(xesp_usbh_stream_t));
+    if (stream == NULL) {
+        ESP_LOGE(TAG, "could not allocate stream");
+        return NULL;
+    }
+
+    stream->retired_xSemaphore = xSemaphoreCreateBinary();
+    if (stream->retired_xSemaphore == NULL) {
+        ESP_LOGE(TAG, "could not create stream xSemaphore");
+        free(stream);
+        return NULL;
+    }
+
+    stream->pipe = pipe;
+    stream->cb = cb;
+    stream->ctx = ctx;
+    stream->num_bytes = num_bytes;
+    stream->num_irps = num_irps;
+
+    // take every irp before submitting any, so the callback
+    // never sees a partially built stream
+    for (int i = 0; i < num_irps; i++) {
+        stream->irps[i] = xesp_usbh_xfer_take_irp(num_bytes);
+        stream_irp_reset(stream, stream->irps[i]);
+    }
+
+    stream->num_irps_queued = num_irps;
+
+    for (int i = 0; i < num_irps; i++) {
+        if (!xesp_usbh_xfer_submit_irp(pipe, stream->irps[i], stream_irp_cb, stream)) {
+            ESP_LOGE(TAG, "stream could not enqueue irp %u", i);
+            stream->stopping = true;
+            // retire the irps that never made it to the pipe
+            // note: the pipe task may be retiring the others concurrently
+            for (int k = i; k < num_irps; k++) {
+                stream_retire_irp(stream, stream->irps[k]);
+            }
+            xesp_usbh_xfer_stream_stop(stream);
+            return NULL;
+        }
+    }
+
+    ESP_LOGI(TAG, "stream started. pipe: %p irps: %u bytes: %u", pipe, num_irps, num_bytes);
+
+    return stream;
+}
+
+void xesp_usbh_xfer_stream_stop(xesp_usbh_stream_t* stream){
+
+    stream->stopping = true;
+
+    // cancel every irp the stream still owns. pending ones are retired right away,
+    // in-flight ones once their channel halts.
+    // The lock keeps an irp from being retired, and reused, while we abort it.
+    bool aborted = false;
+    portENTER_CRITICAL(&stream_lock);
+    for (int i = 0; i < stream->num_irps; i++) {
+        if (stream->irps[i] && hcd_irp_abort(stream->irps[i]) == ESP_OK) {
+            aborted = true;
+        }
+    }
+    portEXIT_CRITICAL(&stream_lock);
+
+    // hcd_irp_abort does not generate a pipe event for pending irps
+    if (aborted) {
+        xfer_pipe_kick(stream->pipe);
+    }
+
+    // wait for every irp to be back in the pool.
+    // (if they already are, the semaphore was given when the last one left)
+    xSemaphoreTake(stream->retired_xSemaphore, portMAX_DELAY);
+
+    vSemaphoreDelete(stream->retired_xSemaphore);
+    free(stream);
+
+    ESP_LOGI(TAG, "stream stopped");
+}
+
+
+/////////////////////////////////
+// Scatter-gather
+//
+
+// copy 'length' bytes between 'buf' and the iov, starting at (seg, offset)
+static void iov_copy(xfer_iov_t* x, uint8_t seg, uint16_t offset, 
+                     uint8_t* buf, uint16_t length, bool to_iov)
+{
+    while (length) {
+        const xesp_usbh_iovec_t* v = &x->iov[seg];
+        uint16_t n = v->length - offset;
+        if (n > length) {
+            n = length;
+        }
+        if (to_iov) {
+            memcpy(v->data + offset, buf, n);
+        } else {
+            memcpy(buf, v->data + offset, n);
+        }
+        buf += n;
+        length -= n;
+        seg++;
+        offset = 0;
+    }
+}
+
+// hand the next part of the transfer to 'piece'. 
+// returns false if there is nothing left to send
+static bool iov_piece_next(xfer_iov_t* x, iov_piece_t* piece)
+{
+    bool got = false;
+
+    portENTER_CRITICAL(&iov_lock);
+
+    if (x->finished) {
+        // nothing
+    } else if (x->bytes_left) {
+        uint16_t length = x->bytes_left < x->piece_max ? x->bytes_left : x->piece_max;
+
+        piece->seg = x->next_seg;
+        piece->offset = x->next_offset;
+        piece->length = length;
+
+        // advance the cursor, across as many buffers as needed
+        x->bytes_left -= length;
+        while (length) {
+            uint16_t n = x->iov[x->next_seg].length - x->next_offset;
+            if (n > length) {
+                x->next_offset += length;
+                break;
+            }
+            length -= n;
+            x->next_seg++;
+            x->next_offset = 0;
+        }
+        got = true;
+    } else if (x->zlp_pending) {
+        x->zlp_pending = false;
+        piece->seg = x->next_seg;
+        piece->offset = 0;
+        piece->length = 0;
+        got = true;
+    }
+
+    portEXIT_CRITICAL(&iov_lock);
+
+    return got;
+}
+
+// get the piece's irp ready to be submitted
+static void iov_piece_fill(xfer_iov_t* x, iov_piece_t* piece)
+{
+    usb_irp_t* irp = piece->irp;
+
+    irp->actual_num_bytes = 0;
+
+    if (x->is_in) {
+        // IN irps must be whole packets. piece_max is, so this still fits.
+        irp->num_bytes = ((piece->length + x->mps - 1) / x->mps) * x->mps;
+    } else {
+        irp->num_bytes = piece->length;
+        iov_copy(x, piece->seg, piece->offset, irp->data_buffer, piece->length, false);
+    }
+}
+
+// give the piece's irp back. The last one out reports the transfer.
+static void iov_piece_retire(xfer_iov_t* x, iov_piece_t* piece)
+{
+    xesp_usbh_xfer_give_irp(piece->irp);
+
+    portENTER_CRITICAL(&iov_lock);
+    piece->irp = NULL;
+    x->num_irps--;
+    bool last = x->num_irps == 0;
+    portEXIT_CRITICAL(&iov_lock);
+
+    if (last) {
+        x->cb(x->actual_num_bytes, x->event, x->ctx);
+        free(x);
+    }
+}
+
+// stop queuing pieces, and cancel the ones that are queued (except 'self')
+static void iov_finish(xfer_iov_t* x, iov_piece_t* self, hcd_pipe_event_t event)
+{
+    portENTER_CRITICAL(&iov_lock);
+    x->finished = true;
+    if (x->event == HCD_PIPE_EVENT_IRP_DONE) {
+        x->event = event;
+    }
+    portEXIT_CRITICAL(&iov_lock);
+
+    // only the pipe task (or a closing thread) retires pieces, 
+    // and we are that thread, so the irps stay put while we do this
+    bool aborted = false;
+    for (int i = 0; i < XESP_USB_MAX_IOV_IRPS; i++) {
+        iov_piece_t* piece = &x->pieces[i];
+        if (piece != self && piece->irp && hcd_irp_abort(piece->irp) == ESP_OK) {
+            aborted = true;
+        }
+    }
+
+    // pending irps are retired without a pipe event
+    if (aborted) {
+        xfer_pipe_kick(x->pipe);
+    }
+}
+
+static void iov_irp_cb(usb_irp_t* irp, hcd_pipe_event_t event, void* ctx);
+
+// queue more pieces, on irps that came free since the transfer started, up to the max.
+// runs on the pipe event task, right after a piece was requeued (so 'x' is still alive)
+static void iov_grow(xfer_iov_t* x)
+{
+    while (true) {
+        iov_piece_t* piece = NULL;
+
+        portENTER_CRITICAL(&iov_lock);
+        for (int i = 0; i < x->max_irps; i++) {
+            if (x->pieces[i].irp == NULL) {
+                piece = &x->pieces[i];
+                break;
+            }
+        }
+        portEXIT_CRITICAL(&iov_lock);
+
+        if (piece == NULL) {
+            return;
+        }
+
+        // never wait, this is the task that gives irps back
+        usb_irp_t* irp = xesp_usbh_xfer_try_take_irp(XESP_USB_IOV_IRP_BYTES);
+        if (irp == NULL) {
+            return;
+        }
+
+        if (!iov_piece_next(x, piece)) {
+            xesp_usbh_xfer_give_irp(irp);
+            return;
+        }
+
+        portENTER_CRITICAL(&iov_lock);
+        piece->xfer = x;
+        piece->irp = irp;
+        x->num_irps++;
+        portEXIT_CRITICAL(&iov_lock);
+
+        iov_piece_fill(x, piece);
+        if (!xesp_usbh_xfer_submit_irp(x->pipe, irp, iov_irp_cb, piece)) {
+            ESP_LOGE(TAG, "iov: could not submit irp %u", xesp_usbh_xfer_irp_idx(irp));
+            iov_finish(x, piece, HCD_PIPE_EVENT_INVALID);
+            iov_piece_retire(x, piece);
+            return;
+        }
+    }
+}
+
+// runs on the pipe event task. irps of a pipe complete in order.
+static void iov_irp_cb(usb_irp_t* irp, hcd_pipe_event_t event, void* ctx)
+{
+    iov_piece_t* piece = (iov_piece_t*) ctx;
+    xfer_iov_t* x = piece->xfer;
+
+    portENTER_CRITICAL(&iov_lock);
+    bool finished = x->finished;
+    portEXIT_CRITICAL(&iov_lock);
+
+    // once finished, later pieces dont count (they were cancelled, or raced the cancel)
+    if (!finished) {
+        if (event == HCD_PIPE_EVENT_IRP_DONE) {
+
+            uint16_t n = irp->actual_num_bytes < piece->length ? irp->actual_num_bytes : piece->length;
+
+            if (x->is_in) {
+                iov_copy(x, piece->seg, piece->offset, irp->data_buffer, n, true);
+            }
+
+            portENTER_CRITICAL(&iov_lock);
+            x->actual_num_bytes += n;
+            portEXIT_CRITICAL(&iov_lock);
+
+            // a short packet ends an IN transfer early. 
+            // Nothing is queued behind it, see max_irps
+            if (x->is_in && irp->actual_num_bytes < irp->num_bytes) {
+                iov_finish(x, piece, HCD_PIPE_EVENT_IRP_DONE);
+            }
+        } else {
+            iov_finish(x, piece, event);
+        }
+    }
+
+    // reuse the irp for the next piece, if any
+    if (event == HCD_PIPE_EVENT_IRP_DONE && iov_piece_next(x, piece)) {
+        iov_piece_fill(x, piece);
+        if (xesp_usbh_xfer_submit_irp(x->pipe, irp, iov_irp_cb, piece)) {
+            iov_grow(x);
+            return;
+        }
+        ESP_LOGE(TAG, "iov: could not resubmit irp %u", xesp_usbh_xfer_irp_idx(irp));
+        iov_finish(x, piece, HCD_PIPE_EVENT_INVALID);
+    }
+
+    iov_piece_retire(x, piece);
+}
+
+bool xesp_usbh_xfer_submit_iov(hcd_pipe_handle_t pipe, 
+                               const xesp_usbh_iovec_t* iov, 
+                               uint8_t iov_count,
+                               xesp_usbh_iov_callback_t* cb, 
+                               void* ctx){
+
+    xfer_pipe_t* xpipe = (xfer_pipe_t*) hcd_pipe_get_ctx(pipe);
+
+    if (xpipe->is_control || xpipe->mps == 0) {
+        ESP_LOGE(TAG, "iov: pipe %p is not a bulk pipe", pipe);
+        return false;
+    }
+
+    uint16_t piece_max = (XESP_USB_IOV_IRP_BYTES / xpipe->mps) * xpipe->mps;
+    if (piece_max == 0) {
+        ESP_LOGE(TAG, "iov: wMaxPacketSize %u is bigger than an irp", xpipe->mps);
+        return false;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < iov_count; i++) {
+        total += iov[i].length;
+    }
+
+    xfer_iov_t* x = calloc(1, sizeof(xfer_iov_t));
+    if (x == NULL) {
+        ESP_LOGE(TAG, "iov: alloc failed");
+        return false;
+    }
+
+    x->pipe = pipe;
+    x->is_in = xpipe->is_in;
+    x->mps = xpipe->mps;
+    x->piece_max = piece_max;
+    // the irps after a short packet would already be getting the device's next
+    // transfer (the hcd restarts them before the cancel can get to them), 
+    // so IN transfers keep a single irp queued. It still carries piece_max bytes.
+    x->max_irps = x->is_in ? 1 : XESP_USB_MAX_IOV_IRPS;
+    x->iov = iov;
+    x->iov_count = iov_count;
+    x->cb = cb;
+    x->ctx = ctx;
+    x->bytes_left = total;
+    x->event = HCD_PIPE_EVENT_IRP_DONE;
+
+    // the device cant tell an OUT transfer that ends on a full packet has ended.
+    // so terminate it with a zero length packet. (a zero length transfer is just that)
+    x->zlp_pending = !x->is_in && (total % x->mps) == 0;
+
+    // take and fill an irp per piece, up to the max, as many as are free.
+    // Never wait for one while holding others: another transfer or a stream 
+    // could be waiting for ours. Only the first is waited for, and not on the 
+    // pipe event task, which is what gives irps back. Completions add the rest.
+    // (all of them before submitting any, the first can complete right away)
+    bool on_pipe_task = xTaskGetCurrentTaskHandle() == pipe_task_handle;
+    uint8_t num_irps = 0;
+    while (num_irps < x->max_irps) {
+        usb_irp_t* irp = (num_irps == 0 && !on_pipe_task) ? 
+            xesp_usbh_xfer_take_irp(XESP_USB_IOV_IRP_BYTES) : 
+            xesp_usbh_xfer_try_take_irp(XESP_USB_IOV_IRP_BYTES);
+        if (irp == NULL) {
+            break;
+        }
+        iov_piece_t* piece = &x->pieces[num_irps];
+        if (!iov_piece_next(x, piece)) {
+            xesp_usbh_xfer_give_irp(irp);
+            break;
+        }
+        piece->xfer = x;
+        piece->irp = irp;
+        iov_piece_fill(x, piece);
+        num_irps++;
+    }
+
+    if (num_irps == 0) {
+        if (x->bytes_left || x->zlp_pending) {
+            ESP_LOGE(TAG, "iov: no irp available");
+        } else {
+            ESP_LOGE(TAG, "iov: nothing to read");
+        }
+        free(x);
+        return false;
+    }
+
+    x->num_irps = num_irps;
+
+    ESP_LOGI(TAG, "iov: pipe %p %u bytes, %u irps of %u bytes", pipe, total, num_irps, piece_max);
+
+    // queue every piece before a completion can refill one (a refill takes the
+    // same mutex), so the pieces go out in order
+    uint8_t submitted = 0;
+    if (!xpipe->closing) {
+        xSemaphoreTake(xpipe->enqueue_xMutex, portMAX_DELAY);
+        while (submitted < num_irps && 
+               xfer_enqueue_locked(xpipe, pipe, x->pieces[submitted].irp, iov_irp_cb, &x->pieces[submitted])) {
+            submitted++;
+        }
+        xSemaphoreGive(xpipe->enqueue_xMutex);
+    }
+
+    if (submitted == 0) {
+        // nothing was submitted. 'cb' is never called
+        ESP_LOGE(TAG, "iov: pipe %p is closed", pipe);
+        for (int k = 0; k < num_irps; k++) {
+            xesp_usbh_xfer_give_irp(x->pieces[k].irp);
+        }
+        free(x);
+        return false;
+    }
+
+    if (submitted < num_irps) {
+        // the pipe is closing. The irps already submitted are drained 
+        // by the close, and the last one out reports the error.
+        portENTER_CRITICAL(&iov_lock);
+        x->finished = true;
+        x->event = HCD_PIPE_EVENT_INVALID;
+        portEXIT_CRITICAL(&iov_lock);
+
+        for (int k = submitted; k < num_irps; k++) {
+            iov_piece_retire(x, &x->pieces[k]);
+        }
+    }
+
+    return true;
+}
+
+// runs on the pipe event task. wakes up the thread blocked in xesp_usbh_xfer_iov
+static void xfer_iov_blocking_cb(size_t actual_num_bytes, hcd_pipe_event_t event, void* ctx){
+    irp_waiter_t* waiter = (irp_waiter_t*) ctx;
+
+    // read the task first, see xfer_irp_blocking_cb
+    TaskHandle_t task = waiter->task;
+
+    waiter->actual_num_bytes = actual_num_bytes;
+    waiter->event = event;
+    waiter->done = true;
+
+    xTaskNotifyGive(task);
+}
+
+hcd_pipe_event_t xesp_usbh_xfer_iov(hcd_pipe_handle_t pipe, 
+                                    const xesp_usbh_iovec_t* iov, 
+                                    uint8_t iov_count,
+                                    size_t* actual_num_bytes){
+
+    irp_waiter_t waiter = {
+        .task = xTaskGetCurrentTaskHandle(),
+        .event = HCD_PIPE_EVENT_NONE,
+        .actual_num_bytes = 0,
+        .done = false,
+    };
+
+    if (!xesp_usbh_xfer_submit_iov(pipe, iov, iov_count, xfer_iov_blocking_cb, &waiter)) {
+        return HCD_PIPE_EVENT_INVALID;
+    }
+
+    // loop, in case someone else notified this task
+    while(!waiter.done) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+
+    if (actual_num_bytes) {
+        *actual_num_bytes = waiter.actual_num_bytes;
+    }
+
+    if (waiter.event != HCD_PIPE_EVENT_IRP_DONE){
+        ESP_LOGE(TAG, "iov xfer pipe: %p error %s after %u bytes", 
+            pipe, hcd_pipe_event_str(waiter.event), waiter.actual_num_bytes);
+    }
+
+    return waiter.event;
+}
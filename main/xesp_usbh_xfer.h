@@ -31,26 +31,126 @@ void xesp_usbh_xfer_deinit();
 // Endpoints
 //
 
-// open an endpoint
-hcd_pipe_handle_t xesp_usbh_xfer_open_endpoint(hcd_port_handle_t port, uint8_t device_addr, usb_desc_ep_t* ep);
+// open an endpoint. 'dev_speed' is the speed of the device, which is 
+// not the port speed when a low speed device sits behind a full speed hub.
+hcd_pipe_handle_t xesp_usbh_xfer_open_endpoint(hcd_port_handle_t port, 
+                                               uint8_t device_addr, 
+                                               usb_speed_t dev_speed, 
+                                               usb_desc_ep_t* ep);
 
 // close an endpoint
 bool xesp_usbh_xfer_close_endpoint(hcd_pipe_handle_t pipe);
 
 
+/////////////////////////////////
+// Pipe task
+//
+
+typedef void xesp_usbh_xfer_work_fn_t(void* arg);
+
+// a call to make on the pipe event task
+struct xesp_usbh_xfer_work_t{
+    xesp_usbh_xfer_work_fn_t* fn;
+    void* arg;
+    struct xesp_usbh_xfer_work_t* next; // while queued
+};
+
+typedef struct xesp_usbh_xfer_work_t xesp_usbh_xfer_work_t;
+
+// call work->fn(work->arg) from the pipe event task, like a completion callback.
+// Never blocks, so it can be used from an esp_timer callback, which must
+// not hold up the esp_timer task that every timer shares.
+// 'work' must stay valid until the call, and can only be queued once at a time.
+void xesp_usbh_xfer_run_on_pipe_task(xesp_usbh_xfer_work_t* work);
+
+
 /////////////////////////////////
 // IRPs
 //
 
-// blocks until an irp is available
-usb_irp_t* xesp_usbh_xfer_take_irp();
+// blocks until an irp that can hold 'num_bytes' of data is available.
+// The irp comes from the smallest size class that fits.
+// returns NULL if 'num_bytes' is larger than XESP_USB_MAX_XFER_BYTES
+// It has room for XESP_USB_IRP_ISO_PACKETS irp->iso_packet_desc entries.
+usb_irp_t* xesp_usbh_xfer_take_irp(uint16_t num_bytes);
+
+// like xesp_usbh_xfer_take_irp, but returns NULL right away if none is available.
+// For the pipe event task, which must never wait for an irp: it is what gives them back.
+usb_irp_t* xesp_usbh_xfer_try_take_irp(uint16_t num_bytes);
+
+// the most data bytes this irp can hold
+uint16_t xesp_usbh_xfer_irp_capacity(usb_irp_t* irp);
 
 // mark irp as available
 void xesp_usbh_xfer_give_irp(usb_irp_t*);
 
+// enqueue the irp and return immediately. 'cb' is called from the pipe 
+// event task once the irp completes. returns false if the irp could not 
+// be enqueued, in which case 'cb' is never called.
+// If irp->timeout (ms) is set, the irp is cancelled once it has been
+// queued that long. It then completes with HCD_PIPE_EVENT_ERROR_XFER, 
+// and irp->status is USB_TRANSFER_STATUS_TIMED_OUT.
+bool xesp_usbh_xfer_submit_irp(hcd_pipe_handle_t pipe, usb_irp_t* irp, 
+                               xesp_usbh_irp_callback_t* cb, void* ctx);
+
+// cancel a submitted irp. Does not block. The irp still completes as usual
+// (with HCD_PIPE_EVENT_ERROR_IRP_NOT_AVAIL, status USB_TRANSFER_STATUS_CANCELLED), 
+// unless it finished first. An in-flight irp is stopped by halting its channel.
+// returns false if the irp is not submitted.
+bool xesp_usbh_xfer_cancel_irp(usb_irp_t* irp);
+
 // blocks until the irp is completed. return HCD_PIPE_EVENT_IRP_DONE on success
+// (wrapper around xesp_usbh_xfer_submit_irp)
+// The calling task is woken with a task notification, so dont call this
+// from a task that uses its notification value for something else.
 hcd_pipe_event_t  xesp_usbh_xfer_irp(hcd_pipe_handle_t pipe, usb_irp_t* irp);
 
 // for logging
-uint8_t xesp_usbh_xfer_irp_idx(usb_irp_t*);
+uint16_t xesp_usbh_xfer_irp_idx(usb_irp_t*);
+
+/////////////////////////////////
+// Streams
+//
+
+// take 'num_irps' irps and keep them all queued on an IN pipe, 
+// so the controller moves straight on to the next irp when one completes.
+// 'cb' runs from the pipe event task for every completed irp.
+// On an IN pipe, 'num_bytes' must be a multiple of the endpoint's wMaxPacketSize.
+// returns NULL on failure.
+xesp_usbh_stream_t* xesp_usbh_xfer_stream_start(hcd_pipe_handle_t pipe,
+                                                uint8_t num_irps,
+                                                uint16_t num_bytes,
+                                                xesp_usbh_stream_callback_t* cb,
+                                                void* ctx);
+
+// stop requeuing, and block until every irp of the stream is back in the pool. 
+// In-flight irps are cancelled too.
+void xesp_usbh_xfer_stream_stop(xesp_usbh_stream_t* stream);
+
+
+/////////////////////////////////
+// Scatter-gather
+//
 
+// transfer any number of bytes, spread across 'iov_count' buffers, on a bulk pipe.
+// The transfer is split into wMaxPacketSize aligned irps, and 'cb' runs once, 
+// from the pipe event task, when all are done.
+// OUT transfers queue several irps back to back, as many as are free, up to a max.
+// They end on a zero length packet if their last packet is a full one.
+// IN transfers keep a single irp queued, so that nothing is read past a short 
+// packet, which ends the transfer early.
+// Can be called from the pipe event task: it then only takes irps that are free.
+// 'iov' and its buffers must stay valid until 'cb' runs.
+// returns false if nothing could be submitted ('cb' will not run).
+bool xesp_usbh_xfer_submit_iov(hcd_pipe_handle_t pipe, 
+                               const xesp_usbh_iovec_t* iov, 
+                               uint8_t iov_count,
+                               xesp_usbh_iov_callback_t* cb, 
+                               void* ctx);
+
+// blocks until the whole transfer is done. return HCD_PIPE_EVENT_IRP_DONE on success
+// 'actual_num_bytes' can be NULL
+hcd_pipe_event_t xesp_usbh_xfer_iov(hcd_pipe_handle_t pipe, 
+                                    const xesp_usbh_iovec_t* iov, 
+                                    uint8_t iov_count,
+                                    size_t* actual_num_bytes);